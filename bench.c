@@ -0,0 +1,836 @@
+// In-process benchmark for the LOH compressor and decompressor.
+// Unlike bench.py, this doesn't time whole processes or need any data files; it generates its own corpora
+//  (one per category from the README's comparison table) from a fixed seed, so numbers are reproducible offline.
+// Build like loh.c: cc -O3 bench.c -o bench (add -DTHREADED -lpthread to also measure the threaded functions)
+// Output is CSV on stdout, one row per corpus/function/thread count.
+// With -k, it instead times each of the hot loops on its own (see bench_kernels), with hardware counters on Linux.
+// With -j, it instead traces one threaded compress and decompress of the text corpus (see bench_trace).
+
+#define _POSIX_C_SOURCE 199309L
+#ifdef __linux__
+// for syscall
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef THREADED
+#include "loh_impl.h"
+#else
+#include "loh_impl_threaded.h"
+#endif
+
+static double bench_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1000000000.0;
+}
+
+// xorshift64*, so corpora come out the same everywhere
+static uint64_t bench_rand_state = 0x9E3779B97F4A7C15;
+static uint32_t bench_rand(void)
+{
+    bench_rand_state ^= bench_rand_state >> 12;
+    bench_rand_state ^= bench_rand_state << 25;
+    bench_rand_state ^= bench_rand_state >> 27;
+    return (uint32_t)((bench_rand_state * 0x2545F4914F6CDD1D) >> 32);
+}
+
+static void gen_zeros(uint8_t * data, size_t len)
+{
+    memset(data, 0, len);
+}
+
+static void gen_noise(uint8_t * data, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+        data[i] = bench_rand();
+}
+
+// words drawn from a skewed distribution over a fixed vocabulary, with punctuation and line breaks
+static void gen_text(uint8_t * data, size_t len)
+{
+    static const char * words[] = {
+        "the", "of", "and", "a", "to", "in", "that", "his", "it", "i", "but", "he", "with", "as", "is", "was",
+        "for", "all", "this", "at", "by", "not", "from", "so", "on", "whale", "one", "you", "had", "have", "there", "or",
+        "were", "now", "which", "me", "like", "upon", "ship", "sea", "old", "into", "some", "when", "more", "what", "ahab", "would",
+        "boat", "captain", "through", "though", "head", "long", "still", "great", "white", "these", "yet", "man", "time", "over",
+    };
+    size_t word_count = sizeof(words) / sizeof(words[0]);
+    size_t i = 0;
+    size_t line = 0;
+    int capital = 1;
+    while (i < len)
+    {
+        // min of two draws skews towards common words
+        uint32_t a = bench_rand() % word_count;
+        uint32_t b = bench_rand() % word_count;
+        const char * word = words[a < b ? a : b];
+        for (size_t j = 0; word[j] && i < len; j++, line++)
+            data[i++] = (capital && j == 0) ? word[j] - 'a' + 'A' : word[j];
+        capital = 0;
+
+        uint32_t r = bench_rand() % 32;
+        if (r == 0 && i < len)
+        {
+            data[i++] = '.';
+            capital = 1;
+        }
+        else if (r < 3 && i < len)
+            data[i++] = ',';
+
+        if (i < len)
+            data[i++] = line > 70 ? '\n' : ' ';
+        if (line > 70)
+            line = 0;
+    }
+}
+
+// 16-bit stereo, a couple of drifting tones plus a little noise
+static void gen_pcm(uint8_t * data, size_t len)
+{
+    double phase_a = 0.0;
+    double phase_b = 0.0;
+    for (size_t i = 0; i + 4 <= len; i += 4)
+    {
+        size_t t = i / 4;
+        phase_a += 0.031 + 0.01 * ((t >> 14) & 3);
+        phase_b += 0.0047;
+        // cheap sine approximation, good enough for a smooth waveform
+        double xa = phase_a - (double)(int64_t)(phase_a / 6.283185307) * 6.283185307 - 3.14159265;
+        double xb = phase_b - (double)(int64_t)(phase_b / 6.283185307) * 6.283185307 - 3.14159265;
+        double sa = xa * (1.2732395 - 0.4052847 * (xa < 0 ? -xa : xa));
+        double sb = xb * (1.2732395 - 0.4052847 * (xb < 0 ? -xb : xb));
+        int32_t noise = (int32_t)(bench_rand() % 257) - 128;
+        int16_t left = (int16_t)(sa * 9000.0 + sb * 4000.0 + noise);
+        int16_t right = (int16_t)(sa * 6000.0 - sb * 5000.0 + noise);
+        data[i + 0] = (uint16_t)left & 0xFF;
+        data[i + 1] = (uint16_t)left >> 8;
+        data[i + 2] = (uint16_t)right & 0xFF;
+        data[i + 3] = (uint16_t)right >> 8;
+    }
+    for (size_t i = len & ~(size_t)3; i < len; i++)
+        data[i] = 0;
+}
+
+// 24-bit RGB image, 1024 pixels wide, made of gradients with some sensor-style noise
+static const uint32_t gen_rgb_width = 1024;
+static void gen_rgb(uint8_t * data, size_t len)
+{
+    uint32_t stride = gen_rgb_width * 3;
+    for (size_t i = 0; i < len; i++)
+    {
+        size_t y = i / stride;
+        size_t x = (i % stride) / 3;
+        size_t c = i % 3;
+        uint32_t v = 0;
+        if (c == 0)
+            v = x / 4 + y / 8;
+        else if (c == 1)
+            v = y / 3 + ((x / 64) & 1) * 40;
+        else
+            v = (x + y) / 6;
+        data[i] = (uint8_t)(v + (bench_rand() % 5));
+    }
+}
+
+// machine-code-ish: short instructions from a small set, with small immediates and relative offsets,
+//  plus zero padding and string tables
+static void gen_exe(uint8_t * data, size_t len)
+{
+    static const uint8_t ops[][4] = {
+        {0x48, 0x89, 0xC7, 3}, {0x48, 0x8B, 0x45, 3}, {0xE8, 0, 0, 1}, {0x0F, 0x84, 0, 2}, {0x85, 0xC0, 0, 2},
+        {0x5D, 0, 0, 1}, {0xC3, 0, 0, 1}, {0x55, 0, 0, 1}, {0x48, 0x83, 0xEC, 3}, {0x31, 0xC0, 0, 2},
+    };
+    static const char * strings[] = {"GetProcAddress", "LoadLibraryA", "malloc", "free", "error: %s\n", ".text", "memcpy", "vector::_M_realloc_insert"};
+    size_t op_count = sizeof(ops) / sizeof(ops[0]);
+    size_t i = 0;
+    while (i < len)
+    {
+        uint32_t section = bench_rand() % 16;
+        size_t run = 256 + bench_rand() % 4096;
+        for (size_t n = 0; n < run && i < len; n++)
+        {
+            if (section == 0)
+                data[i++] = 0;
+            else if (section == 1)
+            {
+                const char * s = strings[bench_rand() % 8];
+                for (size_t j = 0; s[j] && i < len; j++)
+                    data[i++] = s[j];
+                if (i < len)
+                    data[i++] = 0;
+            }
+            else
+            {
+                const uint8_t * op = ops[bench_rand() % op_count];
+                for (uint8_t j = 0; j < op[3] && i < len; j++)
+                    data[i++] = op[j];
+                // immediates/offsets are usually small
+                if (op[0] == 0xE8 || op[1] == 0x84 || op[2] == 0x45 || op[2] == 0xEC)
+                {
+                    uint32_t imm = bench_rand() % (op[0] == 0xE8 ? 65536 : 256);
+                    uint8_t imm_len = op[0] == 0xE8 || op[1] == 0x84 ? 4 : 1;
+                    for (uint8_t j = 0; j < imm_len && i < len; j++)
+                        data[i++] = (imm >> (j * 8)) & 0xFF;
+                }
+            }
+        }
+    }
+}
+
+typedef struct {
+    const char * name;
+    void (*gen)(uint8_t * data, size_t len);
+    uint8_t image_bpp;
+    uint32_t image_stride;
+} bench_corpus;
+
+typedef struct {
+    size_t out_len;
+    double compress_time;
+    double decompress_time;
+} bench_result;
+
+// runs compression and decompression `runs` times each, keeping the fastest time
+// threads == 0 means the non-threaded functions
+// returns 0 if the data didn't round trip
+static int bench_run(const uint8_t * data, size_t len, const loh_params * params, uint16_t threads, int runs, bench_result * result)
+{
+    uint8_t * work = (uint8_t *)malloc(len ? len : 1);
+    result->compress_time = 1e30;
+    result->decompress_time = 1e30;
+    int ok = 1;
+    for (int r = 0; r < runs && ok; r++)
+    {
+        // the compressor modifies its input, so it gets a fresh copy every run
+        memcpy(work, data, len);
+
+        size_t comp_len = 0;
+        double start = bench_now();
+#ifdef THREADED
+        uint8_t * comp = threads ? loh_compress_threaded_ex(work, len, params, &comp_len, threads) : loh_compress_ex(work, len, params, &comp_len);
+#else
+        uint8_t * comp = loh_compress_ex(work, len, params, &comp_len);
+        (void)threads;
+#endif
+        double mid = bench_now();
+
+        size_t dec_len = 0;
+#ifdef THREADED
+        uint8_t * dec = threads ? loh_decompress_threaded(comp, comp_len, &dec_len, 1) : loh_decompress(comp, comp_len, &dec_len, 1);
+#else
+        uint8_t * dec = loh_decompress(comp, comp_len, &dec_len, 1);
+#endif
+        double end = bench_now();
+
+        ok = comp && dec && dec_len == len && memcmp(dec, data, len) == 0;
+
+        if (mid - start < result->compress_time)
+            result->compress_time = mid - start;
+        if (end - mid < result->decompress_time)
+            result->decompress_time = end - mid;
+        result->out_len = comp_len;
+
+        LOH_FREE(comp);
+        LOH_FREE(dec);
+    }
+    free(work);
+    return ok;
+}
+
+static void bench_print(const char * corpus, const char * function, uint16_t threads, const loh_params * params, size_t len, const bench_result * result, double base_compress_time, double base_decompress_time)
+{
+    double mb = (double)len / 1000000.0;
+    printf("%s,%s,%d,%d,%d,%zu,%zu,%.4f,%.2f,%.2f,%.3f,%.3f\n",
+        corpus, function, threads ? threads : 1, params->do_lookback, params->do_huff,
+        len, result->out_len, (double)result->out_len / (double)len,
+        mb / result->compress_time, mb / result->decompress_time,
+        base_compress_time / result->compress_time, base_decompress_time / result->decompress_time);
+    fflush(stdout);
+}
+
+// hardware counters for the kernel benchmarks, through perf_event_open
+// any that can't be opened (not Linux, no permission, running in a VM without a PMU...) just read as missing
+#define BENCH_COUNTERS 4
+static const char * bench_counter_names[BENCH_COUNTERS] = {"cycles", "instructions", "branch_misses", "cache_misses"};
+
+typedef struct {
+    int fds[BENCH_COUNTERS];
+} bench_counters;
+
+static void bench_counters_open(bench_counters * counters)
+{
+    for (size_t n = 0; n < BENCH_COUNTERS; n++)
+        counters->fds[n] = -1;
+#ifdef __linux__
+    static const uint64_t configs[BENCH_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES,
+    };
+    for (size_t n = 0; n < BENCH_COUNTERS; n++)
+    {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[n];
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        counters->fds[n] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+#endif
+}
+
+static void bench_counters_close(bench_counters * counters)
+{
+#ifdef __linux__
+    for (size_t n = 0; n < BENCH_COUNTERS; n++)
+    {
+        if (counters->fds[n] >= 0)
+            close(counters->fds[n]);
+    }
+#else
+    (void)counters;
+#endif
+}
+
+static void bench_counters_start(bench_counters * counters)
+{
+#ifdef __linux__
+    for (size_t n = 0; n < BENCH_COUNTERS; n++)
+    {
+        if (counters->fds[n] >= 0)
+        {
+            ioctl(counters->fds[n], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[n], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)counters;
+#endif
+}
+
+// values of counters that aren't there are set to -1
+static void bench_counters_stop(bench_counters * counters, int64_t * values)
+{
+    for (size_t n = 0; n < BENCH_COUNTERS; n++)
+    {
+        values[n] = -1;
+#ifdef __linux__
+        uint64_t value = 0;
+        if (counters->fds[n] >= 0)
+        {
+            ioctl(counters->fds[n], PERF_EVENT_IOC_DISABLE, 0);
+            if (read(counters->fds[n], &value, sizeof(value)) == (ssize_t)sizeof(value))
+                values[n] = (int64_t)value;
+        }
+#endif
+    }
+}
+
+// everything the kernels work on, set up once before any of them are timed
+typedef struct {
+    uint8_t * text;
+    uint8_t * rgb;
+    size_t len;
+    uint32_t rgb_stride;
+    // the text's lookback stage output, what the entropy coders normally get
+    loh_byte_buffer lookback;
+    loh_bit_buffer huff;
+    loh_bit_buffer ans;
+    uint8_t * out;
+    loh_hashmap hashmap;
+    loh_params params;
+    uint16_t * ans_emit_bits;
+    uint8_t * ans_emit_len;
+    // keeps results alive so the compiler can't throw the work away
+    uint64_t sink;
+} bench_kernel_state;
+
+typedef struct {
+    const char * name;
+    // how many bytes the kernel goes through, for the per-byte numbers
+    size_t (*bytes)(const bench_kernel_state * state);
+    // untimed, run before each timed run
+    void (*setup)(bench_kernel_state * state);
+    void (*run)(bench_kernel_state * state);
+} bench_kernel;
+
+static size_t bench_bytes_input(const bench_kernel_state * state)
+{
+    return state->len;
+}
+static size_t bench_bytes_lookback(const bench_kernel_state * state)
+{
+    return state->lookback.len;
+}
+
+// every position of the text, searched for a match and then inserted, like the match finder does it at level 5
+static void bench_hashmap_setup(bench_kernel_state * state)
+{
+    hashmap_init(&state->hashmap, &state->params, 5, state->len);
+}
+static void bench_hashmap_get(bench_kernel_state * state)
+{
+    const uint8_t * input = state->text;
+    size_t len = state->len;
+    uint64_t total = 0;
+    for (size_t i = 1; i + state->hashmap.hash_length < len; i++)
+    {
+        uint64_t size = 0;
+        size_t back_distance = 0;
+        uint32_t hash = hashmap_hash_raw(&input[i], state->hashmap.hash_length);
+        uint64_t loc = hashmap_get(&state->hashmap, i, hash, input, len, 0, &size, &back_distance);
+        if (loc != (uint64_t)-1)
+            total += size;
+        hashmap_insert(&state->hashmap, hash, i);
+    }
+    state->sink += total;
+}
+
+static void bench_huff_pack_setup(bench_kernel_state * state)
+{
+    state->huff.buffer.len = 0;
+    state->huff.byte_index = 0;
+    state->huff.bit_count = 0;
+    state->huff.bit_index = 0;
+}
+static void bench_huff_pack(bench_kernel_state * state)
+{
+    uint64_t table = 0;
+    huff_pack(&state->huff, state->lookback.data, state->lookback.len, &table);
+    state->sink += state->huff.buffer.len;
+}
+static void bench_huff_unpack(bench_kernel_state * state)
+{
+    state->sink += huff_unpack(state->huff.buffer.data, state->huff.buffer.len, state->out, state->lookback.len);
+}
+
+static void bench_ans_pack_setup(bench_kernel_state * state)
+{
+    state->ans.buffer.len = 0;
+    state->ans.byte_index = 0;
+    state->ans.bit_count = 0;
+    state->ans.bit_index = 0;
+}
+static void bench_ans_pack(bench_kernel_state * state)
+{
+    uint64_t table = 0;
+    ans_pack(&state->ans, state->lookback.data, state->lookback.len, state->ans_emit_bits, state->ans_emit_len, &table);
+    state->sink += state->ans.buffer.len;
+}
+static void bench_ans_unpack(bench_kernel_state * state)
+{
+    state->sink += ans_unpack(state->ans.buffer.data, state->ans.buffer.len, state->out, state->lookback.len);
+}
+
+static void bench_lookback_decompress(bench_kernel_state * state)
+{
+    state->sink += lookback_decompress(state->lookback.data, state->lookback.len, state->out, state->len, 0);
+}
+
+// the delta kernels work on the RGB image in place; each run leaves it differently coded, but that doesn't change the work
+static void bench_delta_apply(bench_kernel_state * state)
+{
+    loh_delta_apply(state->rgb, state->len, 3);
+    state->sink += state->rgb[state->len - 1];
+}
+static void bench_delta_undo(bench_kernel_state * state)
+{
+    loh_delta_undo(state->rgb, state->len, 3);
+    state->sink += state->rgb[state->len - 1];
+}
+static void bench_filter_undo(bench_kernel_state * state)
+{
+    loh_filter_undo(state->rgb, state->len, LOH_FILTER_PAETH, 3, state->rgb_stride);
+    state->sink += state->rgb[state->len - 1];
+}
+
+static void bench_checksum(bench_kernel_state * state)
+{
+    state->sink += loh_checksum(state->text, state->len);
+}
+
+// times each hot loop on its own, on the text and RGB corpora, and prints a CSV row for each with its best time out of runs,
+//  and hardware counters from that run (empty if they aren't available)
+// entropy coding and lookback decoding work on the text's lookback stage output rather than the text itself
+static int bench_kernels(size_t len, int runs)
+{
+    bench_kernel_state state;
+    memset(&state, 0, sizeof(state));
+    if (len < 16)
+        len = 16;
+    state.len = len;
+    state.rgb_stride = gen_rgb_width * 3;
+    state.text = (uint8_t *)malloc(len);
+    state.rgb = (uint8_t *)malloc(len);
+    state.out = (uint8_t *)malloc(len);
+    state.ans_emit_bits = (uint16_t *)malloc(sizeof(uint16_t) * LOH_ANS_BLOCK_SIZE);
+    state.ans_emit_len = (uint8_t *)malloc(LOH_ANS_BLOCK_SIZE);
+    state.params.do_lookback = 5;
+    if (!state.text || !state.rgb || !state.out || !state.ans_emit_bits || !state.ans_emit_len)
+    {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
+    bench_rand_state = 0x9E3779B97F4A7C15 + 2;
+    gen_text(state.text, len);
+    bench_rand_state = 0x9E3779B97F4A7C15 + 4;
+    gen_rgb(state.rgb, len);
+
+    // the inputs for the decoding kernels
+    if (!lookback_compress(&state.lookback, state.text, len, 0, 0, 0, 5, &state.params, &state.hashmap, 0, 0, 0))
+    {
+        fprintf(stderr, "error: out of memory\n");
+        return 1;
+    }
+    bench_huff_pack(&state);
+    bench_ans_pack(&state);
+
+    static const bench_kernel kernels[] = {
+        {"hashmap_get", bench_bytes_input, bench_hashmap_setup, bench_hashmap_get},
+        {"huff_pack", bench_bytes_lookback, bench_huff_pack_setup, bench_huff_pack},
+        {"huff_unpack", bench_bytes_lookback, 0, bench_huff_unpack},
+        {"ans_pack", bench_bytes_lookback, bench_ans_pack_setup, bench_ans_pack},
+        {"ans_unpack", bench_bytes_lookback, 0, bench_ans_unpack},
+        {"lookback_decompress", bench_bytes_input, 0, bench_lookback_decompress},
+        {"delta_apply", bench_bytes_input, 0, bench_delta_apply},
+        {"delta_undo", bench_bytes_input, 0, bench_delta_undo},
+        {"filter_undo_paeth", bench_bytes_input, 0, bench_filter_undo},
+        {"checksum", bench_bytes_input, 0, bench_checksum},
+    };
+
+    bench_counters counters;
+    bench_counters_open(&counters);
+
+    printf("kernel,bytes,ns_per_byte,mb_s");
+    for (size_t n = 0; n < BENCH_COUNTERS; n++)
+        printf(",%s_per_byte", bench_counter_names[n]);
+    printf(",ipc\n");
+
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        const bench_kernel * kernel = &kernels[k];
+        double best = 1e30;
+        int64_t best_values[BENCH_COUNTERS];
+        for (int r = 0; r < runs; r++)
+        {
+            if (kernel->setup)
+                kernel->setup(&state);
+            int64_t values[BENCH_COUNTERS];
+            double start = bench_now();
+            bench_counters_start(&counters);
+            kernel->run(&state);
+            bench_counters_stop(&counters, values);
+            double time = bench_now() - start;
+            if (time < best)
+            {
+                best = time;
+                memcpy(best_values, values, sizeof(values));
+            }
+        }
+
+        double bytes = (double)kernel->bytes(&state);
+        printf("%s,%.0f,%.3f,%.2f", kernel->name, bytes, best * 1000000000.0 / bytes, bytes / 1000000.0 / best);
+        for (size_t n = 0; n < BENCH_COUNTERS; n++)
+        {
+            if (best_values[n] >= 0)
+                printf(",%.4f", (double)best_values[n] / bytes);
+            else
+                printf(",");
+        }
+        if (best_values[0] > 0 && best_values[1] >= 0)
+            printf(",%.3f\n", (double)best_values[1] / (double)best_values[0]);
+        else
+            printf(",\n");
+        fflush(stdout);
+    }
+
+    bench_counters_close(&counters);
+    // keeps the kernels' results alive
+    if (state.sink == 0x5555555555555555)
+        puts("");
+
+    hashmap_free(&state.hashmap);
+    free(state.lookback.data);
+    free(state.huff.buffer.data);
+    free(state.ans.buffer.data);
+    free(state.text);
+    free(state.rgb);
+    free(state.out);
+    free(state.ans_emit_bits);
+    free(state.ans_emit_len);
+    return 0;
+}
+
+#ifdef THREADED
+// compresses and decompresses the text corpus once each with the threaded functions, and writes a Chrome trace of it
+static int bench_trace(const char * path, size_t len, uint16_t threads)
+{
+    uint8_t * data = (uint8_t *)malloc(len ? len : 1);
+    gen_text(data, len);
+
+    loh_trace trace;
+    loh_trace_init(&trace);
+    loh_params params;
+    memset(&params, 0, sizeof(loh_params));
+    params.do_lookback = 5;
+    params.do_huff = 1;
+    params.tracer = &trace.tracer;
+
+    size_t comp_len = 0;
+    size_t dec_len = 0;
+    uint8_t * comp = loh_compress_threaded_ex(data, len, &params, &comp_len, threads);
+    uint8_t * dec = comp ? loh_decompress_threaded_ex(comp, comp_len, &dec_len, 1, &trace.tracer, 0) : 0;
+    int ok = dec && dec_len == len;
+    if (!ok)
+        fprintf(stderr, "error: failed to round trip through loh_compress_threaded_ex\n");
+
+    FILE * f = fopen(path, "wb");
+    if (!f || !loh_trace_write(&trace, f))
+    {
+        fprintf(stderr, "error: failed to write %s\n", path);
+        ok = 0;
+    }
+    if (f)
+        fclose(f);
+
+    loh_trace_free(&trace);
+    free(data);
+    free(comp);
+    free(dec);
+    return !ok;
+}
+#endif
+
+int main(int argc, char ** argv)
+{
+    if (argc > 1 && (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0))
+    {
+        puts("usage: bench [megabytes] [runs] [0-9] [0-3] [max threads]");
+        puts("       bench -k [megabytes] [runs]");
+        puts("       bench -j <trace.json> [megabytes] [threads]");
+        puts("");
+        puts("Generates a test corpus of each kind, compresses and decompresses it in-process,");
+        puts("and prints a CSV row per corpus, function and thread count. Times are the best of <runs>.");
+        puts("");
+        puts("The numeric arguments are the size of each corpus (default 4), the number of runs (default 5),");
+        puts("the lookback level and entropy coding mode (as in loh z; defaults 5 and 1), and the largest");
+        puts("thread count to try for the threaded functions (default 8, only with -DTHREADED).");
+        puts("");
+        puts("ratio is compressed size over original size. The speedup columns are relative to the");
+        puts("single-threaded run of the same function, so they show thread scaling.");
+        puts("");
+        puts("-k times each of the compressor's and decompressor's hot loops on its own instead, printing");
+        puts("ns per byte and, where Linux perf_event_open is allowed, cycles, instructions, branch misses");
+        puts("and cache misses per byte (empty if not). Defaults are 4 megabytes and 5 runs.");
+        puts("");
+        puts("-j (only with -DTHREADED) compresses and decompresses the text corpus once with the threaded");
+        puts("functions, and writes when each chunk and stage ran on which thread to <trace.json>, for");
+        puts("chrome://tracing or ui.perfetto.dev. Defaults are 4 megabytes and 8 threads.");
+        return 0;
+    }
+
+#ifdef THREADED
+    if (argc > 2 && strcmp(argv[1], "-j") == 0)
+    {
+        size_t megabytes = argc > 3 ? strtol(argv[3], 0, 10) : 4;
+        uint16_t threads = argc > 4 ? strtol(argv[4], 0, 10) : 8;
+        return bench_trace(argv[2], megabytes * 1000000, threads < 1 ? 1 : threads);
+    }
+#endif
+
+    if (argc > 1 && strcmp(argv[1], "-k") == 0)
+    {
+        size_t megabytes = argc > 2 ? strtol(argv[2], 0, 10) : 4;
+        int runs = argc > 3 ? strtol(argv[3], 0, 10) : 5;
+        return bench_kernels(megabytes * 1000000, runs < 1 ? 1 : runs);
+    }
+
+    size_t megabytes = argc > 1 ? strtol(argv[1], 0, 10) : 4;
+    int runs = argc > 2 ? strtol(argv[2], 0, 10) : 5;
+    uint8_t do_lookback = argc > 3 ? strtol(argv[3], 0, 10) : 5;
+    uint8_t do_huff = argc > 4 ? strtol(argv[4], 0, 10) : 1;
+    uint16_t max_threads = argc > 5 ? strtol(argv[5], 0, 10) : 8;
+    if (runs < 1)
+        runs = 1;
+    if (max_threads < 1)
+        max_threads = 1;
+    (void)max_threads;
+
+    size_t len = megabytes * 1000000;
+
+    bench_corpus corpora[] = {
+        {"zeros", gen_zeros, 0, 0},
+        {"noise", gen_noise, 0, 0},
+        {"text", gen_text, 0, 0},
+        {"pcm", gen_pcm, 0, 0},
+        {"rgb", gen_rgb, 3, gen_rgb_width * 3},
+        {"exe", gen_exe, 0, 0},
+    };
+
+    puts("corpus,function,threads,level,entropy,in_bytes,out_bytes,ratio,compress_mb_s,decompress_mb_s,compress_speedup,decompress_speedup");
+
+    uint8_t * data = (uint8_t *)malloc(len ? len : 1);
+    int failed = 0;
+    for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++)
+    {
+        bench_rand_state = 0x9E3779B97F4A7C15 + c;
+        corpora[c].gen(data, len);
+
+        loh_params params;
+        memset(&params, 0, sizeof(loh_params));
+        params.do_lookback = do_lookback;
+        params.do_huff = do_huff;
+        params.image_bpp = corpora[c].image_bpp;
+        params.image_stride = corpora[c].image_stride;
+
+        bench_result result;
+        if (!bench_run(data, len, &params, 0, runs, &result))
+        {
+            fprintf(stderr, "error: %s failed to round trip through loh_compress_ex\n", corpora[c].name);
+            failed = 1;
+        }
+        bench_print(corpora[c].name, "loh_compress_ex", 0, &params, len, &result, result.compress_time, result.decompress_time);
+
+        // literals, lengths and distances in their own streams
+        loh_params split_params = params;
+        split_params.split_streams = 1;
+        double single_compress_time = result.compress_time;
+        double single_decompress_time = result.decompress_time;
+        if (!bench_run(data, len, &split_params, 0, runs, &result))
+        {
+            fprintf(stderr, "error: %s failed to round trip through loh_compress_ex with split streams\n", corpora[c].name);
+            failed = 1;
+        }
+        bench_print(corpora[c].name, "loh_compress_ex+split_streams", 0, &split_params, len, &result, single_compress_time, single_decompress_time);
+
+        // hashing 6 bytes instead of 4, which skips over more short matches
+        loh_params hash_params = params;
+        hash_params.hash_length = 6;
+        if (!bench_run(data, len, &hash_params, 0, runs, &result))
+        {
+            fprintf(stderr, "error: %s failed to round trip through loh_compress_ex with a 6-byte hash\n", corpora[c].name);
+            failed = 1;
+        }
+        bench_print(corpora[c].name, "loh_compress_ex+hash_length", 0, &hash_params, len, &result, single_compress_time, single_decompress_time);
+
+        // working memory from one arena per compression context instead of malloc
+        loh_params arena_params = params;
+        arena_params.arena_size = loh_compress_memory_usage(&params, len) * 2;
+        if (!bench_run(data, len, &arena_params, 0, runs, &result))
+        {
+            fprintf(stderr, "error: %s failed to round trip through loh_compress_ex with an arena\n", corpora[c].name);
+            failed = 1;
+        }
+        bench_print(corpora[c].name, "loh_compress_ex+arena", 0, &arena_params, len, &result, single_compress_time, single_decompress_time);
+
+        // content-defined chunks, copying the ones that haven't changed from an older version with one byte less in the middle
+        loh_params reuse_params = params;
+        reuse_params.content_chunk_size = LOH_CDC_DEFAULT_SIZE;
+        uint8_t * older = (uint8_t *)malloc(len ? len : 1);
+        size_t older_len = 0;
+        uint8_t * older_comp = 0;
+        if (older && len)
+        {
+            memcpy(older, data, len / 2);
+            memcpy(&older[len / 2], &data[len / 2 + 1], len - len / 2 - 1);
+            older_comp = loh_compress_ex(older, len - 1, &reuse_params, &older_len);
+        }
+        else if (older)
+            older_comp = loh_compress_ex(older, 0, &reuse_params, &older_len);
+        reuse_params.reuse = older_comp;
+        reuse_params.reuse_len = older_len;
+        if (!older_comp || !bench_run(data, len, &reuse_params, 0, runs, &result))
+        {
+            fprintf(stderr, "error: %s failed to round trip through loh_compress_ex with reused chunks\n", corpora[c].name);
+            failed = 1;
+        }
+        bench_print(corpora[c].name, "loh_compress_ex+reuse", 0, &reuse_params, len, &result, single_compress_time, single_decompress_time);
+        free(older);
+        LOH_FREE(older_comp);
+
+#ifdef THREADED
+        double base_compress_time = 0.0;
+        double base_decompress_time = 0.0;
+        for (uint16_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            if (!bench_run(data, len, &params, threads, runs, &result))
+            {
+                fprintf(stderr, "error: %s failed to round trip through loh_compress_threaded_ex with %d threads\n", corpora[c].name, threads);
+                failed = 1;
+            }
+            if (threads == 1)
+            {
+                base_compress_time = result.compress_time;
+                base_decompress_time = result.decompress_time;
+            }
+            bench_print(corpora[c].name, "loh_compress_threaded_ex", threads, &params, len, &result, base_compress_time, base_decompress_time);
+        }
+        if (!bench_run(data, len, &arena_params, max_threads, runs, &result))
+        {
+            fprintf(stderr, "error: %s failed to round trip through loh_compress_threaded_ex with an arena on %d threads\n", corpora[c].name, max_threads);
+            failed = 1;
+        }
+        bench_print(corpora[c].name, "loh_compress_threaded_ex+arena", max_threads, &arena_params, len, &result, base_compress_time, base_decompress_time);
+
+        // one big chunk, with its match finding spread across threads instead
+        loh_params parallel_params = params;
+        parallel_params.chunk_div = 1;
+        parallel_params.parallel_for = loh_parallel_for_threads;
+        for (uint16_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            parallel_params.parallel_arg = &threads;
+            if (!bench_run(data, len, &parallel_params, 0, runs, &result))
+            {
+                fprintf(stderr, "error: %s failed to round trip through loh_compress_ex with parallel match finding on %d threads\n", corpora[c].name, threads);
+                failed = 1;
+            }
+            if (threads == 1)
+            {
+                base_compress_time = result.compress_time;
+                base_decompress_time = result.decompress_time;
+            }
+            bench_print(corpora[c].name, "loh_compress_ex+parallel_for", threads, &parallel_params, len, &result, base_compress_time, base_decompress_time);
+        }
+
+        // several configurations tried on each chunk at once, keeping the smallest
+        loh_trial trials[LOH_DEFAULT_TRIAL_COUNT];
+        loh_params trial_params = params;
+        trial_params.trials = trials;
+        trial_params.trial_count = loh_default_trials(trials, do_lookback, do_huff);
+        trial_params.parallel_for = loh_parallel_for_threads;
+        for (uint16_t threads = 1; threads <= max_threads; threads *= 2)
+        {
+            trial_params.parallel_arg = &threads;
+            if (!bench_run(data, len, &trial_params, 0, runs, &result))
+            {
+                fprintf(stderr, "error: %s failed to round trip through loh_compress_ex with %d trials on %d threads\n", corpora[c].name, trial_params.trial_count, threads);
+                failed = 1;
+            }
+            if (threads == 1)
+            {
+                base_compress_time = result.compress_time;
+                base_decompress_time = result.decompress_time;
+            }
+            bench_print(corpora[c].name, "loh_compress_ex+trials", threads, &trial_params, len, &result, base_compress_time, base_decompress_time);
+        }
+#endif
+    }
+    free(data);
+
+    return failed;
+}
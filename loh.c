@@ -1,6 +1,16 @@
+#if defined(THREADED) && !defined(_WIN32)
+#define _POSIX_C_SOURCE 200112L
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #ifndef THREADED
 #include "loh_impl.h"
@@ -8,14 +18,771 @@
 #include "loh_impl_threaded.h"
 #endif
 
+// reads the pixel layout out of an uncompressed truecolor or grayscale TGA header
+// returns 0 if the data doesn't look like one
+static int tga_layout(const uint8_t * data, size_t len, uint8_t * bpp, uint32_t * row_stride)
+{
+    if (len < 18)
+        return 0;
+    uint8_t image_type = data[2];
+    uint16_t width = data[12] | (data[13] << 8);
+    uint16_t height = data[14] | (data[15] << 8);
+    uint8_t depth = data[16];
+    if ((image_type != 2 && image_type != 3) || depth == 0 || (depth & 7) != 0 || width == 0 || height == 0)
+        return 0;
+    *bpp = depth / 8;
+    *row_stride = (uint32_t)width * *bpp;
+    return 1;
+}
+
+// "-" means stdin or stdout
+static FILE * open_file(const char * name, int is_output)
+{
+    if (strcmp(name, "-") == 0)
+    {
+        FILE * f = is_output ? stdout : stdin;
+#ifdef _WIN32
+        _setmode(_fileno(f), _O_BINARY);
+#endif
+        return f;
+    }
+    return fopen(name, is_output ? "wb" : "rb");
+}
+
+// returns 0 if the file can't be seeked in (e.g. it's a pipe), in which case its length isn't known up front
+static int file_length(FILE * f, size_t * len)
+{
+    long start = ftell(f);
+    if (start < 0 || fseek(f, 0, SEEK_END) != 0)
+        return 0;
+    long end = ftell(f);
+    fseek(f, start, SEEK_SET);
+    if (end < start)
+        return 0;
+    *len = end - start;
+    return 1;
+}
+
+// reads everything that's left in f into memory
+static uint8_t * read_all(FILE * f, size_t * len)
+{
+    loh_byte_buffer buf = {0, 0, 0, 0, 0};
+    size_t known_len;
+    bytes_reserve(&buf, file_length(f, &known_len) ? known_len + 1 : 1 << 20);
+    while (buf.data)
+    {
+        buf.len += fread(&buf.data[buf.len], 1, buf.cap - buf.len, f);
+        if (buf.len < buf.cap)
+            break;
+        bytes_reserve(&buf, buf.cap);
+    }
+    if (!buf.data || ferror(f))
+    {
+        LOH_FREE(buf.data);
+        return 0;
+    }
+    *len = buf.len;
+    return buf.data;
+}
+
+static int write_all(FILE * f, const uint8_t * data, size_t len)
+{
+    // WHY IS THIS FASTER THAN JUST WRITING THE FILE ALL AT ONCE IF IT'S REALLY BIG
+    const size_t chunk_size = 1 << 20;
+    while (len > chunk_size)
+    {
+        if (fwrite(data, chunk_size, 1, f) != 1)
+            return 0;
+        data += chunk_size;
+        len -= chunk_size;
+    }
+    return len == 0 || fwrite(data, len, 1, f) == 1;
+}
+
+#ifdef THREADED
+
+// Pipelined compression and decompression.
+// The main thread reads one chunk at a time and hands each to its own worker thread as soon as it's in memory,
+//  while a writer thread waits on the workers in order and writes their output, so reading, compressing or
+//  decompressing, and writing all overlap instead of happening one after another.
+
+typedef struct {
+    pthread_t thread;
+    uint8_t * in_data;
+    size_t in_len;
+    uint8_t free_in;
+    uint8_t * out_data;
+    size_t out_len;
+    const loh_params * params;
+    loh_chunk_stats * stats;
+    // when compressing, for chunks that can be copied from loh_params.reuse instead
+    const loh_chunk_layout * layout;
+    uint64_t index;
+    int ok;
+    // dependent chunks
+    // when compressing, the end of the previous chunk
+    loh_byte_buffer dict;
+    // when decompressing, how many bytes at the start of out_data are for the end of the previous chunk
+    size_t history;
+    // set when decompression is done, for the next chunk to wait on
+    uint8_t done;
+    struct cli_pipeline * pipeline;
+} cli_job;
+
+typedef struct cli_pipeline {
+    cli_job * jobs;
+    size_t job_count;
+    size_t started;
+    size_t written;
+    // how many chunks can be read but not yet written at once; keeps memory use and thread count bounded
+    size_t max_in_flight;
+    FILE * out;
+    // compressed chunks can't be written until the chunk table is, so they're kept if the output can't be seeked in
+    uint8_t hold;
+    loh_checksum_state * checksum;
+    int ok;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} cli_pipeline;
+
+static void * cli_compress_job(void * _job)
+{
+    cli_job * job = (cli_job *)_job;
+    loh_byte_buffer out = {0, 0, 0, 0, 0};
+    if (loh_chunk_reuse(job->layout, job->index, job->params, &out, job->stats))
+        job->ok = out.data != 0;
+    else
+    {
+        loh_compress_scratch scratch;
+        memset(&scratch, 0, sizeof(loh_compress_scratch));
+        job->ok = loh_compress_chunk(job->in_data, job->in_len, job->dict.data, job->dict.len, job->params, &scratch, &out, job->stats);
+        loh_compress_scratch_free(&scratch);
+    }
+    if (job->free_in)
+        LOH_FREE(job->in_data);
+    LOH_FREE(job->dict.data);
+    job->dict.data = 0;
+    job->out_data = out.data;
+    job->out_len = out.len;
+    return 0;
+}
+
+// waits for the previous chunk to be decompressed, then copies its end in front of this chunk's output
+static void cli_decompress_wait(void * _job)
+{
+    cli_job * job = (cli_job *)_job;
+    cli_job * prev = job - 1;
+    pthread_mutex_lock(&job->pipeline->mutex);
+    while (!prev->done)
+        pthread_cond_wait(&job->pipeline->cond, &job->pipeline->mutex);
+    pthread_mutex_unlock(&job->pipeline->mutex);
+    memcpy(job->out_data, &prev->out_data[prev->history + prev->out_len - job->history], job->history);
+}
+
+static void * cli_decompress_job(void * _job)
+{
+    cli_job * job = (cli_job *)_job;
+    job->ok = loh_decompress_chunk(job->in_data, job->in_len, &job->out_data[job->history], job->out_len, job->history, cli_decompress_wait, job, 0, 0) == 0;
+    LOH_FREE(job->in_data);
+    
+    pthread_mutex_lock(&job->pipeline->mutex);
+    job->done = 1;
+    pthread_cond_broadcast(&job->pipeline->cond);
+    pthread_mutex_unlock(&job->pipeline->mutex);
+    return 0;
+}
+
+static void * cli_writer(void * _pipeline)
+{
+    cli_pipeline * p = (cli_pipeline *)_pipeline;
+    for (size_t i = 0; ; i += 1)
+    {
+        pthread_mutex_lock(&p->mutex);
+        while (p->started <= i && i < p->job_count)
+            pthread_cond_wait(&p->cond, &p->mutex);
+        int done = i >= p->job_count;
+        int ok = p->ok;
+        pthread_mutex_unlock(&p->mutex);
+        if (done)
+            break;
+        
+        cli_job * job = &p->jobs[i];
+        pthread_join(job->thread, 0);
+        
+        ok = ok && job->ok;
+        if (ok && !p->hold)
+        {
+            ok = write_all(p->out, &job->out_data[job->history], job->out_len);
+            if (p->checksum)
+                loh_checksum_update(p->checksum, &job->out_data[job->history], job->out_len);
+        }
+        // a dependent chunk copies the end of the one before it, so that one can only be freed once this one is done
+        if (i > 0 && !p->hold)
+        {
+            LOH_FREE(p->jobs[i - 1].out_data);
+            p->jobs[i - 1].out_data = 0;
+        }
+        
+        pthread_mutex_lock(&p->mutex);
+        p->ok = p->ok && ok;
+        p->written = i + 1;
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+    }
+    return 0;
+}
+
+static void cli_pipeline_begin(cli_pipeline * p, size_t job_count, FILE * out, pthread_t * writer)
+{
+    memset(p, 0, sizeof(cli_pipeline));
+    p->jobs = (cli_job *)calloc(job_count ? job_count : 1, sizeof(cli_job));
+    p->job_count = job_count;
+    for (size_t i = 0; p->jobs && i < job_count; i += 1)
+        p->jobs[i].pipeline = p;
+    p->max_in_flight = 8;
+    p->out = out;
+    p->ok = p->jobs != 0;
+    pthread_mutex_init(&p->mutex, 0);
+    pthread_cond_init(&p->cond, 0);
+    pthread_create(writer, 0, cli_writer, p);
+}
+
+// waits until there's room for another chunk, returning 0 if the writer has run into an error
+static int cli_pipeline_wait(cli_pipeline * p)
+{
+    pthread_mutex_lock(&p->mutex);
+    while (p->ok && p->started >= p->written + p->max_in_flight)
+        pthread_cond_wait(&p->cond, &p->mutex);
+    int ok = p->ok;
+    pthread_mutex_unlock(&p->mutex);
+    return ok;
+}
+
+static void cli_pipeline_start_job(cli_pipeline * p, void * (*func)(void *))
+{
+    pthread_create(&p->jobs[p->started].thread, 0, func, &p->jobs[p->started]);
+    pthread_mutex_lock(&p->mutex);
+    p->started += 1;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+}
+
+// stops handing out chunks (early, if reading failed) and waits for everything that was started to be written
+static int cli_pipeline_end(cli_pipeline * p, pthread_t writer, int read_ok)
+{
+    pthread_mutex_lock(&p->mutex);
+    if (!read_ok)
+        p->ok = 0;
+    p->job_count = p->started;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(writer, 0);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+    return p->ok;
+}
+
+// data, if given, is the whole input already in memory (for pipes, whose length isn't known up front, TGA mode, or
+//  content-defined chunks, whose boundaries depend on the data)
+// otherwise, the input is read from in one chunk at a time
+// the chunk table comes before the chunks, so it's written last, by seeking back if possible
+static int cli_compress(FILE * in, uint8_t * data, size_t len, FILE * out, const loh_params * _params)
+{
+    loh_params params = *_params;
+    if (params.do_lookback > 12)
+        params.do_lookback = 12;
+    
+    // chunks are split up the same way as loh_compress_threaded_ex, so the output is the same
+    loh_chunk_layout layout;
+    if (!loh_chunk_layout_init(&layout, data, len, &params, 4))
+        return 0;
+    uint64_t chunk_count = layout.chunk_count;
+    
+    loh_byte_buffer header = {0, 0, 0, 0, 0};
+    uint32_t checksum = 0;
+    bytes_push(&header, (const uint8_t *)"LOHz", 4);
+    bytes_push(&header, (uint8_t *)&checksum, 4);
+    bytes_push(&header, (uint8_t *)&chunk_count, 8);
+    size_t chunk_table_loc = header.len;
+    for (size_t i = 0; i < chunk_count + 1; i += 1)
+    {
+        uint64_t n = 0;
+        bytes_push(&header, (uint8_t *)&n, 8);
+        bytes_push(&header, (uint8_t *)&n, 8);
+    }
+    if (!header.data)
+    {
+        loh_chunk_layout_free(&layout);
+        return 0;
+    }
+    
+    long out_start = ftell(out);
+    uint8_t seekable = out_start >= 0 && fseek(out, out_start, SEEK_SET) == 0;
+    if (seekable && !write_all(out, header.data, header.len))
+    {
+        LOH_FREE(header.data);
+        loh_chunk_layout_free(&layout);
+        return 0;
+    }
+    
+    loh_chunk_stats * stats = loh_stats_begin(params.stats, chunk_count);
+    uint64_t dict_size = loh_dict_size(&params);
+    
+    loh_checksum_state checksum_state;
+    loh_checksum_begin(&checksum_state);
+    
+    cli_pipeline p;
+    pthread_t writer;
+    cli_pipeline_begin(&p, chunk_count, out, &writer);
+    p.hold = !seekable;
+    
+    int read_ok = 1;
+    for (size_t i = 0; i < chunk_count && cli_pipeline_wait(&p); i += 1)
+    {
+        uint64_t in_start = loh_chunk_start(&layout, i);
+        uint64_t in_end = loh_chunk_end(&layout, i);
+        
+        cli_job * job = &p.jobs[i];
+        job->in_len = in_end - in_start;
+        job->params = &params;
+        job->stats = stats ? &stats[i] : 0;
+        job->layout = &layout;
+        job->index = i;
+        if (data)
+            job->in_data = &data[in_start];
+        else
+        {
+            job->in_data = (uint8_t *)LOH_MALLOC(job->in_len);
+            job->free_in = 1;
+            if (!job->in_data || fread(job->in_data, 1, job->in_len, in) != job->in_len)
+            {
+                LOH_FREE(job->in_data);
+                read_ok = 0;
+                break;
+            }
+        }
+        
+        // the workers delta code and filter their chunk in place, so it has to be checksummed
+        //  (and the next chunk's dictionary copied out of it) before they start
+        loh_checksum_update(&checksum_state, job->in_data, job->in_len);
+        if (dict_size && i + 1 < chunk_count)
+            loh_dict_save(&p.jobs[i + 1].dict, job->in_data, job->in_len, dict_size);
+        
+        cli_pipeline_start_job(&p, cli_compress_job);
+    }
+    
+    int ok = cli_pipeline_end(&p, writer, read_ok);
+    
+    if (ok)
+    {
+        checksum = loh_checksum_end(&checksum_state);
+        memcpy(&header.data[4], &checksum, 4);
+        
+        uint64_t offset = header.len;
+        for (size_t i = 0; i < chunk_count; i += 1)
+        {
+            loh_chunk_table_set(&header, chunk_table_loc, i * 2 + 0, offset);
+            loh_chunk_table_set(&header, chunk_table_loc, i * 2 + 1, loh_chunk_start(&layout, i));
+            offset += p.jobs[i].out_len;
+        }
+        loh_chunk_table_set(&header, chunk_table_loc, chunk_count * 2 + 0, offset);
+        loh_chunk_table_set(&header, chunk_table_loc, chunk_count * 2 + 1, len);
+        
+        if (seekable)
+        {
+            ok = fseek(out, out_start, SEEK_SET) == 0 && write_all(out, header.data, header.len);
+            fseek(out, 0, SEEK_END);
+        }
+        else
+        {
+            ok = write_all(out, header.data, header.len);
+            for (size_t i = 0; ok && i < chunk_count; i += 1)
+                ok = write_all(out, p.jobs[i].out_data, p.jobs[i].out_len);
+        }
+    }
+    
+    for (size_t i = 0; p.jobs && i < chunk_count; i += 1)
+    {
+        LOH_FREE(p.jobs[i].out_data);
+        LOH_FREE(p.jobs[i].dict.data);
+    }
+    free(p.jobs);
+    LOH_FREE(header.data);
+    loh_chunk_layout_free(&layout);
+    
+    return ok;
+}
+
+// reads the file header and chunk table, then streams the chunks through the pipeline
+// output is written as it's decompressed, so it has to be thrown away by the caller if this fails
+static int cli_decompress(FILE * in, FILE * out)
+{
+    uint8_t file_header[16];
+    if (fread(file_header, 1, 16, in) != 16 || memcmp(file_header, "LOHz", 4) != 0)
+        return 0;
+    
+    uint32_t stored_checksum = file_header[4]
+        | (((uint32_t)file_header[5]) << 8)
+        | (((uint32_t)file_header[6]) << 16)
+        | (((uint32_t)file_header[7]) << 24);
+    uint64_t chunk_count = loh_read_u64(&file_header[8]);
+    
+    if (chunk_count > SIZE_MAX / 16 - 2)
+        return 0;
+    size_t table_len = (chunk_count + 1) * 16;
+    uint8_t * table = (uint8_t *)LOH_MALLOC(table_len);
+    uint64_t in_len;
+    size_t output_len;
+    if (!table || fread(table, 1, table_len, in) != table_len || !loh_validate_table(table, chunk_count, &in_len, &output_len))
+    {
+        LOH_FREE(table);
+        return 0;
+    }
+    
+    loh_checksum_state checksum_state;
+    loh_checksum_begin(&checksum_state);
+    
+    cli_pipeline p;
+    pthread_t writer;
+    cli_pipeline_begin(&p, chunk_count, out, &writer);
+    p.checksum = &checksum_state;
+    
+    int read_ok = 1;
+    uint64_t pos = 16 + table_len;
+    for (size_t i = 0; i < chunk_count && cli_pipeline_wait(&p); i += 1)
+    {
+        uint64_t in_start = loh_read_u64(&table[i * 16]);
+        uint64_t out_start = loh_read_u64(&table[i * 16 + 8]);
+        
+        cli_job * job = &p.jobs[i];
+        job->in_len = loh_read_u64(&table[i * 16 + 16]) - in_start;
+        job->out_len = loh_read_u64(&table[i * 16 + 24]) - out_start;
+        
+        // skip over anything between chunks
+        while (read_ok && pos < in_start)
+        {
+            read_ok = fgetc(in) != EOF;
+            pos += 1;
+        }
+        
+        job->in_data = (uint8_t *)LOH_MALLOC(job->in_len ? job->in_len : 1);
+        if (!read_ok || !job->in_data || fread(job->in_data, 1, job->in_len, in) != job->in_len)
+        {
+            LOH_FREE(job->in_data);
+            read_ok = 0;
+            break;
+        }
+        pos += job->in_len;
+        
+        // dependent chunks get room in front of their output for the end of the previous chunk
+        // if the dictionary's too long (or the header is bad), the chunk is left to fail on its own
+        loh_chunk_header chunk_header;
+        if (i > 0 && chunk_header_read(job->in_data, job->in_len, &chunk_header) && chunk_header.dict_len <= p.jobs[i - 1].out_len)
+            job->history = chunk_header.dict_len;
+        
+        job->out_data = (uint8_t *)LOH_MALLOC(job->history + job->out_len ? job->history + job->out_len : 1);
+        if (!job->out_data)
+        {
+            LOH_FREE(job->in_data);
+            read_ok = 0;
+            break;
+        }
+        
+        cli_pipeline_start_job(&p, cli_decompress_job);
+    }
+    
+    int ok = cli_pipeline_end(&p, writer, read_ok);
+    
+    for (size_t i = 0; p.jobs && i < chunk_count; i += 1)
+        LOH_FREE(p.jobs[i].out_data);
+    free(p.jobs);
+    LOH_FREE(table);
+    
+    return ok && (stored_checksum == 0 || loh_checksum_end(&checksum_state) == stored_checksum);
+}
+
+#endif
+
+// a: packs each input file into an archive, named by its path as given
+// l: lists an archive's members
+// e: extracts a single member by name
+// returns 0 on success, like main
+static int cli_archive(int argc, char ** argv)
+{
+    char mode = argv[1][0];
+    if (mode == 'a')
+    {
+        size_t member_count = argc - 3;
+        loh_archive_member * members = (loh_archive_member *)calloc(member_count + 1, sizeof(loh_archive_member));
+        int ok = members != 0;
+        for (size_t i = 0; ok && i < member_count; i += 1)
+        {
+            FILE * f = open_file(argv[i + 3], 0);
+            members[i].name = argv[i + 3];
+            members[i].name_len = strlen(argv[i + 3]);
+            members[i].data = f ? read_all(f, &members[i].len) : 0;
+            if (f && f != stdin)
+                fclose(f);
+            if (!members[i].data)
+            {
+                fprintf(stderr, "error: failed to read %s\n", argv[i + 3]);
+                ok = 0;
+            }
+        }
+        
+        loh_params params;
+        memset(&params, 0, sizeof(loh_params));
+        params.do_lookback = 5;
+        params.do_huff = 1;
+        
+        size_t out_len = 0;
+        uint8_t * out_data = 0;
+        if (ok)
+        {
+#ifdef THREADED
+            out_data = loh_archive_build_threaded(members, member_count, &params, &out_len, 4);
+#else
+            out_data = loh_archive_build(members, member_count, &params, &out_len);
+#endif
+            if (!out_data)
+                fprintf(stderr, "error: compression failed (are two of the files the same?)\n");
+        }
+        
+        FILE * f2 = out_data ? open_file(argv[2], 1) : 0;
+        if (out_data && !f2)
+            fprintf(stderr, "error: failed to open output file\n");
+        ok = f2 && write_all(f2, out_data, out_len) && fflush(f2) == 0;
+        if (f2 && f2 != stdout)
+            fclose(f2);
+        if (f2 && !ok)
+        {
+            fprintf(stderr, "error: failed to write output file\n");
+            if (f2 != stdout)
+                remove(argv[2]);
+        }
+        
+        for (size_t i = 0; members && i < member_count; i += 1)
+            LOH_FREE(members[i].data);
+        free(members);
+        free(out_data);
+        return !ok;
+    }
+    
+    FILE * f = open_file(argv[2], 0);
+    size_t len = 0;
+    uint8_t * data = f ? read_all(f, &len) : 0;
+    if (f && f != stdin)
+        fclose(f);
+    loh_archive archive;
+    if (!data || !loh_archive_open(&archive, data, len))
+    {
+        fprintf(stderr, data ? "error: not a valid archive\n" : "error: failed to read input file\n");
+        free(data);
+        return 1;
+    }
+    
+    int ok = 1;
+    if (mode == 'l')
+    {
+        loh_archive_info info;
+        for (uint64_t i = 0; i < archive.member_count; i += 1)
+        {
+            loh_archive_member_info(&archive, i, &info);
+            printf("%12llu %12llu  %.*s\n", (unsigned long long)info.len, (unsigned long long)info.stream_len, (int)info.name_len, info.name);
+        }
+    }
+    else
+    {
+        uint64_t index = loh_archive_find(&archive, argv[3], strlen(argv[3]));
+        size_t out_len = 0;
+        uint8_t * out_data = index != (uint64_t)-1 ? loh_archive_extract(&archive, index, &out_len, 1) : 0;
+        FILE * f2 = out_data ? open_file(argv[4], 1) : 0;
+        ok = f2 && write_all(f2, out_data, out_len) && fflush(f2) == 0;
+        if (f2 && f2 != stdout)
+            fclose(f2);
+        if (!ok)
+        {
+            if (f2 && f2 != stdout)
+                remove(argv[4]);
+            fprintf(stderr, index == (uint64_t)-1 ? "error: no such member\n" : !out_data ? "error: decompression failed\n" : "error: failed to write output file\n");
+        }
+        free(out_data);
+    }
+    free(data);
+    return !ok;
+}
+
+// j puts whole LOH files together, and s takes a range of chunks out of one, without recompressing anything
+static int cli_splice(int argc, char ** argv)
+{
+    char mode = argv[1][0];
+    size_t file_count = mode == 'j' ? argc - 3 : 1;
+    char ** names = mode == 'j' ? &argv[3] : &argv[2];
+    const char * out_name = mode == 'j' ? argv[2] : argv[5];
+    
+    uint8_t ** files = (uint8_t **)calloc(file_count + 1, sizeof(uint8_t *));
+    size_t * lens = (size_t *)calloc(file_count + 1, sizeof(size_t));
+    int ok = files && lens;
+    for (size_t i = 0; ok && i < file_count; i += 1)
+    {
+        FILE * f = open_file(names[i], 0);
+        files[i] = f ? read_all(f, &lens[i]) : 0;
+        if (f && f != stdin)
+            fclose(f);
+        if (!files[i])
+        {
+            fprintf(stderr, "error: failed to read %s\n", names[i]);
+            ok = 0;
+        }
+    }
+    
+    size_t out_len = 0;
+    uint8_t * out_data = 0;
+    if (ok && mode == 'j')
+    {
+        out_data = loh_concat((const uint8_t * const *)files, lens, file_count, &out_len);
+        if (!out_data)
+            fprintf(stderr, "error: not all of the inputs are valid loh files\n");
+    }
+    else if (ok)
+    {
+        out_data = loh_extract_chunks(files[0], lens[0], strtoull(argv[3], 0, 10), strtoull(argv[4], 0, 10), &out_len);
+        if (!out_data)
+            fprintf(stderr, "error: not a valid loh file, the chunks are out of range, or the first one depends on the one before it\n");
+    }
+    
+    FILE * f2 = out_data ? open_file(out_name, 1) : 0;
+    if (out_data && !f2)
+        fprintf(stderr, "error: failed to open output file\n");
+    ok = f2 && write_all(f2, out_data, out_len) && fflush(f2) == 0;
+    if (f2 && f2 != stdout)
+        fclose(f2);
+    if (f2 && !ok)
+    {
+        fprintf(stderr, "error: failed to write output file\n");
+        if (f2 != stdout)
+            remove(out_name);
+    }
+    
+    for (size_t i = 0; files && i < file_count; i += 1)
+        free(files[i]);
+    free(files);
+    free(lens);
+    LOH_FREE(out_data);
+    return !ok;
+}
+
+// decodes everything without writing any of it out, just to see if it's intact
+static int cli_test(const char * name)
+{
+    FILE * f = open_file(name, 0);
+    size_t len = 0;
+    uint8_t * data = f ? read_all(f, &len) : 0;
+    if (f && f != stdin)
+        fclose(f);
+    if (!data)
+    {
+        fprintf(stderr, "error: failed to read input file\n");
+        return 1;
+    }
+    
+    uint64_t bad_chunk = 0;
+#ifdef THREADED
+    int result = loh_test_threaded(data, len, &bad_chunk, 4);
+#else
+    int result = loh_test(data, len, &bad_chunk);
+#endif
+    free(data);
+    if (result == LOH_TEST_BAD_FILE)
+        fprintf(stderr, "error: not a valid loh file\n");
+    else if (result == LOH_TEST_BAD_CHUNK)
+        fprintf(stderr, "error: chunk %llu is corrupt\n", (unsigned long long)bad_chunk);
+    else if (result == LOH_TEST_BAD_CHECKSUM)
+        fprintf(stderr, "error: checksum mismatch\n");
+    else if (result == LOH_TEST_NO_MEMORY)
+        fprintf(stderr, "error: out of memory\n");
+    return result != LOH_TEST_OK;
+}
+
 int main(int argc, char ** argv)
 {
-    if (argc < 4 || (argv[1][0] != 'z' && argv[1][0] != 'x'))
+    if ((argc >= 3 && argv[1][0] == 'a') || (argc >= 3 && argv[1][0] == 'l') || (argc >= 5 && argv[1][0] == 'e'))
+        return cli_archive(argc, argv);
+    if (argc >= 3 && argv[1][0] == 't')
+        return cli_test(argv[2]);
+    if ((argc >= 3 && argv[1][0] == 'j') || (argc >= 6 && argv[1][0] == 's'))
+        return cli_splice(argc, argv);
+    
+    // u and n are z with an extra file before the others; once it's read, it's shifted out of the way and the rest is the same
+    uint8_t * prev_data = 0;
+    size_t prev_len = 0;
+    uint8_t append = argc >= 5 && argv[1][0] == 'n';
+    if (argc >= 5 && (argv[1][0] == 'u' || append))
+    {
+        FILE * f = open_file(argv[2], 0);
+        prev_data = f ? read_all(f, &prev_len) : 0;
+        if (f && f != stdin)
+            fclose(f);
+        if (!prev_data)
+        {
+            fprintf(stderr, "error: failed to read previous file\n");
+            return 1;
+        }
+        argv[2] = argv[1];
+        argv += 1;
+        argc -= 1;
+    }
+    
+    if (argc < 4 || (argv[1][0] != 'z' && argv[1][0] != 'x' && !prev_data))
     {
         puts("usage: loh (z[0-9]|x) <in> <out> [0-9] [0|1] [number]");
+        puts("       loh u <prev> <in> <out> [0-9] [0|1] [number]");
+        puts("       loh n <prev> <in> <out> [0-9] [0|1] [number]");
+        puts("       loh t <in>");
+        puts("       loh j <out> <files...>");
+        puts("       loh s <in> <first> <count> <out>");
+        puts("       loh a <archive> <files...>");
+        puts("       loh l <archive>");
+        puts("       loh e <archive> <name> <out>");
         puts("");
         puts("z: compresses <in> into <out>");
+        puts("zs: like z, but also prints what was done with each chunk to stderr");
+        puts("zd: like z, but each chunk's lookback can reference the end of the chunk\n"
+            "    before it, which compresses better but makes chunks depend on each other");
+        puts("zl: like z, but also looks for long repeats arbitrarily far back, for huge\n"
+            "    inputs like disk images or backups that repeat big blocks far apart");
+        puts("zt<number>: like z, but aims to compress <number> MB/s per core, adjusting how\n"
+            "    hard it looks for matches as it goes; the lookback level becomes a maximum");
+        puts("zp: like z, but compresses everything as a single chunk for the best ratio, with\n"
+            "    the match finding spread across threads instead (if built with threads)");
+        puts("zm: like z, but tries several delta distances, lookback levels and entropy\n"
+            "    coders on each chunk and keeps whichever comes out smallest (on idle\n"
+            "    threads, if built with threads); much slower to compress");
+        puts("zr: like z, but stores literals, lengths and distances in separate streams,\n"
+            "    each with its own entropy coding, which usually compresses better");
+        puts("zc: like z, but picks where chunks start and end based on their contents, so\n"
+            "    that inserting or deleting bytes doesn't move the boundaries after the edit");
+        puts("    (s, d, l, t, p, m, r and c can be combined, e.g. zsd or zlt100)");
+        puts("u: like zc, but copies the already-compressed bytes of any chunk that's the\n"
+            "    same as in <prev> (an older version of <out>) instead of compressing it\n"
+            "    again; takes the same letters as z after it (e.g. us)");
+        puts("n: compresses <in> into new chunks on the end of <prev>, and writes the result\n"
+            "    to <out>, which decompresses to <prev>'s contents followed by <in>'s; <prev>\n"
+            "    isn't recompressed (or usually even decompressed); takes the same letters as z");
         puts("x: decompresses <in> into <out>");
+        puts("t: checks that <in> decompresses correctly, without writing the output\n"
+            "    anywhere; if it doesn't, says which chunk is corrupt");
+        puts("j: joins <files...> into <out>, which decompresses to all of their contents\n"
+            "    one after another, without recompressing them");
+        puts("s: makes <out> out of <count> of <in>'s chunks, starting from chunk <first>\n"
+            "    (the first chunk is 0), without recompressing them; can't start on a\n"
+            "    chunk that depends on the one before it (see zd)");
+        puts("a: packs <files...> into an archive, each compressed on its own so any one of\n"
+            "    them can be extracted without decompressing the rest");
+        puts("l: lists the files in an archive, with their original and compressed sizes");
+        puts("e: extracts the file called <name> from an archive into <out>");
+        puts("");
+        puts("<in> and <out> can be - to use stdin and stdout, e.g. for shell pipelines.");
         puts("");
         puts("The three numeric arguments at the end are for z (compress) mode.");
         puts("");
@@ -24,13 +791,19 @@ int main(int argc, char ** argv)
             "pretty low quality but fast enough to be reasonable. 1 means fastest,\n"
             "9 means slowest.");
         puts("");
-        puts("The second turns on Huffman coding.");
+        puts("The second turns on Huffman coding. 2 uses tANS coding instead, and 3\n"
+            "tries both and keeps whichever is smaller for each chunk.");
         puts("");
         puts("The third turns on delta coding, with a byte distance. 3 does good for\n"
             "3-channel RGB images, 4 does good for 4-channel RGBA images or 16-bit\n"
             "PCM audio. Only if they're not already compressed, though. Does not\n"
             "generally work well with most files, like text.");
         puts("");
+        puts("Instead of a delta distance, the third argument can also be \"tga\", which\n"
+            "reads the pixel size and row width from the input's TGA header and uses\n"
+            "2d image filters (left/up/average/paeth) instead of delta coding. Only\n"
+            "works with uncompressed truecolor or grayscale TGA files.");
+        puts("");
         puts("If given, the numeric arguments must be given in order. If not given,\n"
             "their defaults are 5, 1, 0. In other words, RLE and Huffman are enabled\n"
             "by default, but delta coding is not.");
@@ -38,87 +811,182 @@ int main(int argc, char ** argv)
         puts("Lookback and huffman are disabled for chunks of file that don't benefit.");
         return 0;
     }
-    FILE * f = fopen(argv[2], "rb");
+    // errors go to stderr, since stdout might be the output file
+    FILE * f = open_file(argv[2], 0);
     if (!f)
     {
-        puts("error: failed to open input file");
-        return 0;
+        fprintf(stderr, "error: failed to open input file\n");
+        return 1;
     }
-    fseek(f, 0, SEEK_END);
-    size_t file_len = ftell(f);
-    fseek(f, 0, SEEK_SET);
     
-    uint8_t * raw_data = (uint8_t *)malloc(file_len);
-    fread(raw_data, file_len, 1, f);
-    loh_byte_buffer buf = {raw_data, file_len, file_len};
+    FILE * f2 = 0;
+    int ok = 0;
     
-    fclose(f);
-    
-    if (argv[1][0] == 'z')
+    if (argv[1][0] == 'z' || prev_data)
     {
         uint8_t do_diff = 0;
         int8_t do_lookback = 5;
         uint8_t do_huff = 1;
+        uint8_t image_bpp = 0;
+        uint32_t image_stride = 0;
+        uint8_t image_mode = argc > 6 && strcmp(argv[6], "tga") == 0;
+        uint8_t content_chunks = strchr(argv[1], 'c') || (prev_data && !append);
         
         if (argc > 4)
             do_lookback = strtol(argv[4], 0, 10);
         if (argc > 5)
             do_huff = strtol(argv[5], 0, 10);
-        if (argc > 6)
+        if (argc > 6 && !image_mode)
             do_diff = strtol(argv[6], 0, 10);
         
+        uint8_t * raw_data = 0;
+        size_t file_len = 0;
 #ifdef THREADED
-        buf.data = loh_compress_threaded(buf.data, buf.len, do_lookback, do_huff, do_diff, &buf.len, 4);
-        (void)(loh_compress);
-#else
-        buf.data = loh_compress(buf.data, buf.len, do_lookback, do_huff, do_diff, &buf.len);
+        // the chunk size depends on the input's length, so anything that can't tell us that gets read into memory first
+        // (and content-defined chunk boundaries depend on the whole input)
+        if (image_mode || content_chunks || append || !file_length(f, &file_len))
 #endif
+        {
+            raw_data = read_all(f, &file_len);
+            if (!raw_data)
+            {
+                fprintf(stderr, "error: failed to read input file\n");
+                return 1;
+            }
+        }
+        
+        if (image_mode && !tga_layout(raw_data, file_len, &image_bpp, &image_stride))
+        {
+            fprintf(stderr, "error: input is not an uncompressed truecolor or grayscale TGA file\n");
+            return 1;
+        }
         
-        FILE * f2 = fopen(argv[3], "wb");
+        loh_params params;
+        memset(&params, 0, sizeof(loh_params));
+        params.do_lookback = do_lookback;
+        params.do_huff = do_huff;
+        params.do_diff = do_diff;
+        params.image_bpp = image_bpp;
+        params.image_stride = image_stride;
         
-        // WHY IS THIS FASTER THAN JUST WRITING THE FILE ALL AT ONCE IF IT'S REALLY BIG
-        const size_t chunk_size = 1 << 20;
-        while (buf.len > chunk_size)
+        loh_stats stats;
+        memset(&stats, 0, sizeof(loh_stats));
+        if (strchr(argv[1], 's'))
+            params.stats = &stats;
+        if (strchr(argv[1], 'd'))
+            params.dict_size = 1 << 20;
+        if (strchr(argv[1], 'l'))
+            params.long_distance = 1;
+        if (strchr(argv[1], 'r'))
+            params.split_streams = 1;
+        if (content_chunks)
+            params.content_chunk_size = LOH_CDC_DEFAULT_SIZE;
+        if (!append)
+        {
+            params.reuse = prev_data;
+            params.reuse_len = prev_len;
+        }
+        if (strchr(argv[1], 't'))
+            params.target_speed = strtol(strchr(argv[1], 't') + 1, 0, 10);
+#ifdef THREADED
+        uint16_t match_threads = 4;
+#endif
+        if (strchr(argv[1], 'p'))
         {
-            fwrite(buf.data, chunk_size, 1, f2);
-            buf.data += chunk_size;
-            buf.len -= chunk_size;
+            params.chunk_div = 1;
+#ifdef THREADED
+            params.parallel_for = loh_parallel_for_threads;
+            params.parallel_arg = &match_threads;
+#endif
+        }
+        loh_trial trials[LOH_DEFAULT_TRIAL_COUNT];
+        if (strchr(argv[1], 'm'))
+        {
+            params.trials = trials;
+            params.trial_count = loh_default_trials(trials, do_lookback, do_huff);
+#ifdef THREADED
+            params.parallel_for = loh_parallel_for_threads;
+            params.parallel_arg = &match_threads;
+#endif
         }
-        fwrite(buf.data, buf.len, 1, f2);
         
-        fclose(f2);
-    }
-    else if (argv[1][0] == 'x')
-    {
+        f2 = open_file(argv[3], 1);
+        if (f2 && append)
+        {
+            // the new chunks are compressed on their own, then spliced onto the end of the previous file
+            size_t out_len = 0;
 #ifdef THREADED
-        buf.data = loh_decompress_threaded(buf.data, buf.len, &buf.len, 1);
-        (void)(loh_decompress);
+            size_t new_len = 0;
+            uint8_t * new_data = loh_compress_threaded_ex(raw_data, file_len, &params, &new_len, 4);
+            const uint8_t * files[2] = {prev_data, new_data};
+            size_t lens[2] = {prev_len, new_len};
+            uint8_t * out_data = new_data ? loh_concat(files, lens, 2, &out_len) : 0;
+            LOH_FREE(new_data);
 #else
-        buf.data = loh_decompress(buf.data, buf.len, &buf.len, 1);
+            uint8_t * out_data = loh_append(prev_data, prev_len, raw_data, file_len, &params, &out_len);
 #endif
+            ok = out_data && write_all(f2, out_data, out_len);
+            LOH_FREE(out_data);
+        }
+        else if (f2)
+        {
+#ifdef THREADED
+            ok = cli_compress(f, raw_data, file_len, f2, &params);
+#else
+            uint8_t * out_data = (uint8_t *)malloc(loh_compress_bound(file_len));
+            size_t out_len = out_data ? loh_compress_into(raw_data, file_len, &params, out_data, loh_compress_bound(file_len), 0) : 0;
+            ok = out_len && write_all(f2, out_data, out_len);
+            free(out_data);
+#endif
+        }
         
-        if (buf.data)
+        if (params.stats)
         {
-            FILE * f2 = fopen(argv[3], "wb");
-            // WHY IS THIS FASTER THAN JUST WRITING THE FILE ALL AT ONCE IF IT'S REALLY BIG
-            const size_t chunk_size = 1 << 20;
-            while (buf.len > chunk_size)
-            {
-                fwrite(buf.data, chunk_size, 1, f2);
-                buf.data += chunk_size;
-                buf.len -= chunk_size;
-            }
-            fwrite(buf.data, buf.len, 1, f2);
-            fclose(f2);
+            loh_stats_print(&stats, stderr);
+            loh_stats_free(&stats);
         }
-        else
+        
+        free(raw_data);
+        free(prev_data);
+    }
+    else if (argv[1][0] == 'x')
+    {
+        f2 = open_file(argv[3], 1);
+        if (f2)
         {
-            fprintf(stderr, "error: decompression failed");
-            exit(-1);
+#ifdef THREADED
+            ok = cli_decompress(f, f2);
+#else
+            size_t file_len = 0;
+            uint8_t * raw_data = read_all(f, &file_len);
+            size_t out_len = 0;
+            uint8_t * out_data = raw_data ? loh_decompress(raw_data, file_len, &out_len, 1) : 0;
+            ok = out_data && write_all(f2, out_data, out_len);
+            free(raw_data);
+            free(out_data);
+#endif
         }
     }
     
-    free(raw_data);
+    if (f != stdin)
+        fclose(f);
+    if (!f2)
+    {
+        fprintf(stderr, "error: failed to open output file\n");
+        return 1;
+    }
+    if (fflush(f2) != 0)
+        ok = 0;
+    if (f2 != stdout)
+        fclose(f2);
+    
+    if (!ok)
+    {
+        if (f2 != stdout)
+            remove(argv[3]);
+        fprintf(stderr, argv[1][0] == 'x' ? "error: decompression failed\n" : "error: compression failed\n");
+        return 1;
+    }
     
     return 0;
-}
\ No newline at end of file
+}
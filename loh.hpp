@@ -0,0 +1,263 @@
+#ifndef LOH_HPP_HEADER
+#define LOH_HPP_HEADER
+
+/*
+    C++20 interface to LOH, on top of loh_impl.h.
+    Takes std::span, and returns buffers that free themselves.
+    You probably want these functions:
+        loh::compress
+        loh::decompress
+    Requires C++20 (for std::span). The C interface is still there if you need it.
+*/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <span>
+
+#include "loh_impl.h"
+
+namespace loh
+{
+
+// frees memory that came from LOH_MALLOC
+struct free_deleter
+{
+    void operator()(uint8_t * p) const { LOH_FREE(p); }
+};
+
+// a buffer returned by compress or decompress, allocated with LOH_MALLOC and freed when it goes away
+// a null buffer (false when converted to bool) means the call failed; a successful call can still return an empty one
+class buffer
+{
+public:
+    buffer() = default;
+    // takes ownership of data, which must have come from LOH_MALLOC
+    buffer(uint8_t * data, size_t size) : data_(data), size_(data ? size : 0) {}
+    
+    uint8_t * data() { return data_.get(); }
+    const uint8_t * data() const { return data_.get(); }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    explicit operator bool() const { return data_ != nullptr; }
+    
+    uint8_t * begin() { return data(); }
+    uint8_t * end() { return data() + size_; }
+    const uint8_t * begin() const { return data(); }
+    const uint8_t * end() const { return data() + size_; }
+    
+    std::span<uint8_t> span() { return {data(), size_}; }
+    std::span<const uint8_t> span() const { return {data(), size_}; }
+    operator std::span<const uint8_t>() const { return span(); }
+    
+    // gives up ownership; the caller has to LOH_FREE the result
+    uint8_t * release()
+    {
+        size_ = 0;
+        return data_.release();
+    }
+
+private:
+    std::unique_ptr<uint8_t, free_deleter> data_;
+    size_t size_ = 0;
+};
+
+// the same settings as loh_compress's arguments; the other loh_params fields can be set on the result
+inline loh_params make_params(uint8_t do_lookback = 5, uint8_t do_huff = 1, uint8_t do_diff = 0)
+{
+    loh_params params;
+    memset(&params, 0, sizeof(loh_params));
+    params.do_lookback = do_lookback;
+    params.do_huff = do_huff;
+    params.do_diff = do_diff;
+    return params;
+}
+
+// compresses data in place: data is left delta coded/filtered afterwards, but no copy of it is made
+inline buffer compress_in_place(std::span<uint8_t> data, const loh_params & params = make_params())
+{
+    size_t out_len = 0;
+    uint8_t * out = loh_compress_ex(data.data(), data.size(), &params, &out_len);
+    return buffer(out, out_len);
+}
+
+// compresses a copy of data, leaving data alone
+inline buffer compress(std::span<const uint8_t> data, const loh_params & params = make_params())
+{
+    buffer copy((uint8_t *)LOH_MALLOC(data.size() ? data.size() : 1), data.size());
+    if (!copy)
+        return buffer();
+    if (!data.empty())
+        memcpy(copy.data(), data.data(), data.size());
+    return compress_in_place(copy.span(), params);
+}
+
+// the most that compress_into can ever need, for any input of the given length
+inline size_t compress_bound(size_t len)
+{
+    return loh_compress_bound(len);
+}
+
+// compresses data (in place) straight into out, without allocating the output
+// scratch can be reused across calls to avoid reallocating the match finder's tables (see loh_compress_into)
+// returns the compressed length, or 0 if it didn't fit or an allocation failed
+inline size_t compress_into(std::span<uint8_t> data, std::span<uint8_t> out, const loh_params & params = make_params(), loh_compress_scratch * scratch = nullptr)
+{
+    return loh_compress_into(data.data(), data.size(), &params, out.data(), out.size(), scratch);
+}
+
+namespace detail
+{
+
+// delta strides that get their own decoder; anything else uses the generic one
+constexpr unsigned any_stride = 256;
+
+// undoes a chunk's delta coding or image filter, with its delta stride known at compile time
+template <unsigned Stride>
+void undo_diff(const loh_chunk_header & header, uint8_t * out, size_t out_len)
+{
+    if (header.filter)
+        loh_filter_undo(out, out_len, header.filter, header.filter_bpp, header.filter_stride);
+    else if constexpr (Stride == any_stride)
+    {
+        for (size_t i = header.do_diff; i < out_len; i += 1)
+            out[i] += out[i - header.do_diff];
+    }
+    else if constexpr (Stride != 0)
+    {
+        for (size_t i = Stride; i < out_len; i += 1)
+            out[i] += out[i - Stride];
+    }
+}
+
+// decodes one chunk's stages, with which stages it uses and its delta stride known at compile time
+// the header and payload have already been through loh_chunk_validate
+template <bool Lookback, uint8_t Entropy, unsigned Stride>
+int decode_chunk(const loh_chunk_header & header, const uint8_t * payload, size_t payload_len, uint8_t * out, size_t out_len)
+{
+    int error = 0;
+    if constexpr (Lookback && Entropy != LOH_ENTROPY_NONE)
+    {
+        size_t mid_len = loh_read_u64(payload);
+        uint8_t * mid = (uint8_t *)LOH_MALLOC(mid_len);
+        if (!mid)
+            return 2;
+        if constexpr (Entropy == LOH_ENTROPY_ANS)
+            error = ans_unpack(payload, payload_len, mid, mid_len);
+        else
+            error = huff_unpack(payload, payload_len, mid, mid_len);
+        if (!error)
+            error = lookback_decompress(mid, mid_len, out, out_len, header.dict_len);
+        LOH_FREE(mid);
+    }
+    else if constexpr (Entropy == LOH_ENTROPY_ANS)
+        error = ans_unpack(payload, payload_len, out, out_len);
+    else if constexpr (Entropy == LOH_ENTROPY_HUFF)
+        error = huff_unpack(payload, payload_len, out, out_len);
+    else if constexpr (Lookback)
+        error = lookback_decompress(payload, payload_len, out, out_len, header.dict_len);
+    else
+        memcpy(out, payload, out_len);
+    
+    if (error)
+        return error;
+    
+    undo_diff<Stride>(header, out, out_len);
+    return 0;
+}
+
+// split lookback stages have their entropy coding per stream, so there's nothing else to pick at compile time
+template <unsigned Stride>
+int decode_split_chunk(const loh_chunk_header & header, const uint8_t * payload, size_t payload_len, uint8_t * out, size_t out_len)
+{
+    int error = loh_split_decompress(payload, payload_len, out, out_len, header.dict_len, nullptr, nullptr, nullptr, nullptr);
+    if (error)
+        return error;
+    
+    undo_diff<Stride>(header, out, out_len);
+    return 0;
+}
+
+typedef int (*chunk_decoder)(const loh_chunk_header &, const uint8_t *, size_t, uint8_t *, size_t);
+
+// indexed by delta stride: none, 1 to 4, then anything else
+template <bool Lookback, uint8_t Entropy>
+constexpr chunk_decoder stride_decoders[6] = {
+    &decode_chunk<Lookback, Entropy, 0>,
+    &decode_chunk<Lookback, Entropy, 1>,
+    &decode_chunk<Lookback, Entropy, 2>,
+    &decode_chunk<Lookback, Entropy, 3>,
+    &decode_chunk<Lookback, Entropy, 4>,
+    &decode_chunk<Lookback, Entropy, any_stride>,
+};
+
+constexpr chunk_decoder split_decoders[6] = {
+    &decode_split_chunk<0>,
+    &decode_split_chunk<1>,
+    &decode_split_chunk<2>,
+    &decode_split_chunk<3>,
+    &decode_split_chunk<4>,
+    &decode_split_chunk<any_stride>,
+};
+
+// picks the decoder for a chunk's stages, once per chunk
+inline chunk_decoder pick_decoder(const loh_chunk_header & header)
+{
+    static constexpr const chunk_decoder * decoders[2][3] = {
+        {stride_decoders<false, LOH_ENTROPY_NONE>, stride_decoders<false, LOH_ENTROPY_HUFF>, stride_decoders<false, LOH_ENTROPY_ANS>},
+        {stride_decoders<true, LOH_ENTROPY_NONE>, stride_decoders<true, LOH_ENTROPY_HUFF>, stride_decoders<true, LOH_ENTROPY_ANS>},
+    };
+    unsigned stride = header.filter ? 0 : header.do_diff <= 4 ? header.do_diff : 5;
+    if (header.split)
+        return split_decoders[stride];
+    return decoders[header.do_lookback != 0][header.do_huff][stride];
+}
+
+}
+
+// decompresses a whole LOH stream, the same way loh_decompress does
+// returns a null buffer if the data is corrupt, fails its checksum (if checked), or an allocation fails
+inline buffer decompress(std::span<const uint8_t> data, bool check_checksum = true)
+{
+    uint64_t chunk_count;
+    size_t output_len;
+    if (!data.data() || !loh_validate(data.data(), data.size(), &chunk_count, &output_len))
+        return buffer();
+    
+    buffer out((uint8_t *)LOH_MALLOC(output_len ? output_len : 1), output_len);
+    if (!out)
+        return buffer();
+    
+    const uint8_t * chunk_table = &data[16];
+    for (size_t i = 0; i < chunk_count; i += 1)
+    {
+        size_t in_start = loh_read_u64(&chunk_table[i * 16]);
+        size_t out_start = loh_read_u64(&chunk_table[i * 16 + 8]);
+        size_t chunk_len = loh_read_u64(&chunk_table[i * 16 + 16]) - in_start;
+        size_t chunk_output_len = loh_read_u64(&chunk_table[i * 16 + 24]) - out_start;
+        size_t history = i ? out_start - loh_read_u64(&chunk_table[i * 16 - 8]) : 0;
+        
+        loh_chunk_header header;
+        size_t header_len = loh_chunk_validate(&data[in_start], chunk_len, chunk_output_len, &header);
+        if (header_len == 0 || header.dict_len > history)
+            return buffer();
+        
+        detail::chunk_decoder decoder = detail::pick_decoder(header);
+        if (decoder(header, &data[in_start + header_len], chunk_len - header_len, &out.data()[out_start], chunk_output_len))
+            return buffer();
+    }
+    
+    uint32_t stored_checksum = data[4]
+        | (((uint32_t)data[5]) << 8)
+        | (((uint32_t)data[6]) << 16)
+        | (((uint32_t)data[7]) << 24);
+    if (check_checksum && stored_checksum != 0 && loh_checksum(out.data(), output_len) != stored_checksum)
+        return buffer();
+    
+    return out;
+}
+    
+}
+
+#endif // LOH_HPP_HEADER
@@ -14,6 +14,7 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <string.h>
+#include <time.h>
 
 // must return a buffer with at least 8-byte alignment
 #ifndef LOH_REALLOC
@@ -29,27 +30,241 @@
 #define LOH_FREE free
 #endif
 
+// used to time compression stages for loh_stats; must return seconds as a double
+// clock() measures CPU time for the whole process, so loh_impl_threaded.h defines this to a per-thread CPU clock instead
+#ifndef LOH_STATS_TIME
+#define LOH_STATS_TIME() ((double)clock() / CLOCKS_PER_SEC)
+#endif
+
+// used by the speed controller (see loh_params.target_speed); must return seconds as a double
+// loh_impl_threaded.h defines this to a per-thread CPU clock, since the target is per core
+#ifndef LOH_SPEED_TIME
+#define LOH_SPEED_TIME() LOH_STATS_TIME()
+#endif
+
+// the public functions are static, so the header can go in any number of translation units; they're also marked unused,
+//  so that the ones a program doesn't call don't give it warnings
+#ifndef LOH_API
+#if defined(__GNUC__) || defined(__clang__)
+#define LOH_API static __attribute__((unused))
+#elif defined(__cplusplus) && __cplusplus >= 201703L
+#define LOH_API [[maybe_unused]] static
+#else
+#define LOH_API static
+#endif
+#endif
+
 /* data structures and other shared code */
 
+// Working memory can come from an allocator picked at runtime (loh_params.allocator) instead of the macros above.
+// Anything handed back to the caller (compressed or decompressed data, stats) still comes from LOH_MALLOC, so it can
+//  always be freed the same way.
+// The same rules as the macros apply: at least 8-byte alignment, null on failure, and free has to accept null.
+// The threaded functions call it from several threads at once.
+typedef struct {
+    void * (*alloc)(void * arg, size_t size);
+    // keep is how many bytes at the start of ptr have to be kept; ptr can be null
+    void * (*realloc)(void * arg, void * ptr, size_t keep, size_t size);
+    void (*free)(void * arg, void * ptr);
+    void * arg;
+} loh_allocator;
+
+// a null allocator means the macros
+static inline void * loh_alloc(const loh_allocator * allocator, size_t size)
+{
+    return allocator ? allocator->alloc(allocator->arg, size) : LOH_MALLOC(size);
+}
+static inline void * loh_realloc(const loh_allocator * allocator, void * ptr, size_t keep, size_t size)
+{
+    return allocator ? allocator->realloc(allocator->arg, ptr, keep, size) : LOH_REALLOC(ptr, size);
+}
+static inline void loh_dealloc(const loh_allocator * allocator, void * ptr)
+{
+    if (allocator)
+        allocator->free(allocator->arg, ptr);
+    else
+        LOH_FREE(ptr);
+}
+
+// A bump allocator: allocations are carved out of big blocks one after another, and only given back all at once by
+//  loh_arena_reset or loh_arena_release, so short-lived working memory costs no more than a pointer bump and never
+//  contends with other threads. Freeing or growing the newest allocation works in place; anything else is left where
+//  it is until then.
+// The first block is block_size bytes; if it runs out, more are added, each big enough for what didn't fit.
+// Blocks come from parent (null for the macros). Not thread-safe, so each thread needs its own.
+typedef struct loh_arena_block {
+    struct loh_arena_block * next;
+    size_t cap;
+    size_t used;
+} loh_arena_block;
+
+typedef struct {
+    // points back at this arena; give it to whatever should allocate from it
+    loh_allocator allocator;
+    const loh_allocator * parent;
+    size_t block_size;
+    // newest first
+    loh_arena_block * blocks;
+    // the newest allocation, which can be grown or freed in place
+    uint8_t * last;
+    // bytes handed out since the last reset (not counting what freeing the newest allocation gave back), and the most
+    //  that's ever been
+    size_t used;
+    size_t peak;
+} loh_arena;
+
+// arena blocks have their header in front of the memory they hand out
+#define LOH_ARENA_DATA(BLOCK) ((uint8_t *)(BLOCK) + sizeof(loh_arena_block))
+
+static void * loh_arena_alloc(void * _arena, size_t size)
+{
+    loh_arena * arena = (loh_arena *)_arena;
+    size = (size + 7) & ~(size_t)7;
+    loh_arena_block * block = arena->blocks;
+    if (!block || block->cap - block->used < size)
+    {
+        size_t cap = size > arena->block_size ? size : arena->block_size;
+        block = (loh_arena_block *)loh_alloc(arena->parent, sizeof(loh_arena_block) + cap);
+        if (!block)
+            return 0;
+        block->next = arena->blocks;
+        block->cap = cap;
+        block->used = 0;
+        arena->blocks = block;
+    }
+    arena->last = LOH_ARENA_DATA(block) + block->used;
+    block->used += size;
+    arena->used += size;
+    if (arena->used > arena->peak)
+        arena->peak = arena->used;
+    return arena->last;
+}
+
+static void * loh_arena_realloc(void * _arena, void * ptr, size_t keep, size_t size)
+{
+    loh_arena * arena = (loh_arena *)_arena;
+    loh_arena_block * block = arena->blocks;
+    size = (size + 7) & ~(size_t)7;
+    if (ptr && ptr == arena->last)
+    {
+        size_t start = arena->last - LOH_ARENA_DATA(block);
+        if (block->cap - start >= size)
+        {
+            arena->used = arena->used - (block->used - start) + size;
+            block->used = start + size;
+            if (arena->used > arena->peak)
+                arena->peak = arena->used;
+            return ptr;
+        }
+    }
+    uint8_t * data = (uint8_t *)loh_arena_alloc(arena, size);
+    if (data && ptr && keep)
+        memcpy(data, ptr, keep);
+    return data;
+}
+
+static void loh_arena_dealloc(void * _arena, void * ptr)
+{
+    loh_arena * arena = (loh_arena *)_arena;
+    if (!ptr || ptr != arena->last)
+        return;
+    size_t start = arena->last - LOH_ARENA_DATA(arena->blocks);
+    arena->used -= arena->blocks->used - start;
+    arena->blocks->used = start;
+    arena->last = 0;
+}
+
+#undef LOH_ARENA_DATA
+
+static void loh_arena_init(loh_arena * arena, size_t block_size, const loh_allocator * parent)
+{
+    memset(arena, 0, sizeof(loh_arena));
+    arena->allocator.alloc = loh_arena_alloc;
+    arena->allocator.realloc = loh_arena_realloc;
+    arena->allocator.free = loh_arena_dealloc;
+    arena->allocator.arg = arena;
+    arena->parent = parent;
+    arena->block_size = block_size ? block_size : 1 << 16;
+}
+
+// gives back everything allocated from the arena at once, keeping its first block for reuse
+static void loh_arena_reset(loh_arena * arena)
+{
+    loh_arena_block * block = arena->blocks;
+    while (block && block->next)
+    {
+        loh_arena_block * next = block->next;
+        loh_dealloc(arena->parent, block);
+        block = next;
+    }
+    if (block)
+        block->used = 0;
+    arena->blocks = block;
+    arena->last = 0;
+    arena->used = 0;
+}
+
+// gives back everything, blocks included; the arena can still be used afterwards
+static void loh_arena_release(loh_arena * arena)
+{
+    loh_arena_reset(arena);
+    loh_dealloc(arena->parent, arena->blocks);
+    arena->blocks = 0;
+}
+
 typedef struct {
     uint8_t * data;
     size_t len;
     size_t cap;
+    // if set, data points into memory the buffer doesn't own (e.g. a caller's output buffer)
+    // growing past cap moves the contents into a fresh allocation and clears this flag, instead of reallocating
+    uint8_t borrowed;
+    // where data comes from when it grows; null means the macros, which is what anything handed to the caller uses
+    const loh_allocator * allocator;
 } loh_byte_buffer;
 
+static inline void bytes_regrow(loh_byte_buffer * buf)
+{
+    if (buf->borrowed)
+    {
+        uint8_t * data = (uint8_t *)loh_alloc(buf->allocator, buf->cap);
+        if (data && buf->len)
+            memcpy(data, buf->data, buf->len);
+        buf->data = data;
+        buf->borrowed = 0;
+    }
+    else
+        buf->data = (uint8_t *)loh_realloc(buf->allocator, buf->data, buf->len, buf->cap);
+}
+
+// frees a buffer's data with whatever it came from
+static inline void bytes_free(loh_byte_buffer * buf)
+{
+    if (!buf->borrowed)
+        loh_dealloc(buf->allocator, buf->data);
+    buf->data = 0;
+    buf->len = 0;
+    buf->cap = 0;
+    buf->borrowed = 0;
+}
 static inline void bytes_reserve(loh_byte_buffer * buf, size_t extra)
 {
+    if (buf->data && buf->len + extra <= buf->cap)
+        return;
     if (buf->cap < 8)
         buf->cap = 8;
     while (buf->len + extra > buf->cap)
         buf->cap <<= 1;
-    buf->data = (uint8_t *)LOH_REALLOC(buf->data, buf->cap);
+    bytes_regrow(buf);
     if (!buf->data)
         buf->cap = 0;
 }
 static inline void bytes_push(loh_byte_buffer * buf, const uint8_t * bytes, size_t count)
 {
     bytes_reserve(buf, count);
+    // allocation failure leaves data null, which callers check for afterwards
+    if (!buf->data)
+        return;
     memcpy(&buf->data[buf->len], bytes, count);
     buf->len += count;
 }
@@ -60,7 +275,7 @@ static inline void byte_push(loh_byte_buffer * buf, uint8_t byte)
         buf->cap = buf->cap << 1;
         if (buf->cap < 8)
             buf->cap = 8;
-        buf->data = (uint8_t *)LOH_REALLOC(buf->data, buf->cap);
+        bytes_regrow(buf);
     }
     buf->data[buf->len] = byte;
     buf->len += 1;
@@ -133,12 +348,9 @@ static inline void bit_push(loh_bit_buffer * buf, uint8_t data)
     buf->bit_index += 1;
     buf->bit_count += 1;
 }
+// popping past the end of the buffer gives zero bits
 static inline uint64_t bits_pop(loh_bit_buffer * buf, uint8_t bits)
 {
-    if (buf->byte_index >= buf->buffer.len)
-        return 0;
-    if (bits == 0)
-        return 0;
     uint64_t ret = 0;
     for (uint8_t n = 0; n < bits; n += 1)
     {
@@ -147,6 +359,8 @@ static inline uint64_t bits_pop(loh_bit_buffer * buf, uint8_t bits)
             buf->bit_index -= 8;
             buf->byte_index += 1;
         }
+        if (buf->byte_index >= buf->buffer.len)
+            return ret;
         ret |= (uint64_t)((buf->buffer.data[buf->byte_index] >> buf->bit_index) & 1) << n;
         buf->bit_index += 1;
     }
@@ -154,20 +368,58 @@ static inline uint64_t bits_pop(loh_bit_buffer * buf, uint8_t bits)
 }
 static inline uint8_t bit_pop(loh_bit_buffer * buf)
 {
-    if (buf->byte_index >= buf->buffer.len)
-        return 0;
     if (buf->bit_index >= 8)
     {
         buf->bit_index -= 8;
         buf->byte_index += 1;
     }
+    if (buf->byte_index >= buf->buffer.len)
+        return 0;
     uint8_t ret = (buf->buffer.data[buf->byte_index] >> buf->bit_index) & 1;
     buf->bit_index += 1;
     
     return ret;
 }
 
-static uint32_t loh_checksum(uint8_t * data, size_t len)
+// aligns the bit buffer to the start of the next byte, for writing whole bytes directly into buf->buffer
+static inline void bits_align_for_bytes(loh_bit_buffer * buf)
+{
+    // bits_push leaves an empty byte at the end when it exactly fills the previous one
+    if (buf->buffer.len > 0 && buf->bit_index == 0)
+        buf->buffer.len -= 1;
+    buf->bit_index = 8;
+}
+// number of bytes that have had bits written into them (the buffer can have an empty byte pushed ahead of time)
+static inline size_t bits_bytes_used(const loh_bit_buffer * buf)
+{
+    return buf->buffer.len - (buf->buffer.len > 0 && buf->bit_index == 0);
+}
+
+static inline uint32_t loh_read_u32(const uint8_t * data)
+{
+    return data[0]
+        | (((uint32_t)data[1]) << 8)
+        | (((uint32_t)data[2]) << 16)
+        | (((uint32_t)data[3]) << 24);
+}
+
+static inline uint64_t loh_read_u64(const uint8_t * data)
+{
+    uint64_t ret = 0;
+    for (uint8_t i = 0; i < 8; i++)
+        ret |= ((uint64_t)data[i]) << (i * 8);
+    return ret;
+}
+
+static inline uint8_t loh_floor_log2(uint32_t n)
+{
+    uint8_t ret = 0;
+    while (n >>= 1)
+        ret += 1;
+    return ret;
+}
+
+LOH_API uint32_t loh_checksum(const uint8_t * data, size_t len)
 {
     const uint32_t stripes = 4;
     const uint32_t big_prime = 0x1011B0D5;
@@ -195,6 +447,323 @@ static uint32_t loh_checksum(uint8_t * data, size_t len)
     return checksum;
 }
 
+// incremental version of loh_checksum, for data that arrives in pieces
+// feeding the same bytes through any number of loh_checksum_update calls gives the same result as loh_checksum
+typedef struct {
+    uint32_t partial_sum[4];
+    uint8_t tail[4];
+    uint8_t tail_len;
+    uint64_t len;
+} loh_checksum_state;
+
+LOH_API void loh_checksum_begin(loh_checksum_state * state)
+{
+    for (size_t j = 0; j < 4; j++)
+        state->partial_sum[j] = 0x87654321 + j;
+    state->tail_len = 0;
+    state->len = 0;
+}
+
+LOH_API void loh_checksum_update(loh_checksum_state * state, const uint8_t * data, size_t len)
+{
+    const uint32_t big_prime = 0x1011B0D5;
+    state->len += len;
+    
+    uint32_t partial_sum[4];
+    memcpy(partial_sum, state->partial_sum, sizeof(partial_sum));
+    
+    // finish the stripe left over from the previous piece first
+    size_t checksum_i = 0;
+    if (state->tail_len)
+    {
+        while (state->tail_len < 4 && checksum_i < len)
+            state->tail[state->tail_len++] = data[checksum_i++];
+        if (state->tail_len < 4)
+            return;
+        for (size_t j = 0; j < 4; j++)
+            partial_sum[j] = (partial_sum[j] + state->tail[j]) * big_prime;
+        state->tail_len = 0;
+    }
+    
+    while (checksum_i + 3 < len)
+    {
+        for (size_t j = 0; j < 4; j++)
+            partial_sum[j] = (partial_sum[j] + data[checksum_i++]) * big_prime;
+    }
+    
+    memcpy(state->partial_sum, partial_sum, sizeof(partial_sum));
+    
+    while (checksum_i < len)
+        state->tail[state->tail_len++] = data[checksum_i++];
+}
+
+LOH_API uint32_t loh_checksum_end(const loh_checksum_state * state)
+{
+    const uint32_t big_prime = 0x1011B0D5;
+    uint32_t checksum = 0x87654321;
+    
+    for (size_t j = 0; j < 4; j++)
+        checksum = (checksum + state->partial_sum[j]) * big_prime;
+    
+    for (size_t i = 0; i < state->tail_len; i++)
+        checksum = (checksum + state->tail[i]) * big_prime;
+    
+    checksum += state->len;
+    
+    return checksum;
+}
+
+// Optional hook for seeing when each chunk and each of its stages runs, and on which thread (loh_impl_threaded.h has
+//  loh_trace, which records them for a trace viewer).
+// event is called with begin set when something starts and clear when it ends, on the thread doing it, so events nest
+//  like function calls on each thread. chunk is the chunk's index, or LOH_TRACE_NO_CHUNK for the stages inside a chunk
+//  (which are always inside that chunk's event) and for things that aren't about any one chunk.
+// It's called from several threads at once by the threaded functions, and name is always a string literal.
+typedef struct {
+    void (*event)(void * arg, const char * name, uint64_t chunk, uint8_t begin);
+    void * arg;
+} loh_tracer;
+
+#define LOH_TRACE_NO_CHUNK ((uint64_t)-1)
+
+static inline void loh_trace_event(const loh_tracer * tracer, const char * name, uint64_t chunk, uint8_t begin)
+{
+    if (tracer)
+        tracer->event(tracer->arg, name, chunk, begin);
+}
+
+// Each compressed chunk starts with a header giving its compression config.
+// The first four bytes are the delta distance, lookback quality level, huffman flag, and filter mode.
+// The huffman flag is 1 for huffman coding or 2 for tANS coding.
+// If the filter mode is not zero, the delta distance byte is unused (written as zero), and the
+//  image filter parameters follow: a 32-bit row stride in bytes, then an 8-bit pixel size in bytes.
+// If the lookback byte has LOH_CHUNK_SPLIT_FLAG set, the lookback stage is stored as three separate streams, each with
+//  its own entropy coding (see loh_split_pack), and the huffman flag has to be 0.
+
+// values of the huffman flag byte (the entropy coding stage)
+#define LOH_ENTROPY_NONE 0
+#define LOH_ENTROPY_HUFF 1
+#define LOH_ENTROPY_ANS 2
+// not stored; tells the compressor to try both huffman and tANS and keep whichever is smaller
+#define LOH_ENTROPY_BEST 3
+
+#define LOH_FILTER_NONE 0
+#define LOH_FILTER_LEFT 1
+#define LOH_FILTER_UP 2
+#define LOH_FILTER_AVG 3
+#define LOH_FILTER_PAETH 4
+#define LOH_FILTER_MAX 4
+
+typedef struct {
+    uint8_t do_diff;
+    uint8_t do_lookback;
+    uint8_t do_huff;
+    uint8_t filter;
+    uint8_t filter_bpp;
+    uint32_t filter_stride;
+    // if nonzero, the chunk's lookback stage can reference this many bytes of decompressed data from just before the chunk
+    uint32_t dict_len;
+    // if nonzero, the lookback stage is split into separate streams
+    uint8_t split;
+} loh_chunk_header;
+
+// the longest a chunk header can be
+#define LOH_CHUNK_HEADER_MAX 13
+// set in the lookback byte of a chunk header if the chunk's header has a dictionary length
+#define LOH_CHUNK_DICT_FLAG 0x80
+// set in the lookback byte of a chunk header if the lookback stage is split into separate streams
+#define LOH_CHUNK_SPLIT_FLAG 0x40
+
+// the streams of a split lookback stage, in the order they're stored: literal bytes, commands (each token's first byte and
+//  its length's extension bytes), and distances (each match's distance extension bytes)
+#define LOH_SPLIT_LITERALS 0
+#define LOH_SPLIT_COMMANDS 1
+#define LOH_SPLIT_DISTANCES 2
+#define LOH_SPLIT_STREAMS 3
+
+static inline void chunk_header_push(loh_byte_buffer * buf, const loh_chunk_header * header)
+{
+    byte_push(buf, header->do_diff);
+    byte_push(buf, header->do_lookback | (header->dict_len ? LOH_CHUNK_DICT_FLAG : 0) | (header->split ? LOH_CHUNK_SPLIT_FLAG : 0));
+    byte_push(buf, header->do_huff);
+    byte_push(buf, header->filter);
+    if (header->filter)
+    {
+        byte_push(buf, header->filter_stride & 0xFF);
+        byte_push(buf, (header->filter_stride >> 8) & 0xFF);
+        byte_push(buf, (header->filter_stride >> 16) & 0xFF);
+        byte_push(buf, (header->filter_stride >> 24) & 0xFF);
+        byte_push(buf, header->filter_bpp);
+    }
+    if (header->dict_len)
+    {
+        byte_push(buf, header->dict_len & 0xFF);
+        byte_push(buf, (header->dict_len >> 8) & 0xFF);
+        byte_push(buf, (header->dict_len >> 16) & 0xFF);
+        byte_push(buf, (header->dict_len >> 24) & 0xFF);
+    }
+}
+
+// returns the length of the header, or 0 if the header is invalid
+static inline size_t chunk_header_read(const uint8_t * data, size_t len, loh_chunk_header * header)
+{
+    if (len < 4)
+        return 0;
+    
+    header->do_diff = data[0];
+    header->do_lookback = data[1] & ~(LOH_CHUNK_DICT_FLAG | LOH_CHUNK_SPLIT_FLAG);
+    header->do_huff = data[2];
+    header->filter = data[3];
+    header->filter_bpp = 0;
+    header->filter_stride = 0;
+    header->dict_len = 0;
+    header->split = (data[1] & LOH_CHUNK_SPLIT_FLAG) != 0;
+    
+    // split streams are a kind of lookback stage, with the entropy coding done per stream
+    if (header->split && (!header->do_lookback || header->do_huff))
+        return 0;
+    
+    size_t header_len = 4;
+    
+    if (header->filter)
+    {
+        if (len < 9 || header->filter > LOH_FILTER_MAX)
+            return 0;
+        
+        header->filter_stride = data[4]
+            | (((uint32_t)data[5]) << 8)
+            | (((uint32_t)data[6]) << 16)
+            | (((uint32_t)data[7]) << 24);
+        header->filter_bpp = data[8];
+        
+        if (header->filter_bpp == 0 || header->filter_stride < header->filter_bpp)
+            return 0;
+        
+        header_len = 9;
+    }
+    
+    if (data[1] & LOH_CHUNK_DICT_FLAG)
+    {
+        // a dictionary is only meaningful (and only written) for chunks that use lookback
+        if (len < header_len + 4 || !header->do_lookback)
+            return 0;
+        const uint8_t * d = &data[header_len];
+        header->dict_len = d[0]
+            | (((uint32_t)d[1]) << 8)
+            | (((uint32_t)d[2]) << 16)
+            | (((uint32_t)d[3]) << 24);
+        if (header->dict_len == 0)
+            return 0;
+        header_len += 4;
+    }
+    
+    return header_len;
+}
+
+// where the streams of a split lookback stage are, and how they're coded
+typedef struct {
+    uint8_t kind[LOH_SPLIT_STREAMS];
+    const uint8_t * coded[LOH_SPLIT_STREAMS];
+    uint64_t coded_len[LOH_SPLIT_STREAMS];
+    // decoded lengths
+    uint64_t len[LOH_SPLIT_STREAMS];
+} loh_split_layout;
+
+// reads where the streams of a split lookback stage (see loh_split_pack) are, checking that they fit in the payload and
+//  that their decoded lengths are possible for a chunk that decodes to out_len bytes
+// returns 0 on success or 1 if the payload is bad
+static int loh_split_read(const uint8_t * payload, size_t payload_len, uint64_t out_len, loh_split_layout * layout)
+{
+    if (payload_len < 8 || loh_read_u64(payload) != out_len)
+        return 1;
+    
+    size_t i = 8;
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
+    {
+        if (payload_len - i < 9)
+            return 1;
+        uint8_t kind = payload[i];
+        uint64_t coded_len = loh_read_u64(&payload[i + 1]);
+        i += 9;
+        if (kind > LOH_ENTROPY_ANS || coded_len > payload_len - i)
+            return 1;
+        
+        uint64_t len = coded_len;
+        if (kind)
+        {
+            if (coded_len < 8)
+                return 1;
+            len = loh_read_u64(&payload[i]);
+            // huffman codes never spend less than a bit per byte
+            if (kind == LOH_ENTROPY_HUFF && len / 8 > coded_len)
+                return 1;
+        }
+        // every token decodes to at least one byte for each of its command bytes, and every match to at least 4 bytes for
+        //  each of its (at most 9) distance bytes
+        if (len / (n == LOH_SPLIT_DISTANCES ? 3 : 1) > out_len)
+            return 1;
+        
+        layout->kind[n] = kind;
+        layout->coded[n] = &payload[i];
+        layout->coded_len[n] = coded_len;
+        layout->len[n] = len;
+        i += coded_len;
+    }
+    return i == payload_len ? 0 : 1;
+}
+
+// delta codes data in place, subtracting from each byte the one stride bytes before it
+// goes back to front, so each byte is subtracted from one that hasn't been changed yet
+static inline void loh_delta_apply(uint8_t * data, size_t len, size_t stride)
+{
+    for (size_t i = len; i > stride; i -= 1)
+        data[i - 1] -= data[i - 1 - stride];
+}
+
+// undoes loh_delta_apply in place
+static inline void loh_delta_undo(uint8_t * data, size_t len, size_t stride)
+{
+    for (size_t i = stride; i < len; i += 1)
+        data[i] += data[i - stride];
+}
+
+// Image filters predict each byte from the bytes one pixel to the left (a), one row up (b), and up-left (c).
+// Neighbours that would be before the start of the chunk are treated as zero.
+// Row boundaries are not special-cased, so the left neighbour of the first pixel in a row is the last pixel of the previous row.
+
+static inline uint8_t loh_paeth(uint8_t a, uint8_t b, uint8_t c)
+{
+    int16_t pa = (int16_t)b - (int16_t)c;
+    int16_t pb = (int16_t)a - (int16_t)c;
+    int16_t pc = pa + pb;
+    pa = pa < 0 ? -pa : pa;
+    pb = pb < 0 ? -pb : pb;
+    pc = pc < 0 ? -pc : pc;
+    uint8_t bc = pb <= pc ? b : c;
+    return (pa <= pb && pa <= pc) ? a : bc;
+}
+
+static inline uint8_t loh_filter_predict(uint8_t filter, uint8_t a, uint8_t b, uint8_t c)
+{
+    switch (filter)
+    {
+    case LOH_FILTER_LEFT: return a;
+    case LOH_FILTER_UP: return b;
+    case LOH_FILTER_AVG: return (uint8_t)(((uint16_t)a + (uint16_t)b) >> 1);
+    case LOH_FILTER_PAETH: return loh_paeth(a, b, c);
+    default: return 0;
+    }
+}
+
+// slow path, used for the bytes near the start of the chunk that are missing some of their neighbours
+static inline uint8_t loh_filter_predict_at(const uint8_t * data, size_t i, uint8_t filter, uint8_t bpp, uint32_t stride)
+{
+    uint8_t a = i >= bpp ? data[i - bpp] : 0;
+    uint8_t b = i >= stride ? data[i - stride] : 0;
+    uint8_t c = i >= (size_t)stride + bpp ? data[i - stride - bpp] : 0;
+    return loh_filter_predict(filter, a, b, c);
+}
+
 /* compression */
 
 static const size_t loh_min_lookback_length = 4;
@@ -202,91 +771,501 @@ static const size_t loh_min_lookback_length = 4;
 #ifndef LOH_LOW_MEMORY
 #define LOH_HASH_SIZE (20)
 #define LOH_PREVLINK_SIZE (20) // 1m
+#define LOH_LDM_HASH_SIZE (22) // 4m
 #else
 #ifndef LOH_ULTRA_LOW_MEMORY
 #define LOH_HASH_SIZE (18)
 #define LOH_PREVLINK_SIZE (18) // ~256k
+#define LOH_LDM_HASH_SIZE (18)
 #else
 #define LOH_HASH_SIZE (15)
 #define LOH_PREVLINK_SIZE (15) // ~32k
+#define LOH_LDM_HASH_SIZE (15)
+#endif
+#endif
+
+// long-distance matching (see loh_params.long_distance)
+// the rolling hash covers this many bytes, which is also the shortest long-distance match
+#define LOH_LDM_WINDOW (64)
+// on average, one in 2^this many positions gets remembered
+#define LOH_LDM_RATE_BITS (6)
+
+// the speed controller (see loh_params.target_speed) checks how it's doing every this many bytes
+#define LOH_SPEED_STEP (1 << 16)
+
+// Histograms in loh_chunk_stats have power-of-two bins: bin n counts values from 2^n up to (but not including) 2^(n+1).
+// The last bin also counts anything bigger.
+#define LOH_STATS_HIST_BINS 32
+
+// What the compressor did with a single chunk.
+typedef struct {
+    uint64_t in_bytes;
+    // the whole stored chunk, header included
+    uint64_t out_bytes;
+    
+    // chosen delta coding distance (0 if none), or image filter (LOH_FILTER_*, 0 if none)
+    uint8_t delta_stride;
+    uint8_t filter;
+    // the lookback level and entropy coder (LOH_ENTROPY_*) that ended up being used, or 0 if they were dropped
+    uint8_t lookback_kept;
+    uint8_t entropy_kept;
+    // nonzero if the lookback stage was split into separate streams (loh_params.split_streams), in which case entropy_kept
+    //  is 0, and the entropy stats are for all the streams together
+    uint8_t split_kept;
+    // nonzero if the chunk was copied from loh_params.reuse instead of being compressed, in which case only in_bytes and
+    //  out_bytes are filled in
+    uint8_t reused;
+    
+    // lookback stage (run even if it ends up dropped)
+    uint64_t lookback_in;
+    uint64_t lookback_out;
+    uint64_t match_count;
+    // how many of those matches came from the long-distance match finder
+    uint64_t long_match_count;
+    uint64_t literal_run_count;
+    uint64_t literal_bytes;
+    uint64_t match_length_hist[LOH_STATS_HIST_BINS];
+    uint64_t match_distance_hist[LOH_STATS_HIST_BINS];
+    
+    // entropy coding stage (only filled in if it was kept)
+    uint64_t entropy_in;
+    uint64_t entropy_out;
+    // bytes spent on block headers and code tables rather than coded symbols
+    uint64_t entropy_table_bytes;
+    
+    // seconds spent choosing and applying delta coding/filters, in the lookback stage, and in entropy coding (all attempts)
+    double time_prepare;
+    double time_lookback;
+    double time_entropy;
+} loh_chunk_stats;
+
+// Per-chunk statistics, optionally filled in by the compressor (see loh_params.stats).
+// Zero-initialize before first use. Compressing into it again replaces its contents. Release with loh_stats_free.
+typedef struct {
+    uint64_t chunk_count;
+    loh_chunk_stats * chunks;
+} loh_stats;
+
+LOH_API void loh_stats_free(loh_stats * stats)
+{
+    LOH_FREE(stats->chunks);
+    stats->chunks = 0;
+    stats->chunk_count = 0;
+}
+
+static inline uint8_t loh_stats_bin(uint64_t value)
+{
+    uint8_t bin = 0;
+    while (bin + 1 < LOH_STATS_HIST_BINS && (value >> (bin + 1)) != 0)
+        bin += 1;
+    return bin;
+}
+
+// one configuration for loh_params.trials to try; image filter settings still come from loh_params
+typedef struct {
+    uint8_t do_lookback;
+    uint8_t do_huff;
+    // delta coding distance; 0 detects one the usual way, and LOH_TRIAL_NO_DIFF doesn't do delta coding at all
+    uint16_t do_diff;
+} loh_trial;
+
+#define LOH_TRIAL_NO_DIFF 256
+
+// Compression settings. Zero-initialize, then set do_lookback/do_huff/do_diff as you would for loh_compress.
+// The other fields are for tuning; leaving them at zero gives the same behavior as loh_compress.
+typedef struct {
+    // same as the arguments to loh_compress
+    uint8_t do_lookback;
+    uint8_t do_huff;
+    uint8_t do_diff;
+    // if both nonzero, use 2d image filters instead of delta coding (see loh_compress_image)
+    uint8_t image_bpp;
+    uint32_t image_stride;
+    // log2 of the number of hash table entries; 0 means LOH_HASH_SIZE
+    uint8_t hash_bits;
+    // log2 of the number of positions that the match finder remembers (the window); 0 means LOH_PREVLINK_SIZE
+    // both tables are shrunk automatically for chunks that are smaller than them
+    uint8_t window_bits;
+    // how many bytes the match finder hashes to find where to look for matches, from 4 to 6; 0 means LOH_HASH_LENGTH (4)
+    // longer hashes skip over more short false matches, which can be faster and even smaller for binary data
+    uint8_t hash_length;
+    // how many hash chain entries to check per position; 0 means 2^(quality level - 1)
+    uint32_t chain_len;
+    // maximum lookback distance; 0 means 2^(quality level + 12)
+    uint64_t max_distance;
+    // stop searching once a match at least this long is found; 0 means 128
+    uint32_t good_enough_length;
+    // only try a lazy match at the next position if the current match is shorter than this; 0 means 64
+    uint32_t lazy_length;
+    // number of chunks to split the input into (bigger chunks are used if this would make them smaller than 32k)
+    // 0 means 4 for loh_compress_ex, or the number of threads for loh_compress_threaded_ex
+    uint32_t chunk_div;
+    // if not null, filled in with what the compressor did with each chunk
+    loh_stats * stats;
+    // if nonzero, chunks after the first are dependent: their match finder is primed with up to this many bytes from the end
+    //  of the previous chunk (capped at the max lookback distance), which recovers most of the ratio that splitting into
+    //  chunks costs while still compressing every chunk in parallel
+    // decoding a dependent chunk's lookback stage has to wait for the previous chunk; chunks that don't end up using
+    //  lookback are left independent
+    uint32_t dict_size;
+    // if nonzero, also look for long (LOH_LDM_WINDOW bytes or more) repeats anywhere earlier in the chunk, no matter how
+    //  far back, using a sparse rolling hash; the normal match finder only remembers the last 2^window_bits positions
+    // helps a lot with huge inputs that repeat big blocks far apart (disk images, tarballs, backups), for a little more time
+    //  and an extra table of up to 2^LOH_LDM_HASH_SIZE entries; bigger chunks (chunk_div) give it more to work with
+    uint8_t long_distance;
+    // if nonzero, aim to compress about this many MB per second per core, instead of at a fixed speed
+    // the lookback level becomes a ceiling; the match finder's chain length is turned down (all the way to not looking
+    //  for matches) or back up every LOH_SPEED_STEP bytes, depending on how far ahead or behind it is (timed with
+    //  LOH_SPEED_TIME), and chunks skip trials (like LOH_ENTROPY_BEST's second coder) that they can't afford
+    // see loh_target_speed_for_time for a time budget instead
+    uint32_t target_speed;
+    // if not null, each chunk's hash chain searches are split into pieces and run through this, so they can be spread
+    //  across threads (loh_impl_threaded.h has loh_parallel_for_threads); it has to call job(job_arg, n) for every n below
+    //  count, in any order and at the same time if it likes, and return once they're all done
+    // gets the ratio of one big chunk (e.g. chunk_div 1) at a good fraction of multi-core speed; the output doesn't depend on
+    //  how the jobs are run, but it isn't quite the same as without this
+    // huffman coding's 32k blocks are also coded through this, a batch at a time (that part's output is the same either way)
+    void (*parallel_for)(void * parallel_arg, void (*job)(void * job_arg, size_t n), void * job_arg, size_t count);
+    void * parallel_arg;
+    // if not null, each chunk is compressed with every one of these trial_count configurations (in place of do_lookback,
+    //  do_huff and do_diff), and the smallest result is kept; the trials run through parallel_for if it's set, so idle
+    //  cores can try them at the same time (each needs its own copy of the chunk and its own match finder tables)
+    // loh_default_trials fills in a reasonable set
+    const loh_trial * trials;
+    uint32_t trial_count;
+    // if nonzero, the trial that's estimated to be fastest to decode is kept instead, as long as it's at most this many
+    //  thousandths bigger than the smallest one (e.g. 20 for 2%)
+    uint16_t trial_tolerance;
+    // if nonzero (and do_diff is 0), don't detect a delta coding distance either
+    uint8_t no_diff_detect;
+    // if nonzero, the lookback stage is stored as three streams (literals, commands and distances), each entropy coded with
+    //  its own tables (or not at all, if that's smaller), instead of one stream with all of them mixed together
+    // usually smaller, especially for text and executables, and about as fast to decode
+    uint8_t split_streams;
+    // if not null, gets an event for each chunk's stages (see loh_tracer); the threaded functions also add per-chunk events
+    const loh_tracer * tracer;
+    // if not null, working memory (match finder tables, stage buffers and the like) comes from here instead of the
+    //  LOH_MALLOC/LOH_REALLOC/LOH_FREE macros; the output and stats still come from LOH_MALLOC
+    const loh_allocator * allocator;
+    // if not 0, each compression context (the loh_compress_scratch, so each thread, and each trial) gets a loh_arena with
+    //  a first block this big (taken from allocator), serves all of its working memory from that, and gives it all
+    //  back in one go when it's freed
+    // loh_compress_memory_usage, plus some slack for buffers that grow, is a good size for it
+    uint64_t arena_size;
+    // if not 0, chunk boundaries are picked by the data itself instead of being every chunk_size bytes (chunk_div is
+    //  ignored): a chunk ends wherever a rolling hash of the last LOH_CDC_WINDOW bytes hits a certain pattern, so inserting
+    //  or deleting bytes only moves the boundaries right around the edit, and the chunks after it come out the same
+    // chunks come out roughly this many bytes long on average, and are always at least 32KB (except the last one) and at
+    //  most 4 times this long
+    uint64_t content_chunk_size;
+    // if not null, the reuse_len bytes here are a previous LOH file, and any chunk whose contents are exactly the same as
+    //  one of its independent chunks has that chunk's compressed bytes copied over as-is instead of being compressed again
+    // the previous file's chunks are decoded (one at a time) to check that they really are the same
+    // meant to go with content_chunk_size, so that an edit doesn't shift every chunk after it (see loh_recompress)
+    const uint8_t * reuse;
+    size_t reuse_len;
+} loh_params;
+
+// the most trials loh_default_trials can fill in
+#define LOH_DEFAULT_TRIAL_COUNT 8
+
+// fills in trials for loh_params.trials around the given lookback level and entropy coder: the detected delta distance
+//  (which is just a guess from a small sample), no delta coding, distances 1 to 4, two levels higher, and the other entropy
+//  coder; returns how many it filled in, at most LOH_DEFAULT_TRIAL_COUNT
+static inline uint32_t loh_default_trials(loh_trial * trials, uint8_t do_lookback, uint8_t do_huff)
+{
+    uint32_t count = 0;
+    loh_trial base = {do_lookback, do_huff, 0};
+    trials[count++] = base;
+    for (uint16_t diff = 1; diff <= 4; diff += 1)
+    {
+        trials[count] = base;
+        trials[count++].do_diff = diff;
+    }
+    trials[count] = base;
+    trials[count++].do_diff = LOH_TRIAL_NO_DIFF;
+    if (do_lookback && do_lookback < 12)
+    {
+        trials[count] = base;
+        trials[count++].do_lookback = do_lookback + 2 < 12 ? do_lookback + 2 : 12;
+    }
+    if (do_huff == LOH_ENTROPY_HUFF || do_huff == LOH_ENTROPY_ANS)
+    {
+        trials[count] = base;
+        trials[count++].do_huff = do_huff == LOH_ENTROPY_HUFF ? LOH_ENTROPY_ANS : LOH_ENTROPY_HUFF;
+    }
+    return count;
+}
+
+// the target_speed that compresses len bytes in about the given number of seconds of CPU time on each of the given number
+//  of threads
+static inline uint32_t loh_target_speed_for_time(uint64_t len, double seconds, uint16_t threads)
+{
+    double speed = (double)len / (threads ? threads : 1) / seconds / 1000000.0;
+    return speed < 1.0 ? 1 : speed > 4000000000.0 ? 4000000000u : (uint32_t)speed;
+}
+
+// matches are compared 8 bytes at a time where we know which end of a word comes first in memory, and have a way to count
+//  trailing and leading zero bits; everywhere else they're compared one byte at a time
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LOH_WORD_COMPARE 1
+static inline uint8_t loh_ctz64(uint64_t x) { return __builtin_ctzll(x); }
+static inline uint8_t loh_clz64(uint64_t x) { return __builtin_clzll(x); }
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+#include <intrin.h>
+#define LOH_WORD_COMPARE 1
+static inline uint8_t loh_ctz64(uint64_t x) { unsigned long n; _BitScanForward64(&n, x); return (uint8_t)n; }
+static inline uint8_t loh_clz64(uint64_t x) { unsigned long n; _BitScanReverse64(&n, x); return (uint8_t)(63 - n); }
+#else
+#define LOH_WORD_COMPARE 0
+#endif
+
+#if defined(__GNUC__)
+#define LOH_PREFETCH(p) __builtin_prefetch(p)
+#else
+#define LOH_PREFETCH(p) ((void)(p))
+#endif
+
+// for functions that get a separate copy for each constant they're called with (see lookback_compress)
+#if defined(__GNUC__)
+#define LOH_FORCE_INLINE inline __attribute__((always_inline))
+#elif defined(_MSC_VER)
+#define LOH_FORCE_INLINE __forceinline
+#else
+#define LOH_FORCE_INLINE inline
 #endif
+
+// how many bytes in a row are the same at a and b, up to limit
+static inline uint64_t loh_match_length(const uint8_t * a, const uint8_t * b, uint64_t limit)
+{
+    uint64_t n = 0;
+#if LOH_WORD_COMPARE
+    while (n + 8 <= limit)
+    {
+        uint64_t x, y;
+        memcpy(&x, a + n, 8);
+        memcpy(&y, b + n, 8);
+        // the lowest set bit of the difference is in the first byte that's different
+        if (x != y)
+            return n + (loh_ctz64(x ^ y) >> 3);
+        n += 8;
+    }
+#endif
+    while (n < limit && a[n] == b[n])
+        n += 1;
+    return n;
+}
+
+// how many bytes in a row are the same just before a and b, going backwards, up to limit
+static inline uint64_t loh_match_length_back(const uint8_t * a, const uint8_t * b, uint64_t limit)
+{
+    uint64_t n = 0;
+#if LOH_WORD_COMPARE
+    while (n + 8 <= limit)
+    {
+        uint64_t x, y;
+        memcpy(&x, a - n - 8, 8);
+        memcpy(&y, b - n - 8, 8);
+        // going backwards, the highest set bit is in the first byte that's different
+        if (x != y)
+            return n + (loh_clz64(x ^ y) >> 3);
+        n += 8;
+    }
 #endif
+    while (n < limit && a[-1 - (int64_t)n] == b[-1 - (int64_t)n])
+        n += 1;
+    return n;
+}
 
 // for finding lookback matches, we use a chained hash table with limited, location-based chaining
 typedef struct {
     uint32_t * hashtable;
+    // one entry per position in the window: how far back the previous position with the same key is in the low window
+    //  bits (0 if there isn't one that close), and a tag (more bits of the hash, see hashmap_tag) in the rest, so that
+    //  positions whose bytes are different can be skipped without looking at them
     uint32_t * prevlink;
-    uint32_t max_distance;
-    uint16_t chain_len;
+    // also never more than how far back a position's entry is guaranteed not to have been reused by a later position
+    uint64_t max_distance;
+    uint32_t chain_len;
+    uint32_t good_enough_length;
+    uint8_t hash_shift;
+    // how many bytes are hashed (LOH_HASH_LENGTH to LOH_HASH_LENGTH_MAX)
+    uint8_t hash_length;
+    uint32_t prevlink_mask;
+    // sizes the tables were allocated with, so they can be reused for later chunks
+    uint8_t alloc_hash_bits;
+    uint8_t alloc_window_bits;
+    const loh_allocator * allocator;
 } loh_hashmap;
 
-#define loh_prevlink_mask ((1<<LOH_PREVLINK_SIZE) - 1)
-
 #define LOH_HASH_LENGTH 4
-static inline uint32_t hashmap_hash_raw(const void * bytes)
+#define LOH_HASH_LENGTH_MAX 6
+// bytes must point to hash_length characters
+// callers that know hash_length at compile time get just the code for that length
+static inline uint32_t hashmap_hash_raw(const void * bytes, uint8_t hash_length)
 {
     // hashing function (can be anything; go ahead and optimize it as long as it doesn't result in tons of collisions)
-    uint32_t temp = 0xA68BB0D5;
-    // unaligned-safe 32-bit load
-    uint32_t a = 0;
-    memcpy(&a, bytes, 4);
-    // then just multiply it by the const and return the top N bits
-    return a * temp;
+    if (hash_length <= 4)
+    {
+        uint32_t temp = 0xA68BB0D5;
+        // unaligned-safe 32-bit load
+        uint32_t a = 0;
+        memcpy(&a, bytes, 4);
+        // then just multiply it by the const and return the top N bits
+        return a * temp;
+    }
+    // longer hashes do the same thing in 64 bits
+    // (put together from separate loads; copying 5 or 6 bytes into a 64-bit value goes through memory, which is slow)
+    const uint8_t * b = (const uint8_t *)bytes;
+    uint32_t lo = 0;
+    memcpy(&lo, b, 4);
+    uint64_t hi = b[4];
+    if (hash_length > 5)
+        hi |= ((uint64_t)b[5]) << 8;
+    uint64_t a = lo | (hi << 32);
+    return (a * 0x9E3779B97F4A7C15) >> 32;
 }
-static inline uint32_t hashmap_hash(const void * bytes)
+static inline uint32_t loh_hashlink_index(const loh_hashmap * hashmap, uint64_t value)
 {
-    return hashmap_hash_raw(bytes) >> (32 - LOH_HASH_SIZE);
+    return value & hashmap->prevlink_mask;
 }
-static inline uint32_t loh_hashlink_index(uint64_t value)
+// the hash mixed again, so that it doesn't repeat the key (which is the hash's top bits), cut down to the bits above
+//  the distance in a prevlink entry
+static inline uint32_t hashmap_tag(const loh_hashmap * hashmap, uint32_t hash)
 {
-    return value & loh_prevlink_mask;
+    return (hash * 0x9E3779B1) & ~hashmap->prevlink_mask;
 }
 
-// bytes must point to four characters
-static inline void hashmap_insert(loh_hashmap * hashmap, const uint8_t * bytes, uint64_t value)
+static inline uint8_t loh_ceil_log2(uint64_t n)
 {
-    const uint32_t key = hashmap_hash(bytes);
-    hashmap->prevlink[loh_hashlink_index(value)] = hashmap->hashtable[key];
-    hashmap->hashtable[key] = value;
+    uint8_t ret = 0;
+    while ((((uint64_t)1) << ret) < n)
+        ret += 1;
+    return ret;
 }
 
-// bytes must point to four characters and be inside of buffer
-static inline uint64_t hashmap_get(loh_hashmap * hashmap, size_t i, const uint8_t * input, const size_t buffer_len, const size_t pre_context, uint64_t * min_len, size_t * back_distance)
+// works out the table sizes (as log2 of their entry counts) that are used for a chunk of the given length
+// tables never need to be bigger than the chunk itself
+static inline void hashmap_table_bits(const loh_params * params, uint64_t input_len, uint8_t * hash_bits, uint8_t * window_bits)
 {
-    const uint32_t key = hashmap_hash(&input[i]);
-    uint64_t value = hashmap->hashtable[key];
-    // file might be more than 4gb, so map in the upper bits of the current address
-    if (sizeof(size_t) > sizeof(uint32_t))
-        value |= i & 0xFFFFFFFF00000000;
-    if (!value)
-        return -1;
-    
-    // if we hit 128 bytes we call it good enough and take it
-    const uint64_t good_enough_length = 128;
-    uint64_t remaining = buffer_len - i;
-    
+    uint8_t h = (params && params->hash_bits) ? params->hash_bits : LOH_HASH_SIZE;
+    uint8_t w = (params && params->window_bits) ? params->window_bits : LOH_PREVLINK_SIZE;
+    if (h > 30)
+        h = 30;
+    if (w > 30)
+        w = 30;
+    uint8_t len_bits = loh_ceil_log2(input_len);
+    if (len_bits < 8)
+        len_bits = 8;
+    *hash_bits = h < len_bits ? h : len_bits;
+    *window_bits = w < len_bits ? w : len_bits;
+}
+
+static inline uint8_t loh_hash_length(const loh_params * params)
+{
+    uint8_t n = (params && params->hash_length) ? params->hash_length : LOH_HASH_LENGTH;
+    return n < LOH_HASH_LENGTH ? LOH_HASH_LENGTH : n > LOH_HASH_LENGTH_MAX ? LOH_HASH_LENGTH_MAX : n;
+}
+
+static inline uint64_t loh_max_distance(const loh_params * params, int8_t quality_level)
+{
+    return (params && params->max_distance) ? params->max_distance : ((uint64_t)1 << (quality_level + 12));
+}
+
+static void hashmap_free(loh_hashmap * hashmap)
+{
+    loh_dealloc(hashmap->allocator, hashmap->prevlink);
+    loh_dealloc(hashmap->allocator, hashmap->hashtable);
+    hashmap->hashtable = 0;
+    hashmap->prevlink = 0;
+    hashmap->alloc_hash_bits = 0;
+    hashmap->alloc_window_bits = 0;
+}
+
+// hashmap must be zeroed before its first init; after that, its tables are reused if they're already big enough
+// returns 0 if allocation fails
+static int hashmap_init(loh_hashmap * hashmap, const loh_params * params, int8_t quality_level, uint64_t input_len)
+{
+    uint8_t hash_bits;
+    uint8_t window_bits;
+    hashmap_table_bits(params, input_len, &hash_bits, &window_bits);
+    
+    hashmap->hash_shift = 32 - hash_bits;
+    hashmap->hash_length = loh_hash_length(params);
+    hashmap->prevlink_mask = (((uint32_t)1) << window_bits) - 1;
+    if (!hashmap->hashtable || hashmap->alloc_hash_bits < hash_bits || hashmap->alloc_window_bits < window_bits)
+    {
+        hashmap_free(hashmap);
+        hashmap->hashtable = (uint32_t *)loh_alloc(hashmap->allocator, sizeof(uint32_t) << hash_bits);
+        hashmap->prevlink = (uint32_t *)loh_alloc(hashmap->allocator, sizeof(uint32_t) << window_bits);
+        if (!hashmap->hashtable || !hashmap->prevlink)
+        {
+            hashmap_free(hashmap);
+            return 0;
+        }
+        hashmap->alloc_hash_bits = hash_bits;
+        hashmap->alloc_window_bits = window_bits;
+    }
+    memset(hashmap->hashtable, 0, sizeof(uint32_t) << hash_bits);
+    memset(hashmap->prevlink, 0, sizeof(uint32_t) << window_bits);
+    
+    hashmap->chain_len = (params && params->chain_len) ? params->chain_len : ((uint32_t)1 << (quality_level - 1));
+    hashmap->max_distance = loh_max_distance(params, quality_level);
+    if (hashmap->max_distance > hashmap->prevlink_mask)
+        hashmap->max_distance = hashmap->prevlink_mask;
+    // if we hit 128 bytes we call it good enough and take it
+    hashmap->good_enough_length = (params && params->good_enough_length) ? params->good_enough_length : 128;
+    return 1;
+}
+
+// hash is hashmap_hash_raw of the bytes at value
+static inline void hashmap_insert(loh_hashmap * hashmap, uint32_t hash, uint64_t value)
+{
+    const uint32_t key = hash >> hashmap->hash_shift;
+    // positions are only stored as their low 32 bits, but the distance between two of them comes out right anyway
+    // (this shouldn't branch: the hash table entry is usually a cache miss)
+    uint32_t distance = (uint32_t)value - hashmap->hashtable[key];
+    distance = distance > hashmap->prevlink_mask ? 0 : distance;
+    hashmap->prevlink[loh_hashlink_index(hashmap, value)] = hashmap_tag(hashmap, hash) | distance;
+    hashmap->hashtable[key] = value;
+}
+
+// looks for the best match for position i along the chain of earlier positions that starts at value, which has the same key
+// hash is hashmap_hash_raw of the bytes at i
+static inline uint64_t hashmap_search(const loh_hashmap * hashmap, size_t i, uint64_t value, uint32_t hash, const uint8_t * input, const size_t buffer_len, const size_t pre_context, uint64_t * min_len, size_t * back_distance)
+{
+    const uint64_t good_enough_length = hashmap->good_enough_length;
+    const uint32_t mask = hashmap->prevlink_mask;
+    const uint32_t tag = hashmap_tag(hashmap, hash);
+    uint64_t remaining = buffer_len - i;
+    
     // look for best match under key
     uint64_t best = -1;
     uint64_t best_size = loh_min_lookback_length - 1;
     uint64_t best_d = 0;
-    uint64_t first_value = value;
-    uint16_t chain_len = hashmap->chain_len;
+    uint32_t chain_len = hashmap->chain_len;
     while (chain_len-- > 0)
     {
-        if (memcmp(&input[i], &input[value], 4) == 0 && input[i + best_size] == input[value + best_size])
+        // entries further back than max_distance might have been reused by later positions, so if the chain starts
+        //  there, only the position it starts at is checked
+        uint32_t link = tag;
+        if (i - value <= hashmap->max_distance)
         {
-            uint64_t size = 0;
-            while (size < remaining && input[i + size] == input[value + size])
-                size += 1;
+            link = hashmap->prevlink[loh_hashlink_index(hashmap, value)];
+            // the next entry is needed as soon as we're done here, so start loading it now
+            LOH_PREFETCH(&hashmap->prevlink[loh_hashlink_index(hashmap, value - (link & mask))]);
+        }
+        uint64_t next = value - (link & mask);
+        
+        // a different tag means different bytes, so only positions with the same one have to be looked at
+        if ((link & ~mask) == tag && memcmp(&input[i], &input[value], 4) == 0 && input[i + best_size] == input[value + best_size])
+        {
+            uint64_t size = loh_match_length(&input[i], &input[value], remaining);
             
-            size_t d = 1;
-            while (value > 0 && input[i - d] == input[value - 1] && d <= pre_context)
-            {
-                value -= 1;
-                size += 1;
-                d += 1;
-            }
-            d -= 1;
+            uint64_t back_limit = value < pre_context ? value : pre_context;
+            size_t d = loh_match_length_back(&input[i], &input[value], back_limit);
+            value -= d;
+            size += d;
             
             if (size > best_size || (size == best_size && value > best))
             {
@@ -297,16 +1276,21 @@ static inline uint64_t hashmap_get(loh_hashmap * hashmap, size_t i, const uint8_
                 if (size >= good_enough_length || size >= remaining)
                     break;
             }
+            // a match that got extended backwards carries on along the chain of where it starts now, if that has the same
+            //  tag; it usually doesn't (which ends the search early), except inside of runs
+            if (d != 0)
+            {
+                if (i - value > hashmap->max_distance)
+                    break;
+                const uint32_t moved_link = hashmap->prevlink[loh_hashlink_index(hashmap, value)];
+                if ((moved_link & ~mask) != tag)
+                    break;
+                next = value - (moved_link & mask);
+            }
         }
-        value = hashmap->prevlink[loh_hashlink_index(value)];
-        if (sizeof(size_t) > sizeof(uint32_t))
-            value |= i & 0xFFFFFFFF00000000;
-        
-        if (value == 0 || value > i || value == first_value || i - value > hashmap->max_distance)
-            break;
-        const uint32_t key_2 = hashmap_hash(&input[value]);
-        if (key_2 != key)
+        if (next == value || i - next > hashmap->max_distance)
             break;
+        value = next;
     }
     
     *min_len = best_size;
@@ -314,6 +1298,18 @@ static inline uint64_t hashmap_get(loh_hashmap * hashmap, size_t i, const uint8_
     return best;
 }
 
+// hash is hashmap_hash_raw of the bytes at i, which must be inside of buffer
+static inline uint64_t hashmap_get(const loh_hashmap * hashmap, size_t i, uint32_t hash, const uint8_t * input, const size_t buffer_len, const size_t pre_context, uint64_t * min_len, size_t * back_distance)
+{
+    uint64_t value = hashmap->hashtable[hash >> hashmap->hash_shift];
+    // file might be more than 4gb, so map in the upper bits of the current address
+    if (sizeof(size_t) > sizeof(uint32_t))
+        value |= i & 0xFFFFFFFF00000000;
+    if (!value || value > i)
+        return -1;
+    return hashmap_search(hashmap, i, value, hash, input, buffer_len, pre_context, min_len, back_distance);
+}
+
     
 // bits within lookback header byte (which spends 2 bits on length extension bits)
 static const size_t loh_size_bits = 3;
@@ -321,7 +1317,33 @@ static const size_t loh_size_mask = (1 << loh_size_bits) - 1;
 static const size_t loh_dist_bits = 6 - loh_size_bits;
 static const size_t loh_dist_mask = (1 << loh_dist_bits) - 1;
 
-static inline uint64_t hashmap_get_if_efficient(loh_hashmap * hashmap, const size_t i, const uint8_t * input, const uint64_t input_len, const size_t pre_context, uint64_t * out_size, size_t * out_back_distance)
+// whether a match would take fewer bytes to code than the literals it replaces
+static inline int loh_match_is_efficient(uint64_t dist, uint64_t size, size_t pre_context)
+{
+    size_t dist_max_next = loh_dist_mask + 1;
+    size_t dist_byte_count = 1;
+    size_t dist_bit_count = loh_dist_bits;
+    while (dist >= dist_max_next)
+    {
+        dist_bit_count += 7;
+        dist_max_next += 1 << dist_bit_count;
+        dist_byte_count += 1;
+    }
+    
+    uint64_t overhead = dist_byte_count;
+    
+    // cost of extra size byte if size is long
+    // if size is more than one extra byte long, then overhead will definitely be less than size, so we don't have to account for it
+    if (size - loh_min_lookback_length > loh_size_mask)
+        overhead += 1;
+    
+    if (pre_context != 0) // cost of switching out of literal mode
+        overhead += 1;
+    
+    return overhead < size;
+}
+
+static inline uint64_t hashmap_get_if_efficient(loh_hashmap * hashmap, const size_t i, uint32_t hash, const uint8_t * input, const uint64_t input_len, const size_t pre_context, uint64_t * out_size, size_t * out_back_distance)
 {
     // here we only return the hashmap hit if it would be efficient to code it
     
@@ -331,99 +1353,479 @@ static inline uint64_t hashmap_get_if_efficient(loh_hashmap * hashmap, const siz
     
     uint64_t size = 0;
     size_t back_distance = 0;
-    uint64_t found_loc = hashmap_get(hashmap, i, input, input_len, pre_context, &size, &back_distance);
-    uint64_t dist = i - found_loc;
-    if (found_loc != (uint64_t)-1 && found_loc < i)
+    uint64_t found_loc = hashmap_get(hashmap, i, hash, input, input_len, pre_context, &size, &back_distance);
+    if (found_loc != (uint64_t)-1 && found_loc < i && loh_match_is_efficient(i - found_loc, size, pre_context))
+    {
+        *out_size = size;
+        *out_back_distance = back_distance;
+        return found_loc;
+    }
+    return -1;
+}
+
+// Parallel match finding (see loh_params.parallel_for).
+// The chunk is worked through in blocks. For each block, every position up to its end is put in the hashmap first (which
+//  is cheap), then the block is split into LOH_MATCH_PIECES pieces that are searched in parallel, reading from the
+//  hashmap but not changing it. Each search starts from its own position's link in the chain, so it sees the same
+//  earlier positions that it would have if it was done in order.
+// Searching every position would take several times as long as the serial parse, which skips over the inside of every
+//  match it takes, so each piece runs a rough version of the same parse and only searches where it lands; the positions
+//  it skips are given the rest of the match that skipped them. The real parse (in lookback_compress) then picks from
+//  the results serially, and mostly lands in the same places.
+#define LOH_MATCH_PIECES 32
+
+// the best match found at a position, not extended backwards yet (that depends on the literals before it)
+typedef struct {
+    uint32_t dist;
+    uint32_t size;
+} loh_match_candidate;
+
+typedef struct {
+    const loh_hashmap * hashmap;
+    const uint8_t * input;
+    uint64_t input_len;
+    uint64_t start;
+    uint64_t len;
+    // most positions a block can have; the window has to hold the block plus the distance that searches reach back
+    uint64_t cap;
+    // the parse's current lazy matching length
+    uint64_t lazy_length;
+    loh_match_candidate * candidates;
+} loh_match_block;
+
+// searches for a match at position n of the block, cutting it off at search_end
+static inline loh_match_candidate loh_match_block_search(const loh_match_block * block, uint64_t n, uint64_t search_end)
+{
+    const loh_hashmap * hashmap = block->hashmap;
+    loh_match_candidate candidate = {0, 0};
+    uint64_t i = block->start + n;
+    if (i + hashmap->hash_length >= block->input_len)
+        return candidate;
+    
+    // i is already in the hashmap, so its chain starts at its own entry
+    uint32_t distance = hashmap->prevlink[loh_hashlink_index(hashmap, i)] & hashmap->prevlink_mask;
+    if (distance == 0)
+        return candidate;
+    
+    uint64_t size = 0;
+    size_t back_distance = 0;
+    uint64_t found_loc = hashmap_search(hashmap, i, i - distance, hashmap_hash_raw(&block->input[i], hashmap->hash_length), block->input, search_end, 0, &size, &back_distance);
+    // a match that isn't worth taking even right after another one might as well not be there
+    if (found_loc != (uint64_t)-1 && found_loc < i && loh_match_is_efficient(i - found_loc, size, 0))
+    {
+        candidate.dist = i - found_loc;
+        candidate.size = size < 0xFFFFFFFF ? size : 0xFFFFFFFF;
+    }
+    return candidate;
+}
+
+static void loh_match_block_job(void * _block, size_t piece)
+{
+    const loh_match_block * block = (const loh_match_block *)_block;
+    uint64_t piece_len = (block->len + LOH_MATCH_PIECES - 1) / LOH_MATCH_PIECES;
+    uint64_t from = piece * piece_len;
+    uint64_t to = from + piece_len < block->len ? from + piece_len : block->len;
+    if (from >= to)
+        return;
+    memset(&block->candidates[from], 0, sizeof(loh_match_candidate) * (to - from));
+    
+    // matches are cut off a little past the end of the block, so that no search costs more than that; the block's first
+    //  position is where the parse always is when it gets to the block, so it can still find one that runs on as long as
+    //  it likes (e.g. through a long run of zeros)
+    uint64_t search_end = block->start + block->len + block->hashmap->good_enough_length;
+    if (search_end > block->input_len)
+        search_end = block->input_len;
+    
+    uint64_t n = from;
+    while (n < to)
     {
-        size_t dist_max_next = loh_dist_mask + 1;
-        size_t dist_byte_count = 1;
-        size_t dist_bit_count = loh_dist_bits;
-        while (dist >= dist_max_next)
+        loh_match_candidate found = loh_match_block_search(block, n, n ? search_end : block->input_len);
+        block->candidates[n] = found;
+        if (found.size == 0)
         {
-            dist_bit_count += 7;
-            dist_max_next += 1 << dist_bit_count;
-            dist_byte_count += 1;
+            n += 1;
+            continue;
         }
         
-        uint64_t overhead = dist_byte_count;
-        
-        // cost of extra size byte if size is long
-        // if size is more than one extra byte long, then overhead will definitely be less than size, so we don't have to account for it
-        if (size - loh_min_lookback_length > loh_size_mask)
-            overhead += 1;
+        // same lazy matching as the parse
+        uint64_t searched = n;
+        if (found.size < block->lazy_length && n + 1 < to)
+        {
+            searched = n + 1;
+            loh_match_candidate next = loh_match_block_search(block, n + 1, search_end);
+            block->candidates[n + 1] = next;
+            if (next.size >= found.size + 1)
+            {
+                n += 1;
+                found = next;
+            }
+        }
         
-        if (pre_context != 0) // cost of switching out of literal mode
-            overhead += 1;
+        // the rest of the match, for positions the parse would skip over
+        uint64_t end = to - n > found.size ? n + found.size : to;
+        for (uint64_t k = n + 1; k < end; k += 1)
+        {
+            uint64_t left = found.size - (k - n);
+            if (left < loh_min_lookback_length || (k == searched && block->candidates[k].size >= left))
+                continue;
+            block->candidates[k].dist = found.dist;
+            block->candidates[k].size = left;
+        }
+        n = end;
+    }
+}
+
+// moves block to start at start, puts everything up to its end in the hashmap, and finds its candidates
+static void loh_match_block_find(loh_match_block * block, loh_hashmap * hashmap, uint64_t start, uint64_t * inserted_end, uint64_t lazy_length, const loh_params * params)
+{
+    block->lazy_length = lazy_length;
+    block->start = start;
+    block->len = block->input_len - start < block->cap ? block->input_len - start : block->cap;
+    uint64_t end = start + block->len;
+    for (uint64_t p = *inserted_end; p < end && p + hashmap->hash_length < block->input_len; p++)
+        hashmap_insert(hashmap, hashmap_hash_raw(&block->input[p], hashmap->hash_length), p);
+    if (end > *inserted_end)
+        *inserted_end = end;
+    
+    block->hashmap = hashmap;
+    if (hashmap->chain_len)
+        params->parallel_for(params->parallel_arg, loh_match_block_job, block, LOH_MATCH_PIECES);
+    else
+        memset(block->candidates, 0, sizeof(loh_match_candidate) * block->len);
+}
+
+// like hashmap_get_if_efficient, but picks from the block's candidates; positions outside of the block have none
+static inline uint64_t loh_match_block_get_if_efficient(const loh_match_block * block, const size_t i, const size_t pre_context, uint64_t * out_size, size_t * out_back_distance)
+{
+    if (i < block->start || i - block->start >= block->len)
+        return -1;
+    const loh_match_candidate * candidate = &block->candidates[i - block->start];
+    if (candidate->size == 0)
+        return -1;
+    
+    const uint8_t * input = block->input;
+    uint64_t loc = i - candidate->dist;
+    uint64_t size = candidate->size;
+    size_t d = loh_match_length_back(&input[i], &input[loc], loc < pre_context ? loc : pre_context);
+    loc -= d;
+    size += d;
+    if (!loh_match_is_efficient(candidate->dist, size, pre_context))
+        return -1;
+    *out_size = size;
+    *out_back_distance = d;
+    return loc;
+}
+
+// a match found by the long-distance match finder
+typedef struct {
+    uint64_t pos;
+    uint64_t loc;
+    uint64_t size;
+} loh_ldm_match;
+
+// for finding long-distance matches
+// only about one in 2^LOH_LDM_RATE_BITS positions is remembered, picked by the rolling hash of the LOH_LDM_WINDOW bytes
+//  before it, so that the same positions get picked wherever the same data shows up again
+typedef struct {
+    uint64_t * table;
+    uint8_t alloc_bits;
+    // loh_ldm_match entries, in order, not overlapping
+    loh_byte_buffer matches;
+    const loh_allocator * allocator;
+} loh_ldm;
+
+static void loh_ldm_free(loh_ldm * ldm)
+{
+    bytes_free(&ldm->matches);
+    loh_dealloc(ldm->allocator, ldm->table);
+    ldm->table = 0;
+    ldm->alloc_bits = 0;
+}
+
+static inline uint8_t loh_ldm_table_bits(uint64_t input_len)
+{
+    uint8_t bits = loh_ceil_log2(input_len >> LOH_LDM_RATE_BITS);
+    if (bits < 8)
+        bits = 8;
+    return bits < LOH_LDM_HASH_SIZE ? bits : LOH_LDM_HASH_SIZE;
+}
+
+// finds long repeats in input for lookback_compress to use, none of which start before start (the end of the dictionary)
+// if allocation fails, it finds nothing
+static void loh_ldm_find(loh_ldm * ldm, const uint8_t * input, uint64_t input_len, uint64_t start)
+{
+    ldm->matches.len = 0;
+    if (input_len < LOH_LDM_WINDOW * 2)
+        return;
+    
+    uint8_t bits = loh_ldm_table_bits(input_len);
+    if (!ldm->table || ldm->alloc_bits < bits)
+    {
+        loh_dealloc(ldm->allocator, ldm->table);
+        ldm->table = (uint64_t *)loh_alloc(ldm->allocator, sizeof(uint64_t) << bits);
+        ldm->alloc_bits = ldm->table ? bits : 0;
+        if (!ldm->table)
+            return;
+    }
+    memset(ldm->table, 0, sizeof(uint64_t) << bits);
+    const uint64_t mask = (((uint64_t)1) << bits) - 1;
+    
+    // polynomial rolling hash; its top bits depend on every byte in the window
+    const uint64_t mul = 0x9E3779B97F4A7C15;
+    uint64_t mul_out = 1;
+    for (size_t k = 0; k < LOH_LDM_WINDOW; k++)
+        mul_out *= mul;
+    
+    // matches can't start before this (in the dictionary, or in the previous match)
+    uint64_t min_pos = start;
+    // just past the end of the window
+    uint64_t p = 0;
+    uint64_t h = 0;
+    int restart = 1;
+    while (1)
+    {
+        // the hash starts over after each match, since the next match can't overlap it anyway
+        if (restart)
+        {
+            if (p + LOH_LDM_WINDOW > input_len)
+                break;
+            h = 0;
+            for (size_t k = 0; k < LOH_LDM_WINDOW; k++)
+                h = h * mul + input[p++];
+            restart = 0;
+        }
         
-        if (overhead < size)
+        if ((h >> (64 - LOH_LDM_RATE_BITS)) == 0)
         {
-            *out_size = size;
-            *out_back_distance = back_distance;
-            return found_loc;
+            uint64_t * entry = &ldm->table[(h >> (64 - LOH_LDM_RATE_BITS - bits)) & mask];
+            uint64_t prev = *entry;
+            *entry = p;
+            
+            uint64_t a = prev - LOH_LDM_WINDOW;
+            uint64_t b = p - LOH_LDM_WINDOW;
+            if (prev && b >= min_pos && memcmp(&input[a], &input[b], LOH_LDM_WINDOW) == 0)
+            {
+                uint64_t end = p + loh_match_length(&input[p], &input[p - (b - a)], input_len - p);
+                uint64_t back = loh_match_length_back(&input[b], &input[a], b - min_pos < a ? b - min_pos : a);
+                a -= back;
+                b -= back;
+                
+                loh_ldm_match match = {b, a, end - b};
+                bytes_push(&ldm->matches, (const uint8_t *)&match, sizeof(loh_ldm_match));
+                min_pos = end;
+                p = end;
+                restart = 1;
+                continue;
+            }
         }
+        
+        if (p >= input_len)
+            break;
+        h = h * mul + input[p] - input[p - LOH_LDM_WINDOW] * mul_out;
+        p += 1;
     }
-    return -1;
 }
 
-static loh_byte_buffer lookback_compress(const uint8_t * input, uint64_t input_len, int8_t quality_level)
+// state for loh_params.target_speed, kept from one chunk to the next
+typedef struct {
+    // when the chunk has to be done by, and when its lookback stage started
+    double end;
+    double lookback_start;
+    // how long the last chunk's entropy coding took per byte, to leave time for this chunk's
+    double entropy_time;
+    // the chain length the last chunk ended up at, which the next one starts at
+    uint32_t chain_len;
+    uint8_t has_chain_len;
+    // whether the chunk looks incompressible enough to stop looking for matches entirely (chain length 0) if it's behind;
+    //  otherwise, entropy coding all the extra literals would cost more time than it saves
+    uint8_t allow_off;
+} loh_speed_control;
+
+// halves the chain length if the lookback stage is behind schedule, or doubles it if it's well ahead
+// done out of total bytes have been coded into out_len bytes so far; time is left for entropy coding what's left of the
+//  chunk after lookback, assuming the rest compresses as well
+static inline void loh_speed_adjust(const loh_speed_control * speed, uint32_t * chain_len, uint32_t max_chain_len, uint64_t done, uint64_t total, uint64_t out_len)
 {
-    loh_hashmap hashmap;
-    hashmap.hashtable = (uint32_t *)LOH_MALLOC(sizeof(uint32_t *) * (1 << LOH_HASH_SIZE));
-    hashmap.prevlink = (uint32_t *)LOH_MALLOC(sizeof(uint32_t *) * (1 << LOH_PREVLINK_SIZE));
-    memset(hashmap.hashtable, 0, sizeof(uint32_t *) * (1 << LOH_HASH_SIZE));
-    memset(hashmap.prevlink, 0, sizeof(uint32_t *) * (1 << LOH_PREVLINK_SIZE));
-    hashmap.chain_len = (1 << (quality_level - 1));
-    hashmap.max_distance = (1 << (quality_level + 12));
-
-    loh_byte_buffer ret = {0, 0, 0};
-    
-    byte_push(&ret, input_len & 0xFF);
-    byte_push(&ret, (input_len >> 8) & 0xFF);
-    byte_push(&ret, (input_len >> 16) & 0xFF);
-    byte_push(&ret, (input_len >> 24) & 0xFF);
-    byte_push(&ret, (input_len >> 32) & 0xFF);
-    byte_push(&ret, (input_len >> 40) & 0xFF);
-    byte_push(&ret, (input_len >> 48) & 0xFF);
-    byte_push(&ret, (input_len >> 56) & 0xFF);
-    
-    uint64_t i = 0;
+    double now = LOH_SPEED_TIME();
+    double lookback_end = speed->end - speed->entropy_time * total * ((double)out_len / done);
+    double expected = speed->lookback_start + (lookback_end - speed->lookback_start) * ((double)done / total);
+    if (now > expected)
+        *chain_len = (*chain_len > 1 || speed->allow_off) ? *chain_len / 2 : *chain_len;
+    else if (now - speed->lookback_start < (expected - speed->lookback_start) * 0.75 && *chain_len < max_chain_len)
+        *chain_len = (*chain_len == 0) ? 1 : (*chain_len * 2 < max_chain_len) ? *chain_len * 2 : max_chain_len;
+}
+
+// huffman codes a lookback stream while lookback_compress is still writing it, a block at a time (or LOH_HUFF_BATCH at a
+//  time, through parallel_for), so each block is coded while it's still in cache and only the part of the stream that
+//  hasn't been coded yet has to be kept around; the result is the same as huff_pack's for the whole stream
+typedef struct {
+    loh_bit_buffer out;
+    // not null if blocks go through params->parallel_for, in slots (see huff_pack_blocks)
+    const loh_params * params;
+    uint8_t * slots;
+    // how much of the stream to wait for before coding it
+    size_t batch_size;
+    // how much of the stream has been coded so far
+    uint64_t coded;
+    uint64_t table_bytes;
+    // if timed is set, how long the coding has taken so far (with LOH_STATS_TIME), so loh_stats can count it as entropy
+    //  coding rather than lookback
+    uint8_t timed;
+    double time;
+} loh_huff_stream;
+
+static size_t loh_huff_stream_push(loh_huff_stream * stream, const uint8_t * data, size_t len);
+
+// appends the lookback-coded input to ret, using (and reinitializing) the given hashmap
+// the first dict_len bytes of input are a dictionary; matches can reference it, but it isn't coded itself
+// forced matches (from loh_ldm_find) are always used, and other matches are cut short so they don't run into them
+// if speed isn't null, the chain length is adjusted as it goes (see loh_params.target_speed)
+// if sink isn't null, the output is handed to it as it's written, and ret is only left with what it hasn't taken
+// params, forced, speed, stats, and sink may be null
+// returns 0 if allocation fails
+static LOH_FORCE_INLINE int lookback_compress_with(loh_byte_buffer * _ret, const uint8_t * input, uint64_t input_len, uint64_t dict_len, const loh_ldm_match * forced, size_t forced_count, int8_t quality_level, const loh_params * params, loh_hashmap * _hashmap, loh_speed_control * speed, loh_chunk_stats * stats, loh_huff_stream * sink, const uint8_t hash_length)
+{
+    if (!hashmap_init(_hashmap, params, quality_level, input_len))
+        return 0;
+    
+    // work on local copies so the compiler doesn't have to assume they alias anything
+    loh_byte_buffer ret = *_ret;
+    loh_hashmap hashmap = *_hashmap;
+    
+    const uint64_t max_lazy_length = (params && params->lazy_length) ? params->lazy_length : 64;
+    uint64_t lazy_length = max_lazy_length;
+    
+    
+    uint64_t coded_len = input_len - dict_len;
+    size_t start_len = ret.len;
+    byte_push(&ret, coded_len & 0xFF);
+    byte_push(&ret, (coded_len >> 8) & 0xFF);
+    byte_push(&ret, (coded_len >> 16) & 0xFF);
+    byte_push(&ret, (coded_len >> 24) & 0xFF);
+    byte_push(&ret, (coded_len >> 32) & 0xFF);
+    byte_push(&ret, (coded_len >> 40) & 0xFF);
+    byte_push(&ret, (coded_len >> 48) & 0xFF);
+    byte_push(&ret, (coded_len >> 56) & 0xFF);
+    
+    for (uint64_t j = 0; j < dict_len && j + hash_length < input_len; j++)
+        hashmap_insert(&hashmap, hashmap_hash_raw(&input[j], hash_length), j);
+    
+    // parallel match finding; if the candidates can't be allocated, it just searches as it goes instead
+    loh_match_block block;
+    memset(&block, 0, sizeof(loh_match_block));
+    uint64_t inserted_end = dict_len;
+    if (params && params->parallel_for)
+    {
+        block.input = input;
+        block.input_len = input_len;
+        block.cap = (hashmap.prevlink_mask + 1) / 8;
+        if (block.cap < 4096)
+            block.cap = 4096;
+        if (block.cap > (hashmap.prevlink_mask + 1) / 2)
+            block.cap = (hashmap.prevlink_mask + 1) / 2;
+        if (block.cap > coded_len)
+            block.cap = coded_len;
+        block.candidates = (loh_match_candidate *)loh_alloc(hashmap.allocator, sizeof(loh_match_candidate) * (block.cap ? block.cap : 1));
+        // each block goes into the hashmap before it's searched, so entries up to block.cap positions short of a whole
+        //  window back might already have been reused
+        if (block.candidates && hashmap.max_distance > hashmap.prevlink_mask + 1 - block.cap)
+            hashmap.max_distance = hashmap.prevlink_mask + 1 - block.cap;
+    }
+    
+    uint32_t max_chain_len = hashmap.chain_len;
+    uint64_t next_check = (uint64_t)-1;
+    if (speed)
+    {
+        if (speed->chain_len < max_chain_len)
+            hashmap.chain_len = speed->chain_len;
+        next_check = dict_len + LOH_SPEED_STEP;
+    }
+    
+    uint64_t i = dict_len;
     uint64_t l = 0;
     uint64_t found_size = 0;
     uint64_t found_loc = 0;
+    uint64_t forced_pos = forced_count ? forced->pos : (uint64_t)-1;
+    uint8_t found_forced = 0;
     while (i < input_len)
     {
         // store a literal if we found no lookback
         uint64_t size = 0;
         while (i + size < input_len)
         {
+            if (i + size >= next_check)
+            {
+                next_check += LOH_SPEED_STEP;
+                loh_speed_adjust(speed, &hashmap.chain_len, max_chain_len, i + size - dict_len, coded_len, (sink ? sink->coded : 0) + ret.len - start_len);
+                // lazy matching doubles the searching, so it's the next thing to go once the chain can't get any shorter
+                lazy_length = hashmap.chain_len > 1 ? max_lazy_length : 0;
+            }
+            
+            if (i + size == forced_pos)
+            {
+                found_loc = forced->loc;
+                found_size = forced->size;
+                found_forced = 1;
+                forced += 1;
+                forced_count -= 1;
+                forced_pos = forced_count ? forced->pos : (uint64_t)-1;
+                break;
+            }
+            
+            if (block.candidates && i + size - block.start >= block.len)
+                loh_match_block_find(&block, &hashmap, i + size, &inserted_end, lazy_length, params);
+            
             size_t back_distance = 0;
-            if (i + size + LOH_HASH_LENGTH < input_len)
-                found_loc = hashmap_get_if_efficient(&hashmap, i + size, input, input_len, size, &found_size, &back_distance);
+            // the same hash is used to search and then to insert
+            uint32_t hash = 0;
+            if (i + size + hash_length < input_len && hashmap.chain_len)
+            {
+                if (block.candidates)
+                    found_loc = loh_match_block_get_if_efficient(&block, i + size, size, &found_size, &back_distance);
+                else
+                {
+                    hash = hashmap_hash_raw(&input[i + size], hash_length);
+                    found_loc = hashmap_get_if_efficient(&hashmap, i + size, hash, input, input_len, size, &found_size, &back_distance);
+                }
+            }
             if (found_size != 0)
             {
                 // zlib-style "lazy" search: only confirm the match if the next byte isn't a good match too
-                if (found_size < 64 && i + size + 1 + LOH_HASH_LENGTH < input_len)
+                if (found_size < lazy_length && i + size + 1 + hash_length < input_len && i + size + 1 < forced_pos)
                 {
                     uint64_t found_size_2 = 0;
                     size_t back_distance_2 = 0;
-                    uint64_t found_loc_2 = hashmap_get_if_efficient(&hashmap, i + size + 1, input, input_len, size + 1, &found_size_2, &back_distance_2);
+                    uint64_t found_loc_2;
+                    uint32_t hash_2 = 0;
+                    if (block.candidates)
+                        found_loc_2 = loh_match_block_get_if_efficient(&block, i + size + 1, size + 1, &found_size_2, &back_distance_2);
+                    else
+                    {
+                        hash_2 = hashmap_hash_raw(&input[i + size + 1], hash_length);
+                        found_loc_2 = hashmap_get_if_efficient(&hashmap, i + size + 1, hash_2, input, input_len, size + 1, &found_size_2, &back_distance_2);
+                    }
                     if (found_size_2 >= found_size + 1)
                     {
                         size += 1;
+                        hash = hash_2;
                         found_loc = found_loc_2;
                         found_size = found_size_2;
                         back_distance = back_distance_2;
                     }
                 }
+                // don't run into the next forced match; if that leaves too little of the match to be worth it, drop it
+                uint64_t match_start = i + size - back_distance;
+                if (match_start + found_size > forced_pos)
+                    found_size = forced_pos - match_start >= loh_min_lookback_length + 4 ? forced_pos - match_start : 0;
                 if (found_size != 0)
                 {
                     size -= back_distance;
                     break;
                 }
             }
-            // need to update the hashmap mid-literal
-            if (i + size + LOH_HASH_LENGTH < input_len)
-                hashmap_insert(&hashmap, &input[i + size], i + size);
+            // need to update the hashmap mid-literal (unless the block already did)
+            if (i + size + hash_length < input_len && hashmap.chain_len && !block.candidates)
+                hashmap_insert(&hashmap, hash, i + size);
             size += 1;
         }
         
@@ -461,6 +1863,12 @@ static loh_byte_buffer lookback_compress(const uint8_t * input, uint64_t input_l
             
             bytes_push(&ret, &input[i], size);
             i += size;
+            
+            if (stats)
+            {
+                stats->literal_run_count += 1;
+                stats->literal_bytes += size;
+            }
         }
         // check for lookback hit
         if (found_size != 0)
@@ -475,17 +1883,26 @@ static loh_byte_buffer lookback_compress(const uint8_t * input, uint64_t input_l
                 exit(-1);
             }
             
-            // advance cursor and update hashmap
-            uint64_t start_i = i;
-            i += 1;
-            for (size_t j = 1; j < found_size; j++)
+            if (stats)
             {
-                if (i + LOH_HASH_LENGTH < input_len)
-                    hashmap_insert(&hashmap, &input[i], i);
-                i += 1;
+                stats->match_count += 1;
+                stats->long_match_count += found_forced;
+                stats->match_length_hist[loh_stats_bin(found_size)] += 1;
+                stats->match_distance_hist[loh_stats_bin(dist)] += 1;
+            }
+            
+            // advance cursor and update hashmap (unless the next block is going to)
+            if (block.candidates)
+                i += found_size;
+            else
+            {
+                // in order, since each entry only links back to earlier positions
+                uint64_t end = i + found_size;
+                uint64_t insert_end = input_len - hash_length < end ? input_len - hash_length : end;
+                for (; i < insert_end; i++)
+                    hashmap_insert(&hashmap, hashmap_hash_raw(&input[i], hash_length), i);
+                i = end;
             }
-            if (start_i + LOH_HASH_LENGTH < input_len)
-                hashmap_insert(&hashmap, &input[start_i], start_i);
             
             size_t write_size = found_size - loh_min_lookback_length;
             
@@ -537,14 +1954,39 @@ static loh_byte_buffer lookback_compress(const uint8_t * input, uint64_t input_l
             }
             
             found_size = 0;
+            found_forced = 0;
+        }
+        
+        // hand over whatever's ready to be coded, keeping only the rest
+        if (sink && ret.data && ret.len - start_len >= sink->batch_size)
+        {
+            size_t taken = loh_huff_stream_push(sink, &ret.data[start_len], ret.len - start_len);
+            memmove(&ret.data[start_len], &ret.data[start_len + taken], ret.len - start_len - taken);
+            ret.len -= taken;
         }
     }
-    LOH_FREE(hashmap.hashtable);
-    LOH_FREE(hashmap.prevlink);
     
-    return ret;
+    if (speed)
+    {
+        speed->chain_len = hashmap.chain_len;
+        speed->has_chain_len = 1;
+    }
+    
+    loh_dealloc(hashmap.allocator, block.candidates);
+    *_ret = ret;
+    return ret.data != 0;
+}
+
+// the hash length is a constant in each copy of the loop, so the default one doesn't pay for the longer ones
+static int lookback_compress(loh_byte_buffer * _ret, const uint8_t * input, uint64_t input_len, uint64_t dict_len, const loh_ldm_match * forced, size_t forced_count, int8_t quality_level, const loh_params * params, loh_hashmap * _hashmap, loh_speed_control * speed, loh_chunk_stats * stats, loh_huff_stream * sink)
+{
+    uint8_t hash_length = loh_hash_length(params);
+    if (hash_length == LOH_HASH_LENGTH)
+        return lookback_compress_with(_ret, input, input_len, dict_len, forced, forced_count, quality_level, params, _hashmap, speed, stats, sink, LOH_HASH_LENGTH);
+    return lookback_compress_with(_ret, input, input_len, dict_len, forced, forced_count, quality_level, params, _hashmap, speed, stats, sink, hash_length);
 }
 
+
 typedef struct _huff_node {
     struct _huff_node * children[2];
     int64_t freq;
@@ -554,18 +1996,20 @@ typedef struct _huff_node {
     uint8_t symbol;
 } huff_node_t;
 
-static huff_node_t * alloc_huff_node()
-{
-    return (huff_node_t *)LOH_MALLOC(sizeof(huff_node_t));
-}
+// a tree for 256 symbols never needs more than 511 nodes, so each block's nodes come out of a fixed pool
+typedef struct {
+    huff_node_t nodes[511];
+    size_t used;
+} huff_node_pool_t;
 
-static void free_huff_nodes(huff_node_t * node)
+static huff_node_t * alloc_huff_node(huff_node_pool_t * pool)
 {
-    if (node->children[0])
-        free_huff_nodes(node->children[0]);
-    if (node->children[1])
-        free_huff_nodes(node->children[1]);
-    LOH_FREE(node);
+    if (pool->used >= sizeof(pool->nodes) / sizeof(pool->nodes[0]))
+    {
+        fprintf(stderr, "LOH internal error: ran out of huffman tree nodes\n");
+        exit(-1);
+    }
+    return &pool->nodes[pool->used++];
 }
 
 static void push_code(huff_node_t * node, uint8_t bit)
@@ -603,897 +2047,3480 @@ static int huff_len_compare(const void * a, const void * b)
         return 1;
     return 0;
 }
-static loh_bit_buffer huff_pack(uint8_t * data, size_t len)
+// huffman codes one of huff_pack's blocks into ret, which has to be at the start of a byte (or fresh)
+// returns how many bytes of it were the block header and code table
+static uint64_t huff_pack_block(loh_bit_buffer * ret, const uint8_t * data, size_t len)
 {
-    // set up buffers and start pushing data to them
-    loh_bit_buffer ret;
-    memset(&ret, 0, sizeof(loh_bit_buffer));
-    bits_push(&ret, len, 8*8);
+    size_t start_byte = bits_bytes_used(ret);
+    uint64_t header_overhead_bytes = 0;
     
-    // The huffman stage is split up into chunks, so that each chunk can have a more ideal huffman code.
-    // The chunk size is arbitrary, but for the sake of simplicity, this encoder uses a fixed 32k chunk size.
-    // Each chunk is prefixed with a byte-aligned 32-bit integer giving the number of output tokens in the chunk.
+    bits_push(ret, len, 8*4);
     
-    uint64_t chunk_size = (1 << 15);
-    uint64_t chunk_count = (len + chunk_size - 1) / chunk_size;
+    // build huff dictionary
     
-    //uint64_t header_overhead_bytes = 0;
+    // count bytes, then sort them
+    uint64_t counts[256] = {0};
+    uint64_t total_count = len;
+    for (size_t i = 0; i < len; i += 1)
+        counts[data[i]] += 1;
+    // we stuff the byte identity into the bottom 8 bits
+    size_t symbol_count = 0;
+    for (size_t b = 0; b < 256; b++)
+    {
+        if (counts[b])
+            symbol_count += 1;
+        counts[b] = (counts[b] << 8) | b;
+    }
     
-    //size_t diff_counts[256] = {0};
+    qsort(&counts, 256, sizeof(uint64_t), count_compare);
     
-    for (uint32_t chunk = 0; chunk < chunk_count; chunk += 1)
+    // we want to generate a length-limited code with a maximum of 15 bits...
+    // ... which means that the minimum frequency must be at least 1/(1<<14) of the total count
+    // (we give ourselves 1 bit of leniency because the algorithm isn't perfect)
+    if (symbol_count > 0)
     {
-        size_t chunk_start = chunk * chunk_size;
-        size_t chunk_end = (chunk + 1) * chunk_size;
-        if (chunk + 1 == chunk_count)
-            chunk_end = len;
-        
-        uint8_t * _data = &data[chunk_start];
-        uint8_t * data = _data;
-        size_t len = chunk_end - chunk_start;
-        
-        // the bit buffer is forcibly aligned to the start of the next byte at the start of the chunk
-        if (ret.bit_index != 0)
-            ret.bit_index = 8;
-        
-        bits_push(&ret, len, 8*4);
-        
-        //header_overhead_bytes += 4;
-        
-        // build huff dictionary
-        
-        // count bytes, then sort them
-        uint64_t counts[256] = {0};
-        uint64_t total_count = len;
-        for (size_t i = 0; i < len; i += 1)
-            counts[data[i]] += 1;
-        // we stuff the byte identity into the bottom 8 bits
-        size_t symbol_count = 0;
-        for (size_t b = 0; b < 256; b++)
-        {
-            if (counts[b])
-                symbol_count += 1;
-            counts[b] = (counts[b] << 8) | b;
-        }
-        
-        qsort(&counts, 256, sizeof(uint64_t), count_compare);
-        
-        // we want to generate a length-limited code with a maximum of 15 bits...
-        // ... which means that the minimum frequency must be at least 1/(1<<14) of the total count
-        // (we give ourselves 1 bit of leniency because the algorithm isn't perfect)
-        if (symbol_count > 0)
+        const uint64_t n = 1 << 14;
+        // use ceiled division to make super extra sure that we don't go over 1/16k
+        uint64_t min_ok_count = (total_count + n - 1) / n;
+        while ((counts[symbol_count-1] >> 8) < min_ok_count)
         {
-            const uint64_t n = 1 << 14;
-            // use ceiled division to make super extra sure that we don't go over 1/16k
-            uint64_t min_ok_count = (total_count + n - 1) / n;
-            while ((counts[symbol_count-1] >> 8) < min_ok_count)
+            for (int i = symbol_count-1; i >= 0; i -= 1)
             {
-                for (int i = symbol_count-1; i >= 0; i -= 1)
+                // We use an x = max(minimum, x) approach instead of just adding to every count, because
+                //  if we never add to the most frequent item's frequency, we will definitely converge.
+                // (Specifically, this is guaranteed to converge if there are 16k or less symbols in
+                //  the dictionary, which there are. There are only 256 at most.)
+                // More proof of convergence: We will eventually add less than 16k to "total_count"
+                //  two `while` iterations in a row, which will cause min_ok_count to stop changing.
+                if (counts[i] >> 8 < min_ok_count)
                 {
-                    // We use an x = max(minimum, x) approach instead of just adding to every count, because
-                    //  if we never add to the most frequent item's frequency, we will definitely converge.
-                    // (Specifically, this is guaranteed to converge if there are 16k or less symbols in
-                    //  the dictionary, which there are. There are only 256 at most.)
-                    // More proof of convergence: We will eventually add less than 16k to "total_count"
-                    //  two `while` iterations in a row, which will cause min_ok_count to stop changing.
-                    if (counts[i] >> 8 < min_ok_count)
-                    {
-                        uint64_t diff = min_ok_count - (counts[i] >> 8);
-                        counts[i] += diff << 8;
-                        total_count += diff;
-                    }
-                    else
-                        break;
+                    uint64_t diff = min_ok_count - (counts[i] >> 8);
+                    counts[i] += diff << 8;
+                    total_count += diff;
                 }
-                min_ok_count = (total_count + n - 1) / n;
+                else
+                    break;
             }
+            min_ok_count = (total_count + n - 1) / n;
         }
+    }
+    
+    // set up raw huff nodes
+    huff_node_pool_t pool;
+    pool.used = 0;
+    huff_node_t * unordered_dict[256];
+    for (size_t i = 0; i < 256; i += 1)
+    {
+        unordered_dict[i] = alloc_huff_node(&pool);
+        unordered_dict[i]->symbol = counts[i] & 0xFF;
+        unordered_dict[i]->code = 0;
+        unordered_dict[i]->code_len = 0;
+        unordered_dict[i]->freq = counts[i] >> 8;
+        unordered_dict[i]->children[0] = 0;
+        unordered_dict[i]->children[1] = 0;
+    }
+    
+    // set up byte name -> huff node dict
+    huff_node_t * dict[256];
+    for (size_t i = 0; i < 256; i += 1)
+        dict[unordered_dict[i]->symbol] = unordered_dict[i];
+    
+    // set up tree generation queues
+    huff_node_t * queue[512];
+    memset(queue, 0, sizeof(queue));
+    
+    size_t queue_count = 256;
+    
+    for (size_t i = 0; i < 256; i += 1)
+        queue[i] = unordered_dict[i];
+    
+    // remove zero-frequency items from the input queue
+    while (queue_count > 0 && queue[queue_count - 1]->freq == 0)
+        queue_count -= 1;
+    
+    // start pumping through the queues
+    while (queue_count > 1)
+    {
+        huff_node_t * lowest = queue[queue_count - 1];
+        huff_node_t * next_lowest = queue[queue_count - 2];
         
-        // set up raw huff nodes
-        huff_node_t * unordered_dict[256];
-        for (size_t i = 0; i < 256; i += 1)
+        queue_count -= 2;
+        
+        if (!lowest || !next_lowest)
         {
-            unordered_dict[i] = alloc_huff_node();
-            unordered_dict[i]->symbol = counts[i] & 0xFF;
-            unordered_dict[i]->code = 0;
-            unordered_dict[i]->code_len = 0;
-            unordered_dict[i]->freq = counts[i] >> 8;
-            unordered_dict[i]->children[0] = 0;
-            unordered_dict[i]->children[1] = 0;
+            fprintf(stderr, "LOH internal error: failed to find lowest-frequency nodes\n");
+            exit(-1);
         }
         
-        // set up byte name -> huff node dict
-        huff_node_t * dict[256];
-        for (size_t i = 0; i < 256; i += 1)
-            dict[unordered_dict[i]->symbol] = unordered_dict[i];
+        // make new node
+        huff_node_t * new_node = alloc_huff_node(&pool);
+        new_node->symbol = 0;
+        new_node->code = 0;
+        new_node->code_len = 0;
+        new_node->freq = lowest->freq + next_lowest->freq;
+        new_node->children[0] = next_lowest;
+        new_node->children[1] = lowest;
         
-        // set up tree generation queues
-        huff_node_t * queue[512];
-        memset(queue, 0, sizeof(queue));
+        push_code(new_node->children[0], 0);
+        push_code(new_node->children[1], 1);
         
-        size_t queue_count = 256;
-        
-        for (size_t i = 0; i < 256; i += 1)
-            queue[i] = unordered_dict[i];
-        
-        // remove zero-frequency items from the input queue
-        while (queue_count > 0 && queue[queue_count - 1]->freq == 0)
+        // insert new element at end of array, then bubble it down to the correct place
+        queue[queue_count] = new_node;
+        queue_count += 1;
+        if (queue_count > 512)
         {
-            free_huff_nodes(queue[queue_count - 1]);
-            queue_count -= 1;
+            fprintf(stderr, "LOH internal error: huffman tree generation too deep\n");
+            exit(-1);
         }
-        
-        uint8_t queue_needs_free = 0;
-        // start pumping through the queues
-        while (queue_count > 1)
+        for (size_t i = queue_count - 1; i > 0; i -= 1)
         {
-            queue_needs_free = 1;
-            
-            huff_node_t * lowest = queue[queue_count - 1];
-            huff_node_t * next_lowest = queue[queue_count - 2];
-            
-            queue_count -= 2;
-            
-            if (!lowest || !next_lowest)
-            {
-                fprintf(stderr, "LOH internal error: failed to find lowest-frequency nodes\n");
-                exit(-1);
-            }
-            
-            // make new node
-            huff_node_t * new_node = alloc_huff_node();
-            new_node->symbol = 0;
-            new_node->code = 0;
-            new_node->code_len = 0;
-            new_node->freq = lowest->freq + next_lowest->freq;
-            new_node->children[0] = next_lowest;
-            new_node->children[1] = lowest;
-            
-            push_code(new_node->children[0], 0);
-            push_code(new_node->children[1], 1);
-            
-            // insert new element at end of array, then bubble it down to the correct place
-            queue[queue_count] = new_node;
-            queue_count += 1;
-            if (queue_count > 512)
+            if (queue[i]->freq >= queue[i-1]->freq)
             {
-                fprintf(stderr, "LOH internal error: huffman tree generation too deep\n");
-                exit(-1);
-            }
-            for (size_t i = queue_count - 1; i > 0; i -= 1)
-            {
-                if (queue[i]->freq >= queue[i-1]->freq)
-                {
-                    huff_node_t * temp = queue[i];
-                    queue[i] = queue[i-1];
-                    queue[i-1] = temp;
-                }
+                huff_node_t * temp = queue[i];
+                queue[i] = queue[i-1];
+                queue[i-1] = temp;
             }
         }
-        
-        // With the above done, our basic huffman tree is built. Now we need to canonicalize it.
-        // Canonicalization algorithms only work on sorted lists. Because of frequency ties, our
-        //  code list might not be sorted by code length. Let's fix that by sorting it first.
-        
-        qsort(&unordered_dict, symbol_count, sizeof(huff_node_t*), huff_len_compare);
-        
-        // If we only have one symbol, we need to ensure that it thinks it has a code length of exactly 1.
-        if (symbol_count == 1)
-            unordered_dict[0]->code_len = 1;
-        
-        // Now we ACTUALLY canonicalize the huffman code list.
-        
-        uint64_t canon_code = 0;
-        uint64_t canon_len = 0;
-        uint16_t codes_per_len[256] = {0};
-        for (size_t i = 0; i < symbol_count; i += 1)
+    }
+    
+    // With the above done, our basic huffman tree is built. Now we need to canonicalize it.
+    // Canonicalization algorithms only work on sorted lists. Because of frequency ties, our
+    //  code list might not be sorted by code length. Let's fix that by sorting it first.
+    
+    qsort(&unordered_dict, symbol_count, sizeof(huff_node_t*), huff_len_compare);
+    
+    // If we only have one symbol, we need to ensure that it thinks it has a code length of exactly 1.
+    if (symbol_count == 1)
+        unordered_dict[0]->code_len = 1;
+    
+    // Now we ACTUALLY canonicalize the huffman code list.
+    
+    uint64_t canon_code = 0;
+    uint64_t canon_len = 0;
+    uint16_t codes_per_len[256] = {0};
+    for (size_t i = 0; i < symbol_count; i += 1)
+    {
+        if (canon_code == 0)
         {
-            if (canon_code == 0)
-            {
-                canon_len = unordered_dict[i]->code_len;
-                codes_per_len[canon_len] += 1;
-                unordered_dict[i]->code = 0;
-                canon_code += 1;
-                continue;
-            }
-            if (unordered_dict[i]->code_len > canon_len)
-                canon_code <<= unordered_dict[i]->code_len - canon_len;
-            
             canon_len = unordered_dict[i]->code_len;
             codes_per_len[canon_len] += 1;
-            uint64_t code = canon_code;
-            // we store codes with the most significant huffman bit in the least significant word bit
-            // (this makes string encoding faster)
-            for (size_t b = 0; b < canon_len / 2; b++)
-            {
-                size_t b2 = canon_len - b - 1;
-                uint64_t diff = (!((code >> b) & 1)) != (!((code >> b2) & 1));
-                diff = (diff << b) | (diff << b2);
-                code ^= diff;
-            }
-            unordered_dict[i]->code = code;
-            
+            unordered_dict[i]->code = 0;
             canon_code += 1;
+            continue;
         }
-        uint8_t incompressible = canon_len == 8 && symbol_count == 256;
+        if (unordered_dict[i]->code_len > canon_len)
+            canon_code <<= unordered_dict[i]->code_len - canon_len;
         
-        /*
-        // Our canonical length-limited huffman code is finally done!
-        // To print it out (with modified frequencies):
-        uint8_t _prev_symbol = 0;
-        for (size_t c = 0; c < symbol_count; c += 1)
+        canon_len = unordered_dict[i]->code_len;
+        codes_per_len[canon_len] += 1;
+        uint64_t code = canon_code;
+        // we store codes with the most significant huffman bit in the least significant word bit
+        // (this makes string encoding faster)
+        for (size_t b = 0; b < canon_len / 2; b++)
         {
-            uint8_t d = unordered_dict[c]->symbol - _prev_symbol;
-            diff_counts[d] += 1;
-            _prev_symbol = unordered_dict[c]->symbol;
-            
-            printf("%02X: ", unordered_dict[c]->symbol);
-            for (size_t i = 0; i < unordered_dict[c]->code_len; i++)
-                printf("%c", ((unordered_dict[c]->code >> i) & 1) ? '1' : '0');
-            printf("\t %lld", unordered_dict[c]->freq);
-            puts("");
+            size_t b2 = canon_len - b - 1;
+            uint64_t diff = (!((code >> b) & 1)) != (!((code >> b2) & 1));
+            diff = (diff << b) | (diff << b2);
+            code ^= diff;
         }
-        */
-        
-        // Now we actually compress the input data.
-        
-        //size_t start_byte = ret.buffer.len;
+        unordered_dict[i]->code = code;
         
-        bit_push(&ret, incompressible);
-        
-        if (!incompressible)
+        canon_code += 1;
+    }
+    uint8_t incompressible = canon_len == 8 && symbol_count == 256;
+    
+    // Our canonical length-limited huffman code is finally done!
+    // Now we actually compress the input data.
+    
+    bit_push(ret, incompressible);
+    
+    if (!incompressible)
+    {
+        // push huffman code description
+        // start at code length 1
+        // bit 1: add 1 to code length
+        // bit 0: read next 8 bits as symbol for next code. add 1 to code
+        uint8_t prev_symbol = 0;
+        if (len > 0)
         {
-            // push huffman code description
-            // start at code length 1
-            // bit 1: add 1 to code length
-            // bit 0: read next 8 bits as symbol for next code. add 1 to code
-            uint8_t prev_symbol = 0;
-            if (len > 0)
+            bits_push(ret, symbol_count - 1, 8);
+            size_t code_depth = 1;
+            for (size_t i = 0; i < symbol_count; i++)
             {
-                bits_push(&ret, symbol_count - 1, 8);
-                size_t code_depth = 1;
-                for (size_t i = 0; i < symbol_count; i++)
+                while (code_depth < unordered_dict[i]->code_len)
                 {
-                    while (code_depth < unordered_dict[i]->code_len)
-                    {
-                        bit_push(&ret, 1);
-                        code_depth += 1;
-                    }
-                    bit_push(&ret, 0);
-                    uint8_t diff = unordered_dict[i]->symbol - prev_symbol;
-                    
-                    // stored as diffs
-                    // 0 : 1
-                    // 10 : 2
-                    // 110 : 3
-                    // 1110 : 4
-                    // 1111xxxxxxxx : other
-                    if (diff >= 1 && diff <= 4)
-                    {
-                        bits_push(&ret, 0xFF, diff - 1);
-                        bit_push(&ret, 0);
-                    }
-                    else
-                    {
-                        bits_push(&ret, 0xFF, 4);
-                        bits_push(&ret, diff, 8);
-                    }
-                    prev_symbol = unordered_dict[i]->symbol;
+                    bit_push(ret, 1);
+                    code_depth += 1;
+                }
+                bit_push(ret, 0);
+                uint8_t diff = unordered_dict[i]->symbol - prev_symbol;
+                
+                // stored as diffs
+                // 0 : 1
+                // 10 : 2
+                // 110 : 3
+                // 1110 : 4
+                // 1111xxxxxxxx : other
+                if (diff >= 1 && diff <= 4)
+                {
+                    bits_push(ret, 0xFF, diff - 1);
+                    bit_push(ret, 0);
+                }
+                else
+                {
+                    bits_push(ret, 0xFF, 4);
+                    bits_push(ret, diff, 8);
                 }
+                prev_symbol = unordered_dict[i]->symbol;
             }
-            
-            //size_t end_byte = ret.buffer.len;
-            
-            //header_overhead_bytes += end_byte - start_byte + 1;
-            
-            // the bit buffer is forcibly aligned to the start of the next byte at the end of the huff tree
-            if (ret.bit_index != 0)
-                ret.bit_index = 8;
-            
-            // push huffman-coded string
-            for (size_t i = 0; i < len; i++)
-                bits_push(&ret, dict[data[i]]->code, dict[data[i]]->code_len);
-            
-            // despite all we've done to them, our huffman tree nodes still have their child pointers intact
-            // so we can recursively free all our nodes all at once
-            if (queue_needs_free)
-                free_huff_nodes(queue[0]);
-            // if we only have 0 or 1 nodes, then the queue doesn't run, so we need to free them directly
-            // (only if there are actually any nodes, though)
-            else if (symbol_count == 1)
-                free_huff_nodes(unordered_dict[0]);
-        }
-        else
-        {
-            // the bit buffer is forcibly aligned to the start of the next byte before incompressible data
-            if (ret.bit_index != 0)
-                ret.bit_index = 8;
-            
-            for (size_t i = 0; i < len; i++)
-                bits_push(&ret, data[i], 8);
         }
+        
+        // the bit buffer is forcibly aligned to the start of the next byte at the end of the huff tree
+        if (ret->bit_index != 0)
+            ret->bit_index = 8;
+        
+        header_overhead_bytes += bits_bytes_used(ret) - start_byte;
+        
+        // push huffman-coded string
+        for (size_t i = 0; i < len; i++)
+            bits_push(ret, dict[data[i]]->code, dict[data[i]]->code_len);
     }
-    
-    /*
-    for (size_t s = 0; s < 256; s += 1)
+    else
     {
-        printf("%02X : %d\n", s, diff_counts[s]);
+        // the bit buffer is forcibly aligned to the start of the next byte before incompressible data
+        if (ret->bit_index != 0)
+            ret->bit_index = 8;
+        
+        header_overhead_bytes += bits_bytes_used(ret) - start_byte;
+        
+        for (size_t i = 0; i < len; i++)
+            bits_push(ret, data[i], 8);
     }
-    */
     
-    //printf("huff table overhead: %lld\n", header_overhead_bytes);
-    return ret;
+    return header_overhead_bytes;
 }
 
-// passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
-// returned data must be freed by the caller; it was allocated with LOH_MALLOC
-static uint8_t * loh_compress(uint8_t * data, size_t len, uint8_t do_lookback, uint8_t do_huff, uint8_t do_diff, size_t * out_len)
+// Parallel huffman coding (see loh_params.parallel_for).
+// huff_pack's blocks each start on a fresh byte and have their own code, so nothing about one depends on another. A batch
+//  of them at a time is coded into separate slots in parallel, and then they're copied into place in order, which gives
+//  exactly the same output as coding them one after another.
+#define LOH_HUFF_BATCH 32
+// the most a block can come out to: its header and code table, then every byte at the longest code length (15 bits)
+#define LOH_HUFF_SLOT_SIZE (((size_t)1 << 15) * 2 + 1024)
+
+typedef struct {
+    const uint8_t * data;
+    size_t len;
+    uint64_t first_block;
+    uint8_t * slots;
+    loh_bit_buffer blocks[LOH_HUFF_BATCH];
+    uint64_t header_bytes[LOH_HUFF_BATCH];
+} loh_huff_batch;
+
+static void loh_huff_batch_job(void * _batch, size_t n)
 {
-    if (!data || !out_len) return 0;
-    
-    if (do_lookback > 12)
-        do_lookback = 12;
+    loh_huff_batch * batch = (loh_huff_batch *)_batch;
+    size_t start = (batch->first_block + n) << 15;
+    size_t end = batch->len - start > ((size_t)1 << 15) ? start + ((size_t)1 << 15) : batch->len;
     
-    uint32_t checksum = loh_checksum(data, len);
+    loh_bit_buffer * block = &batch->blocks[n];
+    memset(block, 0, sizeof(loh_bit_buffer));
+    block->buffer.data = &batch->slots[n * LOH_HUFF_SLOT_SIZE];
+    block->buffer.cap = LOH_HUFF_SLOT_SIZE;
+    block->buffer.borrowed = 1;
+    batch->header_bytes[n] = huff_pack_block(block, &batch->data[start], end - start);
+}
+
+// codes data as huff_pack's blocks, appending them to ret (each starting on a fresh byte), and returns how many bytes
+//  of them were block headers and code tables
+// if params isn't null and has a parallel_for, the blocks go through it, LOH_HUFF_BATCH at a time; slots has to have room
+//  for LOH_HUFF_BATCH blocks of LOH_HUFF_SLOT_SIZE bytes each then
+static uint64_t huff_pack_blocks(loh_bit_buffer * ret, const uint8_t * data, size_t len, const loh_params * params, uint8_t * slots)
+{
+    uint64_t chunk_count = (len + ((size_t)1 << 15) - 1) >> 15;
+    uint64_t header_overhead_bytes = 0;
     
-    // LOH files are composed of a series of arbitrary-length chunks.
-    // Chunks have their compressed and decompressed start addresses stored in the header,
-    //  and also the address just past the end of the last chunk (still for both).
-    // Compression config is stored on a per-chunk basis at the start of each compressed chunk.
-    // For the sake of simplicity, the reference compressor divides the file into at most N chunks,
-    //  or chunks with 32KB length, whichever gives bigger chunks.
-    // There is no maximum chunk size.
+    if (!params || !params->parallel_for)
+    {
+        for (uint64_t chunk = 0; chunk < chunk_count; chunk += 1)
+        {
+            size_t chunk_start = chunk << 15;
+            size_t chunk_end = chunk + 1 == chunk_count ? len : chunk_start + ((size_t)1 << 15);
+            
+            // the bit buffer is forcibly aligned to the start of the next byte at the start of the chunk
+            if (ret->bit_index != 0)
+                ret->bit_index = 8;
+            
+            header_overhead_bytes += huff_pack_block(ret, &data[chunk_start], chunk_end - chunk_start);
+        }
+        return header_overhead_bytes;
+    }
     
-    uint64_t chunk_div = 4;
-    uint64_t chunk_size = (len + chunk_div - 1) / chunk_div;
-    if (chunk_size < (1 << 15))
-        chunk_size = (1 << 15);
-    uint64_t chunk_count = (len + chunk_size - 1) / chunk_size;
+    loh_huff_batch batch;
+    batch.data = data;
+    batch.len = len;
+    batch.slots = slots;
+    for (uint64_t first = 0; first < chunk_count; first += LOH_HUFF_BATCH)
+    {
+        size_t count = chunk_count - first < LOH_HUFF_BATCH ? chunk_count - first : LOH_HUFF_BATCH;
+        batch.first_block = first;
+        params->parallel_for(params->parallel_arg, loh_huff_batch_job, &batch, count);
+        
+        // each block was coded from the start of an empty buffer, and goes at the start of the byte after the last one
+        for (size_t n = 0; n < count; n += 1)
+        {
+            const loh_bit_buffer * block = &batch.blocks[n];
+            bits_align_for_bytes(ret);
+            bytes_push(&ret->buffer, block->buffer.data, block->buffer.len);
+            ret->bit_index = block->bit_index;
+            ret->byte_index = ret->buffer.len - 1;
+            ret->bit_count += block->bit_count;
+            header_overhead_bytes += batch.header_bytes[n];
+        }
+    }
+    return header_overhead_bytes;
+}
+
+// appends to the given bit buffer, which must be fresh (it can point at a borrowed byte buffer, though)
+// if table_bytes isn't null, the number of bytes spent on block headers and code tables is added to it
+static void huff_pack(loh_bit_buffer * _ret, uint8_t * data, size_t len, uint64_t * table_bytes)
+{
+    // set up buffers and start pushing data to them
+    loh_bit_buffer ret = *_ret;
+    bits_push(&ret, len, 8*8);
     
-    //printf("%lld\n", chunk_count);
+    // The huffman stage is split up into chunks, so that each chunk can have a more ideal huffman code.
+    // The chunk size is arbitrary, but for the sake of simplicity, this encoder uses a fixed 32k chunk size.
+    // Each chunk is prefixed with a byte-aligned 32-bit integer giving the number of output tokens in the chunk.
+    uint64_t header_overhead_bytes = 8 + huff_pack_blocks(&ret, data, len, 0, 0);
     
-    loh_byte_buffer real_buf = {0, 0, 0};
+    if (table_bytes)
+        *table_bytes += header_overhead_bytes;
+    *_ret = ret;
+}
+
+// like huff_pack, but codes its blocks through params->parallel_for (see huff_pack_blocks)
+// gives up partway through if ret points at a borrowed byte buffer and outgrows it, since it's thrown away then anyway
+static void huff_pack_parallel(loh_bit_buffer * _ret, const uint8_t * data, size_t len, uint64_t * table_bytes, const loh_params * params, uint8_t * slots)
+{
+    loh_bit_buffer ret = *_ret;
+    uint8_t borrowed = ret.buffer.borrowed;
+    bits_push(&ret, len, 8*8);
     
-    bytes_push(&real_buf, (const uint8_t *)"LOHz", 4);
-    bytes_push(&real_buf, (uint8_t *)&checksum, 4);
-    bytes_push(&real_buf, (uint8_t *)&chunk_count, 8);
+    uint64_t header_overhead_bytes = 8;
+    const size_t batch_size = LOH_HUFF_BATCH << 15;
+    for (size_t start = 0; start < len && ret.buffer.data && ret.buffer.borrowed == borrowed; start += batch_size)
+        header_overhead_bytes += huff_pack_blocks(&ret, &data[start], len - start < batch_size ? len - start : batch_size, params, slots);
     
-    size_t chunk_table_loc = real_buf.len;
-    for (size_t i = 0; i < chunk_count + 1; i += 1)
+    if (table_bytes)
+        *table_bytes += header_overhead_bytes;
+    *_ret = ret;
+}
+
+// codes as many whole blocks from the start of data as there are, and returns how many bytes that was
+static size_t loh_huff_stream_push(loh_huff_stream * stream, const uint8_t * data, size_t len)
+{
+    len &= ~(((size_t)1 << 15) - 1);
+    double start = stream->timed ? LOH_STATS_TIME() : 0.0;
+    stream->table_bytes += huff_pack_blocks(&stream->out, data, len, stream->params, stream->slots);
+    stream->coded += len;
+    if (stream->timed)
+        stream->time += LOH_STATS_TIME() - start;
+    return len;
+}
+
+// codes the rest of the stream (whatever's after what was pushed) and fills in its length
+static void loh_huff_stream_end(loh_huff_stream * stream, const uint8_t * data, size_t len)
+{
+    double start = stream->timed ? LOH_STATS_TIME() : 0.0;
+    stream->table_bytes += huff_pack_blocks(&stream->out, data, len, stream->params, stream->slots);
+    stream->coded += len;
+    if (stream->timed)
+        stream->time += LOH_STATS_TIME() - start;
+    if (!stream->out.buffer.data)
+        return;
+    for (size_t n = 0; n < 8; n += 1)
+        stream->out.buffer.data[n] = (uint8_t)(stream->coded >> (n * 8));
+}
+
+// tANS (table-based asymmetric numeral system) coding, an alternative entropy coding stage to huffman coding.
+// Unlike huffman coding, it can spend fractional numbers of bits on each symbol.
+// Like the huffman stage, the stream is split up into 32k chunks, each with its own symbol frequency table.
+
+#define LOH_ANS_TABLE_LOG 11
+#define LOH_ANS_TABLE_SIZE (1 << LOH_ANS_TABLE_LOG)
+
+// scales symbol counts so that they add up to the table size, without letting any present symbol drop to zero
+static void ans_normalize(const uint64_t * counts, uint64_t total, uint16_t * norm)
+{
+    int64_t sum = 0;
+    size_t largest = 0;
+    for (size_t s = 0; s < 256; s++)
     {
-        uint64_t n = 0;
-        bytes_push(&real_buf, (uint8_t *)&n, 8);
-        bytes_push(&real_buf, (uint8_t *)&n, 8);
+        norm[s] = 0;
+        if (!counts[s])
+            continue;
+        uint64_t n = (counts[s] * LOH_ANS_TABLE_SIZE + total / 2) / total;
+        norm[s] = n ? n : 1;
+        sum += norm[s];
+        if (counts[s] > counts[largest])
+            largest = s;
+    }
+    // rounding up rare symbols can overshoot, so take the excess from whichever symbols have the most to spare
+    while (sum > LOH_ANS_TABLE_SIZE)
+    {
+        size_t biggest = 0;
+        for (size_t s = 1; s < 256; s++)
+        {
+            if (norm[s] > norm[biggest])
+                biggest = s;
+        }
+        norm[biggest] -= 1;
+        sum -= 1;
+    }
+    norm[largest] += LOH_ANS_TABLE_SIZE - sum;
+}
+
+// spreads symbols across the state table; encoder and decoder must do this identically
+static void ans_spread(const uint16_t * norm, uint8_t * spread)
+{
+    const size_t step = (LOH_ANS_TABLE_SIZE >> 1) + (LOH_ANS_TABLE_SIZE >> 3) + 3;
+    size_t pos = 0;
+    for (size_t s = 0; s < 256; s++)
+    {
+        for (size_t k = 0; k < norm[s]; k++)
+        {
+            spread[pos] = s;
+            pos = (pos + step) & (LOH_ANS_TABLE_SIZE - 1);
+        }
+    }
+}
+
+static inline void ans_push_symbol_diff(loh_bit_buffer * ret, uint8_t diff)
+{
+    // same as the huffman code table's symbol diffs
+    // 0 : 1
+    // 10 : 2
+    // 110 : 3
+    // 1110 : 4
+    // 1111xxxxxxxx : other
+    if (diff >= 1 && diff <= 4)
+    {
+        bits_push(ret, 0xFF, diff - 1);
+        bit_push(ret, 0);
+    }
+    else
+    {
+        bits_push(ret, 0xFF, 4);
+        bits_push(ret, diff, 8);
     }
-    size_t chunk_table_end = real_buf.len;
+}
+
+#define LOH_ANS_BLOCK_SIZE (1 << 15)
+
+// appends to the given bit buffer, which must be fresh (it can point at a borrowed byte buffer, though)
+// emit_bits and emit_len are scratch space with room for LOH_ANS_BLOCK_SIZE entries
+// if table_bytes isn't null, the number of bytes spent on block headers and frequency tables is added to it
+static void ans_pack(loh_bit_buffer * _ret, uint8_t * data, size_t len, uint16_t * emit_bits, uint8_t * emit_len, uint64_t * table_bytes)
+{
+    loh_bit_buffer ret = *_ret;
+    bits_push(&ret, len, 8*8);
     
-    uint64_t total_compressed_len = chunk_table_end;
-    uint64_t total_uncompressed_len = 0;
-    for (size_t i = 0; i < chunk_count; i += 1)
+    uint64_t header_overhead_bytes = 8;
+    
+    // the bits for each symbol are produced back to front, so they're stored in emit_bits/emit_len and written out afterwards
+    uint64_t chunk_size = LOH_ANS_BLOCK_SIZE;
+    uint64_t chunk_count = (len + chunk_size - 1) / chunk_size;
+    
+    for (uint32_t chunk = 0; chunk < chunk_count; chunk += 1)
     {
-        uint64_t * chunk_table = (uint64_t *)&real_buf.data[chunk_table_loc];
-        chunk_table[i * 2 + 0] = total_compressed_len;
-        chunk_table[i * 2 + 1] = total_uncompressed_len;
+        size_t chunk_start = chunk * chunk_size;
+        size_t chunk_end = (chunk + 1) * chunk_size;
+        if (chunk + 1 == chunk_count)
+            chunk_end = len;
         
-        uint64_t in_start = i * chunk_size;
-        uint64_t in_end = (i + 1) * chunk_size;
-        if (in_end > len)
-            in_end = len;
+        uint8_t * data_ = &data[chunk_start];
+        size_t len_ = chunk_end - chunk_start;
         
-        //printf("%lld %lld\n", in_start, in_end);
+        // the bit buffer is forcibly aligned to the start of the next byte at the start of the chunk
+        if (ret.bit_index != 0)
+            ret.bit_index = 8;
         
-        uint64_t in_size = in_end - in_start;
+        size_t start_byte = bits_bytes_used(&ret);
         
-        uint8_t * raw_data = &data[in_start];
+        bits_push(&ret, len_, 8*4);
         
-        loh_byte_buffer buf = {raw_data, in_size, in_size};
+        uint64_t counts[256] = {0};
+        for (size_t i = 0; i < len_; i += 1)
+            counts[data_[i]] += 1;
         
-        // detect probably-good differentiation stride
-        // step 1: figure out the typical absolute difference between bytes
-        // (128 isn't guaranteed)
+        uint16_t norm[256];
+        ans_normalize(counts, len_, norm);
         
-        int64_t difference = 0;
-        uint64_t rand = 19529;
-        const uint64_t m = 0xA68BF0C7;
-        uint8_t seen_values[256] = {0};
-        for (size_t n = 0; n < 4096; n += 1)
+        // build encoding table
+        // each symbol owns a range of norm[s] sub-states, which map to the full-size state that decodes to that symbol
+        uint8_t spread[LOH_ANS_TABLE_SIZE];
+        ans_spread(norm, spread);
+        
+        uint16_t cumul[256];
+        uint16_t next[256];
+        uint8_t max_bits[256];
+        size_t symbol_count = 0;
+        uint16_t sum = 0;
+        for (size_t s = 0; s < 256; s++)
         {
-            rand *= m + n * 2;
-            size_t a = rand % in_size;
-            rand *= m + n * 2;
-            size_t b = rand % in_size;
-            int16_t diff = (int16_t)data[in_start + a] - (int16_t)data[in_start + b];
-            diff = diff < 0 ? -diff : diff;
-            difference += diff;
-            seen_values[data[in_start + a]] = 1;
-            seen_values[data[in_start + b]] = 1;
+            cumul[s] = sum;
+            next[s] = norm[s];
+            sum += norm[s];
+            max_bits[s] = norm[s] ? LOH_ANS_TABLE_LOG - loh_floor_log2(norm[s]) : 0;
+            symbol_count += norm[s] != 0;
         }
-        // to prevent differentiating files that only have a small number of unique values (doing so thrashes the entropy coder)
-        uint16_t num_seen_values = 0;
-        for (size_t n = 0; n < 256; n++)
-            num_seen_values += seen_values[n];
-        difference /= 4096;
-        
-        int64_t orig_difference = difference;
-        
-        uint8_t did_diff = do_diff;
-        
-        // now check 1 through 16 as possible differentiation values, using a similar strategy
-        if (!do_diff && num_seen_values > 128)
+        uint16_t encode_table[LOH_ANS_TABLE_SIZE];
+        for (size_t u = 0; u < LOH_ANS_TABLE_SIZE; u++)
         {
-            for (uint8_t diff_opt = 1; diff_opt <= 16; diff_opt += 1)
-            {
-                int64_t diff_difference = 0;
-                if (diff_opt * 2 > in_size)
-                    break;
-                for (size_t n = 0; n < 4096; n += 1)
-                {
-                    rand *= m + n * 2;
-                    size_t a = rand % (in_size - diff_opt);
-                    int16_t diff = (int16_t)data[in_start + a] - (int16_t)data[in_start + a + diff_opt];
-                    diff = diff < 0 ? -diff : diff;
-                    diff_difference += diff;
-                }
-                diff_difference /= 4096;
-                // 2x to prevent noise from triggering differentiation when it's not necessary
-                if (diff_difference * 2 < orig_difference && diff_difference < difference)
-                {
-                    difference = diff_difference;
-                    did_diff = diff_opt;
-                }
-            }
+            uint8_t s = spread[u];
+            encode_table[cumul[s] + next[s] - norm[s]] = u + LOH_ANS_TABLE_SIZE;
+            next[s] += 1;
         }
         
-        if (did_diff)
+        // encode back to front
+        uint32_t state = LOH_ANS_TABLE_SIZE;
+        uint64_t total_bits = 0;
+        for (size_t i = len_; i-- > 0;)
         {
-            for (size_t i = buf.len - 1; i >= did_diff; i -= 1)
-                buf.data[i] -= buf.data[i - did_diff];
+            uint8_t s = data_[i];
+            uint32_t c = norm[s];
+            uint8_t k = max_bits[s];
+            uint8_t nbits = k - (state < (c << k));
+            emit_bits[i] = state & ((1 << nbits) - 1);
+            emit_len[i] = nbits;
+            total_bits += nbits;
+            state = encode_table[cumul[s] + (state >> nbits) - c];
         }
         
-        loh_byte_buffer orig_buf = buf;
+        // count how big the frequency table will be (see below)
+        uint64_t table_bits = 8 + LOH_ANS_TABLE_LOG;
+        uint8_t prev_symbol = 0;
+        uint32_t remaining = LOH_ANS_TABLE_SIZE;
+        size_t symbols_left = symbol_count;
+        for (size_t s = 0; s < 256; s++)
+        {
+            if (!norm[s])
+                continue;
+            uint8_t diff = s - prev_symbol;
+            table_bits += (diff >= 1 && diff <= 4) ? diff : 12;
+            prev_symbol = s;
+            symbols_left -= 1;
+            if (symbols_left > 0)
+            {
+                uint32_t max_value = remaining - symbols_left - 1;
+                table_bits += max_value ? loh_floor_log2(max_value) + 1 : 0;
+                remaining -= norm[s];
+            }
+        }
         
-        size_t lb_comp_ratio_100 = 100;
+        // fall back to storing raw bytes if coding doesn't help
+        uint8_t incompressible = total_bits + table_bits >= len_ * 8;
         
-        uint8_t did_lookback = do_lookback;
+        bit_push(&ret, incompressible);
         
-        if (do_lookback)
+        if (!incompressible)
         {
-            loh_byte_buffer new_buf = lookback_compress(buf.data, buf.len, do_lookback);
-            if (new_buf.len < buf.len)
+            bits_push(&ret, symbol_count - 1, 8);
+            
+            prev_symbol = 0;
+            for (size_t s = 0; s < 256; s++)
             {
-                lb_comp_ratio_100 = new_buf.len * 100 / buf.len;
-                if (buf.data != raw_data)
-                    LOH_FREE(buf.data);
-                buf = new_buf;
+                if (!norm[s])
+                    continue;
+                ans_push_symbol_diff(&ret, s - prev_symbol);
+                prev_symbol = s;
             }
-            else
+            // frequencies use as many bits as the largest frequency that's still possible at that point
+            // the last symbol's frequency is whatever's left over, so it isn't stored
+            remaining = LOH_ANS_TABLE_SIZE;
+            symbols_left = symbol_count;
+            for (size_t s = 0; s < 256 && symbols_left > 1; s++)
             {
-                LOH_FREE(new_buf.data);
-                did_lookback = 0;
+                if (!norm[s])
+                    continue;
+                symbols_left -= 1;
+                uint32_t max_value = remaining - symbols_left - 1;
+                bits_push(&ret, norm[s] - 1, max_value ? loh_floor_log2(max_value) + 1 : 0);
+                remaining -= norm[s];
             }
-        }
-        uint8_t did_huff = 0;
-        if (do_huff)
-        {
-            loh_byte_buffer new_buf = huff_pack(buf.data, buf.len).buffer;
-            if (new_buf.len < buf.len)
+            
+            bits_push(&ret, state - LOH_ANS_TABLE_SIZE, LOH_ANS_TABLE_LOG);
+            
+            // the bit buffer is forcibly aligned to the start of the next byte at the end of the frequency table
+            bits_align_for_bytes(&ret);
+            
+            header_overhead_bytes += bits_bytes_used(&ret) - start_byte;
+            
+            // push symbol bits in decoding order, through a local accumulator
+            bytes_reserve(&ret.buffer, (total_bits + 7) / 8);
+            uint8_t * out = &ret.buffer.data[ret.buffer.len];
+            uint64_t acc = 0;
+            uint8_t acc_len = 0;
+            size_t o = 0;
+            for (size_t i = 0; i < len_; i++)
             {
-                if (buf.data != raw_data)
-                    LOH_FREE(buf.data);
-                buf = new_buf;
-                did_huff = 1;
-                
-                // if we did lookback but it's tenuous, try huff-compressing the original data too to see if it comes out smaller
-                
-                if (did_lookback && (lb_comp_ratio_100 > 80 || (did_diff != 0 && lb_comp_ratio_100 > 30)))
+                acc |= ((uint64_t)emit_bits[i]) << acc_len;
+                acc_len += emit_len[i];
+                if (acc_len >= 32)
                 {
-                    loh_byte_buffer new_buf_2 = huff_pack(orig_buf.data, orig_buf.len).buffer;
-                    
-                    if (new_buf_2.len < buf.len)
-                    {
-                        buf = new_buf_2;
-                        did_lookback = 0;
-                    }
-                    else
-                        LOH_FREE(new_buf_2.data);
+                    for (uint8_t b = 0; b < 4; b++)
+                        out[o++] = acc >> (b * 8);
+                    acc >>= 32;
+                    acc_len -= 32;
                 }
             }
-            else
+            while (acc_len > 0)
             {
-                LOH_FREE(new_buf.data);
-                did_huff = 0;
+                out[o++] = acc;
+                acc >>= 8;
+                acc_len = acc_len > 8 ? acc_len - 8 : 0;
             }
+            ret.buffer.len += o;
+        }
+        else
+        {
+            // the bit buffer is forcibly aligned to the start of the next byte before incompressible data
+            bits_align_for_bytes(&ret);
+            header_overhead_bytes += bits_bytes_used(&ret) - start_byte;
+            bytes_push(&ret.buffer, data_, len_);
         }
-        
-        byte_push(&real_buf, did_diff);
-        byte_push(&real_buf, did_lookback);
-        byte_push(&real_buf, did_huff);
-        byte_push(&real_buf, 0);
-        bytes_push(&real_buf, buf.data, buf.len);
-        
-        if (buf.data != raw_data)
-            LOH_FREE(buf.data);
-        
-        total_compressed_len += buf.len + 4;
-        total_uncompressed_len += in_size;
     }
-    uint64_t * chunk_table = (uint64_t *)&real_buf.data[chunk_table_loc];
-    chunk_table[chunk_count * 2 + 0] = total_compressed_len;
-    chunk_table[chunk_count * 2 + 1] = total_uncompressed_len;
     
-    *out_len = real_buf.len;
-    return real_buf.data;
+    if (table_bytes)
+        *table_bytes += header_overhead_bytes;
+    *_ret = ret;
 }
 
-/* decompression */
+struct loh_trial_state;
+
+// working memory for compressing chunks, kept around and reused from one chunk to the next
+// must be zeroed before first use, and released with loh_compress_scratch_free
+typedef struct {
+    loh_hashmap hashmap;
+    loh_byte_buffer lookback; // lookback stage output
+    loh_byte_buffer alt; // entropy coding trials that might not win
+    loh_byte_buffer primed; // the dictionary followed by the chunk, for dependent chunks
+    loh_byte_buffer split[LOH_SPLIT_STREAMS]; // the lookback stage's streams, if they're split
+    loh_ldm ldm;
+    loh_speed_control speed;
+    uint16_t * ans_emit_bits;
+    uint8_t * ans_emit_len;
+    // where huff_pack_parallel codes each batch of blocks
+    uint8_t * huff_slots;
+    // one for each of loh_params.trials
+    struct loh_trial_state * trials;
+    uint32_t trial_count;
+    // where all of the above comes from (see loh_compress_scratch_bind)
+    const loh_allocator * allocator;
+    // what it was bound to: loh_params.allocator and loh_params.arena_size
+    const loh_allocator * bound_allocator;
+    uint64_t bound_arena_size;
+    loh_arena arena;
+} loh_compress_scratch;
 
-// On error, the value poitned to by the error parameter will be set to 1.
-// Any partially-decompressed data is returned rather than being freed and nulled.
-static loh_byte_buffer lookback_decompress(const uint8_t * input, size_t input_len, int * error)
+static void loh_trial_states_free(struct loh_trial_state * trials, uint32_t trial_count, const loh_allocator * allocator);
+
+static void loh_compress_scratch_free(loh_compress_scratch * scratch)
 {
-    size_t i = 0;
-    
-    loh_byte_buffer ret = {0, 0, 0};
-    
-    if (input_len < 8)
+    loh_trial_states_free(scratch->trials, scratch->trial_count, scratch->allocator);
+    loh_dealloc(scratch->allocator, scratch->huff_slots);
+    loh_dealloc(scratch->allocator, scratch->ans_emit_len);
+    loh_dealloc(scratch->allocator, scratch->ans_emit_bits);
+    loh_ldm_free(&scratch->ldm);
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
+        bytes_free(&scratch->split[LOH_SPLIT_STREAMS - 1 - n]);
+    bytes_free(&scratch->primed);
+    bytes_free(&scratch->alt);
+    bytes_free(&scratch->lookback);
+    hashmap_free(&scratch->hashmap);
+    if (scratch->bound_arena_size)
+        loh_arena_release(&scratch->arena);
+    memset(scratch, 0, sizeof(loh_compress_scratch));
+}
+
+// makes scratch get its memory from wherever params says to (loh_params.allocator and loh_params.arena_size),
+//  first giving back anything it got from somewhere else on an earlier call
+// a scratch with its own arena can't be moved (copied) once it's bound
+static void loh_compress_scratch_bind(loh_compress_scratch * scratch, const loh_params * params)
+{
+    if (scratch->bound_allocator == params->allocator && scratch->bound_arena_size == params->arena_size)
+        return;
+    loh_compress_scratch_free(scratch);
+    scratch->bound_allocator = params->allocator;
+    scratch->bound_arena_size = params->arena_size;
+    scratch->allocator = params->allocator;
+    if (params->arena_size)
+    {
+        loh_arena_init(&scratch->arena, params->arena_size, params->allocator);
+        scratch->allocator = &scratch->arena.allocator;
+    }
+    scratch->hashmap.allocator = scratch->allocator;
+    scratch->lookback.allocator = scratch->allocator;
+    scratch->alt.allocator = scratch->allocator;
+    scratch->primed.allocator = scratch->allocator;
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
+        scratch->split[n].allocator = scratch->allocator;
+    scratch->ldm.allocator = scratch->allocator;
+    scratch->ldm.matches.allocator = scratch->allocator;
+}
+
+// starts a huffman coded stream (see loh_huff_stream) in out's spare capacity, the same way loh_entropy_pack_bounded does
+// it's used once it outgrows limit, but keeps going in a buffer of its own, which loh_huff_stream_free gives back
+// returns 0 if out has no room to start in or the slots for parallel_for can't be allocated
+static int loh_huff_stream_begin(loh_huff_stream * stream, loh_byte_buffer * out, size_t limit, const loh_params * params, loh_compress_scratch * scratch)
+{
+    memset(stream, 0, sizeof(loh_huff_stream));
+    if (!out->data)
+        return 0;
+    stream->out.buffer.data = &out->data[out->len];
+    stream->out.buffer.cap = out->cap - out->len < limit ? out->cap - out->len : limit;
+    stream->out.buffer.borrowed = 1;
+    stream->batch_size = (size_t)1 << 15;
+    if (params->parallel_for)
     {
-        ret.len = 1;
-        ret.cap = 0;
-        return ret;
+        if (!scratch->huff_slots)
+            scratch->huff_slots = (uint8_t *)loh_alloc(scratch->allocator, LOH_HUFF_SLOT_SIZE * LOH_HUFF_BATCH);
+        if (!scratch->huff_slots)
+            return 0;
+        stream->params = params;
+        stream->slots = scratch->huff_slots;
+        stream->batch_size = LOH_HUFF_BATCH << 15;
     }
     
-    uint64_t size = 0;
-    size |= input[i++];
-    size |= ((uint64_t)input[i++]) << 8;
-    size |= ((uint64_t)input[i++]) << 16;
-    size |= ((uint64_t)input[i++]) << 24;
-    size |= ((uint64_t)input[i++]) << 32;
-    size |= ((uint64_t)input[i++]) << 40;
-    size |= ((uint64_t)input[i++]) << 48;
-    size |= ((uint64_t)input[i++]) << 56;
+    // the stream's length goes here once it's known
+    bits_push(&stream->out, 0, 8*8);
+    stream->table_bytes = 8;
+    return 1;
+}
+
+// gives back the stream's own buffer, if it outgrew the space it started in
+static void loh_huff_stream_free(loh_huff_stream * stream)
+{
+    bytes_free(&stream->out.buffer);
+}
+
+// runs one entropy coding stage (LOH_ENTROPY_HUFF or LOH_ENTROPY_ANS), writing straight into out's spare capacity
+// the output is only kept (appended to out) if it comes out smaller than limit; it's abandoned as soon as it can't fit
+// returns the number of bytes appended, or 0 if nothing was
+// if it was kept and table_bytes isn't null, writes how much of it was block headers and code tables to table_bytes
+// huffman coding goes through params->parallel_for if it's set and there's more than one block
+static size_t loh_entropy_pack_bounded(uint8_t kind, uint8_t * data, size_t len, loh_byte_buffer * out, size_t limit, const loh_params * params, loh_compress_scratch * scratch, uint64_t * table_bytes)
+{
+    if (!out->data)
+        return 0;
     
-    bytes_reserve(&ret, size);
+    loh_bit_buffer view;
+    memset(&view, 0, sizeof(loh_bit_buffer));
+    view.buffer.data = &out->data[out->len];
+    view.buffer.cap = out->cap - out->len < limit ? out->cap - out->len : limit;
+    view.buffer.borrowed = 1;
+    
+    uint64_t table = 0;
+    if (kind == LOH_ENTROPY_ANS)
+    {
+        if (!scratch->ans_emit_bits)
+            scratch->ans_emit_bits = (uint16_t *)loh_alloc(scratch->allocator, sizeof(uint16_t) * LOH_ANS_BLOCK_SIZE);
+        if (!scratch->ans_emit_len)
+            scratch->ans_emit_len = (uint8_t *)loh_alloc(scratch->allocator, LOH_ANS_BLOCK_SIZE);
+        if (!scratch->ans_emit_bits || !scratch->ans_emit_len)
+            return 0;
+        ans_pack(&view, data, len, scratch->ans_emit_bits, scratch->ans_emit_len, &table);
+    }
+    else if (params->parallel_for && len > ((size_t)1 << 15))
+    {
+        if (!scratch->huff_slots)
+            scratch->huff_slots = (uint8_t *)loh_alloc(scratch->allocator, LOH_HUFF_SLOT_SIZE * LOH_HUFF_BATCH);
+        if (!scratch->huff_slots)
+            return 0;
+        huff_pack_parallel(&view, data, len, &table, params, scratch->huff_slots);
+    }
+    else
+        huff_pack(&view, data, len, &table);
     
-    if (!ret.data)
+    // outgrew the space we gave it
+    if (!view.buffer.borrowed)
     {
-        *error = 1;
-        return ret;
+        bytes_free(&view.buffer);
+        return 0;
     }
+    if (view.buffer.len >= limit)
+        return 0;
     
-#define _LOH_CHECK_I_VS_LEN_OR_RETURN(N) \
-    if (i + N > input_len) return *error = 1, ret;
+    if (table_bytes)
+        *table_bytes = table;
+    out->len += view.buffer.len;
+    return view.buffer.len;
+}
 
-    while (i < input_len)
+// entropy codes data into scratch space, and if it comes out smaller than limit, replaces everything in out past start with it
+// returns 1 if it replaced anything
+static int loh_entropy_pack_replace(uint8_t kind, uint8_t * data, size_t len, loh_byte_buffer * out, size_t start, size_t limit, const loh_params * params, loh_compress_scratch * scratch, uint64_t * table_bytes)
+{
+    scratch->alt.len = 0;
+    bytes_reserve(&scratch->alt, limit);
+    if (!loh_entropy_pack_bounded(kind, data, len, &scratch->alt, limit, params, scratch, table_bytes))
+        return 0;
+    out->len = start;
+    bytes_push(out, scratch->alt.data, scratch->alt.len);
+    return 1;
+}
+
+// sorts the bytes of a lookback stream (from lookback_compress, so it isn't checked) into the streams of a split lookback
+//  stage, leaving out the length prefix
+// returns 0 if allocation fails
+static int loh_lookback_split(const uint8_t * stream, size_t len, loh_byte_buffer * streams)
+{
+    // no stream can be longer than the whole lookback stream
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
     {
-        uint8_t dat = input[i++];
+        streams[n].len = 0;
+        bytes_reserve(&streams[n], len);
+        if (!streams[n].data)
+            return 0;
+    }
+    uint8_t * literals = streams[LOH_SPLIT_LITERALS].data;
+    uint8_t * commands = streams[LOH_SPLIT_COMMANDS].data;
+    uint8_t * distances = streams[LOH_SPLIT_DISTANCES].data;
+    size_t l = 0;
+    size_t c = 0;
+    size_t d = 0;
+    
+    size_t i = 8;
+    while (i < len)
+    {
+        uint8_t dat = stream[i++];
+        commands[c++] = dat;
         
         uint8_t size_continues = dat & 1;
-        size_t size = (dat >> 1) & loh_size_mask;
-        
+        uint64_t size = (dat >> 1) & loh_size_mask;
         uint8_t dist_continues = dat & (1 << (loh_size_bits + 1));
-        size_t dist = (dat >> (loh_size_bits + 2)) & loh_dist_mask;
+        uint8_t is_literal = !dist_continues && !((dat >> (loh_size_bits + 2)) & loh_dist_mask);
         
         uint64_t n = loh_size_bits;
         while (size_continues)
         {
-            _LOH_CHECK_I_VS_LEN_OR_RETURN(1)
-            uint64_t cont_dat = input[i++];
+            uint8_t cont_dat = stream[i++];
+            commands[c++] = cont_dat;
             size_continues = cont_dat & 1;
-            size += ((cont_dat >> 1) << n);
+            size += ((uint64_t)(cont_dat >> 1)) << n;
             size += ((uint64_t)1) << n;
             n += 7;
         }
-        
-        n = loh_dist_bits;
         while (dist_continues)
         {
-            _LOH_CHECK_I_VS_LEN_OR_RETURN(1)
-            uint64_t cont_dat = input[i++];
-            dist_continues = cont_dat & 1;
-            dist += ((cont_dat >> 1) << n);
-            dist += ((uint64_t)1) << n;
-            n += 7;
-        }
-        
-        // lookback mode
-        if (dist > 0)
-        {
-            size += loh_min_lookback_length;
-            // bounds limit
-            if (dist > ret.len)
-            {
-                *error = 1;
-                return ret;
-            }
-            
-            // bytes_push uses memcpy, which doesn't work if there's any overlap.
-            // overlap is allowed here, so we have to copy bytes manually.
-            for(size_t j = 0; j < size; j++)
-                byte_push(&ret, ret.data[ret.len - dist]);
+            dist_continues = stream[i] & 1;
+            distances[d++] = stream[i++];
         }
-        // literal mode
-        else
+        if (is_literal)
         {
-            size += 1;
-            
-            _LOH_CHECK_I_VS_LEN_OR_RETURN(size)
-            bytes_push(&ret, &input[i], size);
-            i += size;
+            memcpy(&literals[l], &stream[i], size + 1);
+            i += size + 1;
+            l += size + 1;
         }
     }
     
-#undef _LOH_CHECK_I_VS_LEN_OR_RETURN
-    
-    return ret;
+    streams[LOH_SPLIT_LITERALS].len = l;
+    streams[LOH_SPLIT_COMMANDS].len = c;
+    streams[LOH_SPLIT_DISTANCES].len = d;
+    return 1;
 }
 
-static loh_byte_buffer huff_unpack(loh_bit_buffer * buf, int * error)
+// writes a lookback stream into out as a split lookback stage: its 64-bit decoded length, then each of the streams as an
+//  8-bit entropy coder (LOH_ENTROPY_*), a 64-bit length, and the stream, coded with whichever of do_huff's coders makes it
+//  smallest, or not at all if none of them make it smaller
+// returns 0 on failure (allocation failure, or out being a borrowed buffer that ran out of room)
+// if table_bytes isn't null, adds how much of it was entropy coding block headers and code tables to it
+static int loh_split_pack(uint8_t do_huff, const uint8_t * stream, size_t len, loh_byte_buffer * out, const loh_params * params, loh_compress_scratch * scratch, uint64_t * table_bytes)
 {
-    buf->bit_index = 0;
-    buf->byte_index = 0;
-    size_t output_len = bits_pop(buf, 8*8);
-    
-    loh_byte_buffer ret = {0, 0, 0};
+    uint8_t out_borrowed = out->borrowed;
+    if (!loh_lookback_split(stream, len, scratch->split))
+        return 0;
+    bytes_push(out, stream, 8);
     
-    // if output length is 0, stop decoding
-    if (output_len == 0)
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
     {
-        bytes_reserve(&ret, output_len);
-        return ret;
+        const loh_byte_buffer * split = &scratch->split[n];
+        uint8_t section_head[9] = {0};
+        size_t section_start = out->len;
+        bytes_push(out, section_head, 9);
+        if (!out->data || out->borrowed != out_borrowed)
+            return 0;
+        size_t data_start = out->len;
+        
+        uint8_t kind = LOH_ENTROPY_NONE;
+        uint64_t table = 0;
+        if (do_huff && split->len)
+        {
+            if (!out->borrowed)
+                bytes_reserve(out, split->len);
+            uint8_t first = do_huff == LOH_ENTROPY_ANS ? LOH_ENTROPY_ANS : LOH_ENTROPY_HUFF;
+            size_t best_len = loh_entropy_pack_bounded(first, split->data, split->len, out, split->len, params, scratch, &table);
+            if (best_len)
+                kind = first;
+            if (do_huff == LOH_ENTROPY_BEST && loh_entropy_pack_replace(LOH_ENTROPY_ANS, split->data, split->len, out, data_start, best_len ? best_len : split->len, params, scratch, &table))
+                kind = LOH_ENTROPY_ANS;
+        }
+        if (!kind)
+            bytes_push(out, split->data, split->len);
+        if (!out->data || out->borrowed != out_borrowed)
+            return 0;
+        if (kind && table_bytes)
+            *table_bytes += table;
+        
+        uint64_t section_len = out->len - data_start;
+        out->data[section_start] = kind;
+        for (size_t b = 0; b < 8; b += 1)
+            out->data[section_start + 1 + b] = (section_len >> (b * 8)) & 0xFF;
+    }
+    return 1;
+}
+
+// applies an image filter in place
+// bytes are filtered back to front, so each byte's prediction is made from unfiltered neighbours
+static void loh_filter_apply(uint8_t * data, size_t len, uint8_t filter, uint8_t bpp, uint32_t stride)
+{
+    size_t head = (size_t)stride + bpp;
+    if (head > len)
+        head = len;
+    
+#define _LOH_FILTER_APPLY_LOOP(PRED) \
+    for (size_t i = len; i-- > head;) \
+    { \
+        uint8_t a = data[i - bpp]; \
+        uint8_t b = data[i - stride]; \
+        uint8_t c = data[i - stride - bpp]; \
+        (void)a; (void)b; (void)c; \
+        data[i] -= (PRED); \
     }
-    // reserve 8 extra bytes because we might write extra garbage bytes at the end
-    // (we do this to avoid having to spend a branch jumping out of the inner decoding loop)
-    bytes_reserve(&ret, output_len + 8);
     
-    if (!ret.data)
+    switch (filter)
     {
-        puts("alloc failed");
-        *error = 1;
-        return ret;
+    case LOH_FILTER_LEFT: _LOH_FILTER_APPLY_LOOP(a) break;
+    case LOH_FILTER_UP: _LOH_FILTER_APPLY_LOOP(b) break;
+    case LOH_FILTER_AVG: _LOH_FILTER_APPLY_LOOP((uint8_t)(((uint16_t)a + (uint16_t)b) >> 1)) break;
+    case LOH_FILTER_PAETH: _LOH_FILTER_APPLY_LOOP(loh_paeth(a, b, c)) break;
+    default: return;
     }
     
-    size_t start_len = 0;
-    while (start_len < output_len)
+#undef _LOH_FILTER_APPLY_LOOP
+    
+    for (size_t i = head; i-- > 0;)
+        data[i] -= loh_filter_predict_at(data, i, filter, bpp, stride);
+}
+
+// picks the image filter that gives the smallest typical residuals, sampled at random like delta stride detection
+static uint8_t loh_filter_choose(const uint8_t * data, size_t len, uint8_t bpp, uint32_t stride)
+{
+    size_t head = (size_t)stride + bpp;
+    if (len <= head)
+        return LOH_FILTER_LEFT;
+    
+    uint8_t best_filter = LOH_FILTER_LEFT;
+    uint64_t best_cost = -1;
+    const uint64_t m = 0xA68BF0C7;
+    for (uint8_t filter = LOH_FILTER_LEFT; filter <= LOH_FILTER_MAX; filter += 1)
     {
-        // the bit buffer is forcibly aligned at the start of each chunk
-        if (buf->bit_index != 0)
-        {
-            buf->bit_index = 0;
-            buf->byte_index += 1;
-        }
-        
-        uint32_t chunk_len = bits_pop(buf, 8*4);
-        
-        uint8_t incompressible = bit_pop(buf);
-        
-        if (!incompressible)
+        // same sample positions for every filter
+        uint64_t rand = 19529;
+        uint64_t cost = 0;
+        for (size_t n = 0; n < 4096; n += 1)
         {
-            // load huffman code description
-            // starts at code length 1
-            // bit 1: add 1 to code length
-            // bit 0: read next 8 bits as symbol for next code. add 1 to code
-            uint16_t symbol_count = bits_pop(buf, 8) + 1;
-            uint16_t max_codes[16] = {0};
-            uint8_t symbols[32768] = {0};
-            uint16_t code_value = 0;
-            size_t code_depth = 1;
-            uint8_t prev_symbol = 0;
-            for (size_t i = 0; i < symbol_count; i++)
-            {
-                uint8_t bit = bit_pop(buf);
-                while (bit)
-                {
-                    code_value <<= 1;
-                    code_depth += 1;
-                    bit = bit_pop(buf);
-                    if (code_depth > 15)
-                    {
-                        *error = 1;
-                        return ret;
-                    }
-                }
-                
-                // stored as diffs
-                // 0 : 1
-                // 10 : 2
-                // 110 : 3
-                // 1110 : 4
-                // 1111xxxxxxxx : other
-                uint8_t diff = 1 + bit_pop(buf);
-                diff += diff == 2 && bit_pop(buf);
-                diff += diff == 3 && bit_pop(buf);
-                diff += diff == 4 && bit_pop(buf);
-                if (diff == 5)
-                    diff = bits_pop(buf, 8);
-                
-                uint8_t symbol = prev_symbol + diff;
-                prev_symbol += diff;
-                
-                symbols[code_value] = symbol;
-                max_codes[code_depth] = code_value + 1;
-                code_value += 1;
-            }
-            max_codes[code_depth] = 0xFFFF;
-            
-            // the bit buffer is forcibly aligned to the start of the next byte at the end of the huffman tree data
-            if (buf->bit_index != 0)
-            {
-                buf->bit_index = 0;
-                buf->byte_index += 1;
-            }
-            
-            size_t n = 0;
-            size_t i = start_len;
-            uint16_t code_word = 0;
-            uint16_t * max_code = max_codes + 1;
-            // consume all remaining input bytes
-            size_t j = 0;
-            for (j = buf->byte_index; j < buf->buffer.len; j++)
-            {
-                // operating on bit buffer input bytes/words is faster than operating on individual input bits
-                uint8_t word = buf->buffer.data[j];
-                for (uint8_t b = 0; b < 8; b += 1)
-                {
-                    code_word = code_word | (word & 1);
-                    word >>= 1;
-                    if (code_word < *max_code++)
-                    {
-                        ret.data[i++] = symbols[code_word];
-                        n += 1;
-                        code_word = 0;
-                        max_code = max_codes + 1;
-                    }
-                    else
-                        code_word <<= 1;
-                }
-                if (n >= chunk_len)
-                    break;
-            }
-            buf->byte_index = j + 1;
-            buf->bit_index = 0;
+            rand *= m + n * 2;
+            size_t i = head + rand % (len - head);
+            int16_t diff = (int8_t)(data[i] - loh_filter_predict(filter, data[i - bpp], data[i - stride], data[i - stride - bpp]));
+            cost += diff < 0 ? -diff : diff;
         }
-        else
+        if (cost < best_cost)
         {
-            // the bit buffer is forcibly aligned to the start of the next byte for incompressible data
-            if (buf->bit_index != 0)
-            {
-                buf->bit_index = 0;
-                buf->byte_index += 1;
-            }
-            
-            for (size_t i = start_len; i < start_len + chunk_len; i += 1)
-                ret.data[i] = buf->buffer.data[buf->byte_index + (i - start_len)];
-            
-            buf->byte_index += chunk_len;
-            buf->bit_index = 0;
+            best_cost = cost;
+            best_filter = filter;
         }
-        start_len += chunk_len;
     }
-     
-    ret.len = output_len;
-    
-#undef _LOH_PROCESS_WORD
-    
-    return ret;
+    return best_filter;
 }
 
-
-// input data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
-// if huffman and lookback coding are both disabled, then the returned pointer is a pointer into the input data
-// otherwise, returned data must be freed by the caller; it was allocated with LOH_MALLOC
-static uint8_t * loh_decompress(uint8_t * data, size_t len, size_t * out_len, uint8_t check_checksum)
+// how much of the end of each chunk the next chunk gets as its dictionary, if chunks are dependent (see loh_params.dict_size)
+// params must already have its lookback level clamped
+static inline uint64_t loh_dict_size(const loh_params * params)
 {
-    if (!data || !out_len) return 0;
-    
-    if (len < 8 || memcmp(data, "LOHz", 4) != 0)
+    if (!params->do_lookback || !params->dict_size)
         return 0;
+    uint64_t max_distance = loh_max_distance(params, params->do_lookback);
+    return params->dict_size < max_distance ? params->dict_size : max_distance;
+}
+
+// saves the end of a chunk for the next chunk to use as its dictionary
+// this has to happen before the chunk itself is compressed, since that changes it in place
+static inline void loh_dict_save(loh_byte_buffer * dict, const uint8_t * chunk, uint64_t chunk_len, uint64_t dict_size)
+{
+    uint64_t n = chunk_len < dict_size ? chunk_len : dict_size;
+    dict->len = 0;
+    bytes_push(dict, &chunk[chunk_len - n], n);
+}
+
+static int huff_unpack(const uint8_t * input, size_t input_len, uint8_t * out, size_t out_len);
+
+// compresses a single chunk with a single configuration; see loh_compress_chunk
+static int loh_compress_chunk_once(uint8_t * raw_data, uint64_t in_size, const uint8_t * dict, uint64_t dict_len, const loh_params * params, loh_compress_scratch * scratch, loh_byte_buffer * out, loh_chunk_stats * stats)
+{
+    double time_start = stats ? LOH_STATS_TIME() : 0.0;
+    loh_trace_event(params->tracer, "prepare", LOH_TRACE_NO_CHUNK, 1);
+    loh_compress_scratch_bind(scratch, params);
     
-    uint32_t stored_checksum = data[4]
-        | (((uint32_t)data[5]) << 8)
-        | (((uint32_t)data[6]) << 16)
-        | (((uint32_t)data[7]) << 24);
+    loh_speed_control * speed = params->target_speed ? &scratch->speed : 0;
+    double speed_start = speed ? LOH_SPEED_TIME() : 0.0;
+    double speed_end = speed_start + (double)in_size / (params->target_speed * 1000000.0);
+
+    loh_byte_buffer buf = {raw_data, in_size, in_size, 0, 0};
+    uint8_t out_borrowed = out->borrowed;
+    loh_chunk_header header;
     
-    uint64_t chunk_count = data[8]
-        | (((uint64_t)data[9]) << 8)
-        | (((uint64_t)data[10]) << 16)
-        | (((uint64_t)data[11]) << 24)
-        | (((uint64_t)data[12]) << 32)
-        | (((uint64_t)data[13]) << 40)
-        | (((uint64_t)data[14]) << 48)
-        | (((uint64_t)data[15]) << 56);
+    uint8_t do_lookback = params->do_lookback;
+    uint8_t do_huff = params->do_huff;
+    uint8_t do_diff = params->do_diff;
+    uint8_t image_bpp = params->image_bpp;
+    uint32_t image_stride = params->image_stride;
     
-    const uint64_t * chunk_table = (uint64_t *)&data[16];
+    memset(&header, 0, sizeof(loh_chunk_header));
     
-    uint64_t output_len = chunk_table[chunk_count * 2 + 1];
+    // matches can't reach further back than the max lookback distance, so there's no point using more dictionary than that
+    uint64_t max_distance = loh_max_distance(params, do_lookback);
+    if (max_distance > 0xFFFFFFFF)
+        max_distance = 0xFFFFFFFF;
+    if (!do_lookback || !dict)
+        dict_len = 0;
+    if (dict_len > max_distance)
+    {
+        dict += dict_len - max_distance;
+        dict_len = max_distance;
+    }
+    header.dict_len = dict_len;
     
-    loh_byte_buffer out_buf = {0, 0, 0};
-    bytes_reserve(&out_buf, output_len);
+    uint8_t did_diff = do_diff;
     
-    for (size_t i = 0; i < chunk_count; i += 1)
+    if (image_bpp && image_stride >= image_bpp)
     {
-        uint8_t * chunk_start = &data[chunk_table[i * 2]];
-        //uint8_t * chunk_end   = &data[chunk_table[i * 2 + 2]];
-        size_t chunk_len = chunk_table[i * 2 + 2] - chunk_table[i * 2];
-        //size_t output_len = chunk_table[i * 2 + 3] - chunk_table[i * 2 + 1];
-        
-        loh_byte_buffer buf = {chunk_start, chunk_len, chunk_len};
-        
-        uint8_t do_diff = buf.data[0];
-        uint8_t do_lookback = buf.data[1];
-        uint8_t do_huff = buf.data[2];
-        
-        buf.data += 4;
-        buf.len -= 4;
-        
-        uint8_t * buf_orig = buf.data;
+        did_diff = 0;
+        header.filter = loh_filter_choose(buf.data, buf.len, image_bpp, image_stride);
+        header.filter_bpp = image_bpp;
+        header.filter_stride = image_stride;
+        loh_filter_apply(buf.data, buf.len, header.filter, image_bpp, image_stride);
+    }
+    else
+    {
+        // detect probably-good differentiation stride
+        // step 1: figure out the typical absolute difference between bytes
+        // (128 isn't guaranteed)
         
-        if (do_huff)
+        int64_t difference = 0;
+        uint64_t rand = 19529;
+        const uint64_t m = 0xA68BF0C7;
+        uint8_t seen_values[256] = {0};
+        for (size_t n = 0; n < 4096; n += 1)
         {
-            loh_bit_buffer compressed;
-            memset(&compressed, 0, sizeof(loh_bit_buffer));
-            compressed.buffer = buf;
-            int error = 0;
-            loh_byte_buffer new_buf = huff_unpack(&compressed, &error);
-            if (buf.data != buf_orig)
-                LOH_FREE(buf.data);
-            buf = new_buf;
-            if (!error && !buf.data)
-            {
-                fprintf(stderr, "oops in rle");
-                exit(-1);
-            }
-            if (error)
-            {
-                if (buf.data && buf.data != buf_orig)
-                    LOH_FREE(buf.data);
-                return 0;
-            }
+            rand *= m + n * 2;
+            size_t a = rand % in_size;
+            rand *= m + n * 2;
+            size_t b = rand % in_size;
+            int16_t diff = (int16_t)raw_data[a] - (int16_t)raw_data[b];
+            diff = diff < 0 ? -diff : diff;
+            difference += diff;
+            seen_values[raw_data[a]] = 1;
+            seen_values[raw_data[b]] = 1;
         }
-        if (do_lookback)
+        // to prevent differentiating files that only have a small number of unique values (doing so thrashes the entropy coder)
+        uint16_t num_seen_values = 0;
+        for (size_t n = 0; n < 256; n++)
+            num_seen_values += seen_values[n];
+        difference /= 4096;
+        
+        int64_t orig_difference = difference;
+        
+        // now check 1 through 16 as possible differentiation values, using a similar strategy
+        if (!do_diff && !params->no_diff_detect && num_seen_values > 128)
         {
-            int error = 0;
-            loh_byte_buffer new_buf = lookback_decompress(buf.data, buf.len, &error);
-            if (buf.data != buf_orig)
-                LOH_FREE(buf.data);
-            buf = new_buf;
-            if (!error && !buf.data)
-            {
-                fprintf(stderr, "oops in lzss");
-                exit(-1);
-            }
-            if (error)
+            for (uint8_t diff_opt = 1; diff_opt <= 16; diff_opt += 1)
             {
-                if (buf.data && buf.data != buf_orig)
-                    LOH_FREE(buf.data);
-                return 0;
+                int64_t diff_difference = 0;
+                if (diff_opt * 2 > in_size)
+                    break;
+                for (size_t n = 0; n < 4096; n += 1)
+                {
+                    rand *= m + n * 2;
+                    size_t a = rand % (in_size - diff_opt);
+                    int16_t diff = (int16_t)raw_data[a] - (int16_t)raw_data[a + diff_opt];
+                    diff = diff < 0 ? -diff : diff;
+                    diff_difference += diff;
+                }
+                diff_difference /= 4096;
+                // 2x to prevent noise from triggering differentiation when it's not necessary
+                if (diff_difference * 2 < orig_difference && diff_difference < difference)
+                {
+                    difference = diff_difference;
+                    did_diff = diff_opt;
+                }
             }
         }
-        if (do_diff)
-        {
-            for (size_t i = do_diff; i < buf.len; i += 1)
-                buf.data[i] += buf.data[i - do_diff];
-        }
         
-        bytes_push(&out_buf, buf.data, buf.len);
+        if (did_diff)
+            loh_delta_apply(buf.data, buf.len, did_diff);
     }
     
-    uint32_t checksum;
-    if (stored_checksum != 0 && check_checksum)
-        checksum = loh_checksum(out_buf.data, out_buf.len);
-    else
-        checksum = stored_checksum;
+    double time_lookback = stats ? LOH_STATS_TIME() : 0.0;
+    loh_trace_event(params->tracer, "prepare", LOH_TRACE_NO_CHUNK, 0);
     
-    if (checksum == stored_checksum || !check_checksum)
+    // the stage flags in the header get filled in at the end, once we know which stages were kept
+    size_t header_start = out->len;
+    chunk_header_push(out, &header);
+    size_t data_start = out->len;
+    
+    loh_byte_buffer orig_buf = buf;
+    
+    size_t lb_comp_ratio_100 = 100;
+    
+    uint8_t did_lookback = do_lookback;
+    
+    if (speed)
+    {
+        // quick compressibility estimate: how common the most common byte value is, out of 1024 samples
+        // data that looks like noise (or is already compressed) starts out not spending much time looking for matches,
+        //  and data dominated by one value gets tANS, which handles that better than Huffman
+        uint16_t counts[256] = {0};
+        uint16_t top = 0;
+        uint64_t rand = 19529;
+        const uint64_t m = 0xA68BF0C7;
+        for (size_t n = 0; n < 1024; n += 1)
+        {
+            rand *= m + n * 2;
+            uint16_t c = ++counts[buf.data[rand % buf.len]];
+            top = c > top ? c : top;
+        }
+        speed->allow_off = top <= 16;
+        if (!speed->has_chain_len)
+        {
+            speed->chain_len = speed->allow_off ? 1 : (uint32_t)-1;
+            speed->has_chain_len = 1;
+        }
+        if (do_huff == LOH_ENTROPY_BEST)
+            do_huff = top >= 512 ? LOH_ENTROPY_ANS : LOH_ENTROPY_HUFF;
+        
+        if (!speed->entropy_time || !do_huff)
+            speed->entropy_time = do_huff ? 1.0 / 100000000.0 : 0.0;
+        speed->end = speed_end;
+        speed->lookback_start = LOH_SPEED_TIME();
+    }
+    
+    // set if the lookback stage gets huffman coded as it's written, and if that was kept
+    loh_huff_stream sink;
+    uint8_t fused = 0;
+    uint8_t fused_kept = 0;
+    double time_fused = 0.0;
+    
+    if (do_lookback)
+    {
+        loh_trace_event(params->tracer, "lookback", LOH_TRACE_NO_CHUNK, 1);
+        scratch->lookback.len = 0;
+        // the match finder needs the dictionary and the chunk to be contiguous
+        const uint8_t * lookback_in = buf.data;
+        if (dict_len)
+        {
+            scratch->primed.len = 0;
+            bytes_push(&scratch->primed, dict, dict_len);
+            bytes_push(&scratch->primed, buf.data, buf.len);
+            lookback_in = scratch->primed.data;
+        }
+        scratch->ldm.matches.len = 0;
+        if (lookback_in && params->long_distance)
+            loh_ldm_find(&scratch->ldm, lookback_in, dict_len + buf.len, dict_len);
+        const loh_ldm_match * forced = (const loh_ldm_match *)scratch->ldm.matches.data;
+        size_t forced_count = scratch->ldm.matches.len / sizeof(loh_ldm_match);
+        
+        // if nothing else needs the whole lookback stream (split streams, tANS, or the speed control's timing of each
+        //  stage), huffman coding it as it's written saves writing all of it out and reading it back twice
+        // it goes straight into out, the same as loh_entropy_pack_bounded would put it
+        if (do_huff == LOH_ENTROPY_HUFF && !params->split_streams && !speed && buf.len > ((uint64_t)1 << 15))
+        {
+            if (!out->borrowed)
+                bytes_reserve(out, buf.len);
+            fused = loh_huff_stream_begin(&sink, out, buf.len, params, scratch);
+            sink.timed = stats != 0;
+        }
+        int lookback_ok = lookback_in && lookback_compress(&scratch->lookback, lookback_in, dict_len + buf.len, dict_len, forced, forced_count, do_lookback, params, &scratch->hashmap, speed, stats, fused ? &sink : 0);
+        uint64_t lookback_len = scratch->lookback.len;
+        if (fused && lookback_ok)
+        {
+            loh_huff_stream_end(&sink, scratch->lookback.data, scratch->lookback.len);
+            lookback_len = sink.coded;
+            time_fused = sink.time;
+            lookback_ok = sink.out.buffer.data != 0;
+        }
+        if (stats)
+        {
+            stats->lookback_in = buf.len;
+            stats->lookback_out = lookback_len;
+        }
+        if (lookback_ok && lookback_len < buf.len)
+        {
+            lb_comp_ratio_100 = lookback_len * 100 / buf.len;
+            if (fused && sink.out.buffer.borrowed && sink.out.buffer.len < lookback_len)
+            {
+                out->len += sink.out.buffer.len;
+                fused_kept = 1;
+            }
+            else if (fused)
+            {
+                // huffman coding didn't make it any smaller, so the stream is kept as it is, and has to be decoded back out
+                scratch->lookback.len = 0;
+                bytes_reserve(&scratch->lookback, lookback_len);
+                if (!scratch->lookback.data || huff_unpack(sink.out.buffer.data, sink.out.buffer.len, scratch->lookback.data, lookback_len))
+                {
+                    loh_huff_stream_free(&sink);
+                    loh_trace_event(params->tracer, "lookback", LOH_TRACE_NO_CHUNK, 0);
+                    return 0;
+                }
+                scratch->lookback.len = lookback_len;
+            }
+            if (!fused_kept)
+                buf = scratch->lookback;
+        }
+        else
+            did_lookback = 0;
+        if (fused)
+            loh_huff_stream_free(&sink);
+        // if lookback was dropped, the entropy stage codes the original data as usual
+        fused = fused && did_lookback;
+        loh_trace_event(params->tracer, "lookback", LOH_TRACE_NO_CHUNK, 0);
+    }
+    double time_entropy = stats ? LOH_STATS_TIME() : 0.0;
+    loh_trace_event(params->tracer, "entropy", LOH_TRACE_NO_CHUNK, 1);
+    double speed_entropy = speed ? LOH_SPEED_TIME() : 0.0;
+    
+    uint8_t did_huff = fused_kept ? LOH_ENTROPY_HUFF : 0;
+    uint8_t did_split = 0;
+    uint64_t table_bytes = fused_kept ? sink.table_bytes : 0;
+    size_t entropy_in = fused_kept ? sink.coded : buf.len;
+    uint8_t kind = do_huff == LOH_ENTROPY_ANS ? LOH_ENTROPY_ANS : LOH_ENTROPY_HUFF;
+    if (did_lookback && params->split_streams)
+    {
+        // each stream gets its own entropy coding, in place of a single entropy stage
+        if (!loh_split_pack(do_huff, buf.data, buf.len, out, params, scratch, &table_bytes))
+        {
+            loh_trace_event(params->tracer, "entropy", LOH_TRACE_NO_CHUNK, 0);
+            return 0;
+        }
+        did_split = 1;
+    }
+    else if (do_huff && !fused)
+    {
+        // entropy coding is the last stage, so it's written straight into out (and dropped if it isn't smaller than its input)
+        if (!out->borrowed)
+            bytes_reserve(out, buf.len);
+        
+        size_t best_len = loh_entropy_pack_bounded(kind, buf.data, buf.len, out, buf.len, params, scratch, &table_bytes);
+        if (best_len)
+            did_huff = kind;
+        
+        if (do_huff == LOH_ENTROPY_BEST && loh_entropy_pack_replace(LOH_ENTROPY_ANS, buf.data, buf.len, out, data_start, best_len ? best_len : buf.len, params, scratch, &table_bytes))
+            did_huff = LOH_ENTROPY_ANS;
+    }
+    
+    // if we did lookback but it's tenuous, try huff-compressing the original data too to see if it comes out smaller
+    
+    if (do_huff && (did_huff || did_split) && did_lookback && (lb_comp_ratio_100 > 80 || ((did_diff != 0 || header.filter != 0) && lb_comp_ratio_100 > 30)))
+    {
+        for (uint8_t kind_2 = LOH_ENTROPY_HUFF; kind_2 <= LOH_ENTROPY_ANS; kind_2 += 1)
+        {
+            if (do_huff != LOH_ENTROPY_BEST && kind_2 != kind)
+                continue;
+            if (loh_entropy_pack_replace(kind_2, orig_buf.data, orig_buf.len, out, data_start, out->len - data_start, params, scratch, &table_bytes))
+            {
+                entropy_in = orig_buf.len;
+                did_huff = kind_2;
+                did_lookback = 0;
+                did_split = 0;
+            }
+        }
+    }
+    if (!did_huff && !did_split)
+        bytes_push(out, buf.data, buf.len);
+    loh_trace_event(params->tracer, "entropy", LOH_TRACE_NO_CHUNK, 0);
+    
+    if (speed && do_huff && entropy_in)
+        speed->entropy_time = (LOH_SPEED_TIME() - speed_entropy) / entropy_in;
+    
+    if (!out->data || out->borrowed != out_borrowed)
+        return 0;
+    
+    header.do_diff = did_diff;
+    header.do_lookback = did_lookback;
+    header.do_huff = did_huff;
+    header.split = did_split;
+    
+    // if lookback was dropped, the chunk doesn't depend on the dictionary after all, and its header is 4 bytes shorter than the placeholder
+    if (!did_lookback && header.dict_len)
+    {
+        header.dict_len = 0;
+        memmove(&out->data[data_start - 4], &out->data[data_start], out->len - data_start);
+        out->len -= 4;
+        data_start -= 4;
+    }
+    
+    loh_byte_buffer header_buf = {&out->data[header_start], 0, LOH_CHUNK_HEADER_MAX, 1, 0};
+    chunk_header_push(&header_buf, &header);
+    
+    if (stats)
+    {
+        double time_end = LOH_STATS_TIME();
+        stats->in_bytes = in_size;
+        stats->out_bytes = out->len - header_start;
+        stats->delta_stride = did_diff;
+        stats->filter = header.filter;
+        stats->lookback_kept = did_lookback;
+        stats->entropy_kept = did_huff;
+        stats->split_kept = did_split;
+        if (did_huff || did_split)
+        {
+            stats->entropy_in = entropy_in;
+            stats->entropy_out = out->len - data_start;
+            stats->entropy_table_bytes = table_bytes;
+        }
+        stats->time_prepare = time_lookback - time_start;
+        stats->time_lookback = time_entropy - time_lookback - time_fused;
+        stats->time_entropy = time_end - time_entropy + time_fused;
+    }
+    
+    return 1;
+}
+
+// a rough estimate of how long a compressed chunk takes to decode (in arbitrary units), for loh_params.trial_tolerance
+// going by the typical per-byte speeds of each stage: entropy decoding is by far the slowest, then lookback, then filters
+static uint64_t loh_chunk_decode_cost(const uint8_t * chunk, size_t chunk_len, uint64_t out_len)
+{
+    loh_chunk_header header;
+    size_t header_len = chunk_header_read(chunk, chunk_len, &header);
+    if (!header_len)
+        return -1;
+    
+    // the entropy stage decodes to the lookback stage's input if there is one, which starts with its length
+    uint64_t entropy_len = out_len;
+    if (header.do_huff && header.do_lookback && chunk_len >= header_len + 8)
+        entropy_len = loh_read_u64(&chunk[header_len]);
+    
+    uint64_t cost = 0;
+    if (header.do_huff)
+        cost += entropy_len * (header.do_huff == LOH_ENTROPY_ANS ? 10 : 8);
+    loh_split_layout layout;
+    if (header.split && !loh_split_read(&chunk[header_len], chunk_len - header_len, out_len, &layout))
+    {
+        for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
+        {
+            if (layout.kind[n])
+                cost += layout.len[n] * (layout.kind[n] == LOH_ENTROPY_ANS ? 10 : 8);
+        }
+    }
+    if (header.do_lookback)
+        cost += out_len * 2;
+    if (header.filter)
+        cost += out_len * 3;
+    else if (header.do_diff)
+        cost += out_len;
+    return cost;
+}
+
+// each trial works on its own copy of the chunk, in its own scratch space, so they can all run at once
+typedef struct loh_trial_state {
+    loh_compress_scratch scratch;
+    loh_byte_buffer in;
+    loh_byte_buffer out;
+    loh_chunk_stats stats;
+    int ok;
+} loh_trial_state;
+
+// allocator is what trials itself came from; each trial's buffers come from its own scratch's allocator
+static void loh_trial_states_free(loh_trial_state * trials, uint32_t trial_count, const loh_allocator * allocator)
+{
+    for (uint32_t n = 0; trials && n < trial_count; n += 1)
+    {
+        bytes_free(&trials[n].out);
+        bytes_free(&trials[n].in);
+        loh_compress_scratch_free(&trials[n].scratch);
+    }
+    loh_dealloc(allocator, trials);
+}
+
+typedef struct {
+    const uint8_t * raw_data;
+    uint64_t in_size;
+    const uint8_t * dict;
+    uint64_t dict_len;
+    const loh_params * params;
+    loh_trial_state * trials;
+    uint8_t want_stats;
+} loh_trial_job;
+
+static void loh_trial_run(void * _job, size_t n)
+{
+    const loh_trial_job * job = (const loh_trial_job *)_job;
+    const loh_trial * trial = &job->params->trials[n];
+    loh_trial_state * state = &job->trials[n];
+    
+    loh_params params = *job->params;
+    params.trials = 0;
+    params.trial_count = 0;
+    // the trials are what's being run in parallel already
+    params.parallel_for = 0;
+    params.stats = 0;
+    params.do_lookback = trial->do_lookback < 12 ? trial->do_lookback : 12;
+    params.do_huff = trial->do_huff;
+    params.do_diff = trial->do_diff < LOH_TRIAL_NO_DIFF ? trial->do_diff : 0;
+    params.no_diff_detect = trial->do_diff >= LOH_TRIAL_NO_DIFF;
+    
+    // trials run on different threads, so their buffers come from their own scratch (and its own arena, if any)
+    loh_compress_scratch_bind(&state->scratch, &params);
+    state->in.allocator = state->scratch.allocator;
+    state->out.allocator = state->scratch.allocator;
+    state->in.len = 0;
+    state->out.len = 0;
+    bytes_push(&state->in, job->raw_data, job->in_size);
+    memset(&state->stats, 0, sizeof(loh_chunk_stats));
+    state->ok = state->in.data && loh_compress_chunk_once(state->in.data, job->in_size, job->dict, job->dict_len, &params, &state->scratch, &state->out, job->want_stats ? &state->stats : 0);
+}
+
+// compresses a single chunk, deciding which stages are worth keeping, and appends it (header included) to out
+// passed-in data is modified (delta coding and filtering are done in place)
+// if dict_len isn't zero, dict is the uncompressed data from just before the chunk, and the chunk is made dependent on it
+//  (see loh_params.dict_size); it has to be the original data, not what an earlier call turned it into in place
+// the last stage is written straight into out; earlier stages and losing trials go into scratch, which is reused between calls
+// returns 0 on failure (allocation failure, or out being a borrowed buffer that ran out of room)
+// stats may be null
+static int loh_compress_chunk(uint8_t * raw_data, uint64_t in_size, const uint8_t * dict, uint64_t dict_len, const loh_params * params, loh_compress_scratch * scratch, loh_byte_buffer * out, loh_chunk_stats * stats)
+{
+    if (!params->trials || !params->trial_count)
+        return loh_compress_chunk_once(raw_data, in_size, dict, dict_len, params, scratch, out, stats);
+    
+    loh_compress_scratch_bind(scratch, params);
+    if (scratch->trial_count < params->trial_count)
+    {
+        loh_trial_states_free(scratch->trials, scratch->trial_count, scratch->allocator);
+        scratch->trial_count = 0;
+        scratch->trials = (loh_trial_state *)loh_alloc(scratch->allocator, sizeof(loh_trial_state) * params->trial_count);
+        if (!scratch->trials)
+            return 0;
+        memset(scratch->trials, 0, sizeof(loh_trial_state) * params->trial_count);
+        scratch->trial_count = params->trial_count;
+    }
+    
+    loh_trial_job job = {raw_data, in_size, dict, dict_len, params, scratch->trials, stats != 0};
+    if (params->parallel_for)
+        params->parallel_for(params->parallel_arg, loh_trial_run, &job, params->trial_count);
+    else
+    {
+        for (uint32_t n = 0; n < params->trial_count; n += 1)
+            loh_trial_run(&job, n);
+    }
+    
+    // smallest first, then the fastest to decode of the ones that are close enough to it
+    loh_trial_state * best = 0;
+    for (uint32_t n = 0; n < params->trial_count; n += 1)
+    {
+        loh_trial_state * state = &scratch->trials[n];
+        if (!state->ok)
+            return 0;
+        if (!best || state->out.len < best->out.len)
+            best = state;
+    }
+    if (params->trial_tolerance)
+    {
+        uint64_t max_len = best->out.len + best->out.len * params->trial_tolerance / 1000;
+        uint64_t best_cost = loh_chunk_decode_cost(best->out.data, best->out.len, in_size);
+        for (uint32_t n = 0; n < params->trial_count; n += 1)
+        {
+            loh_trial_state * state = &scratch->trials[n];
+            if (state->out.len > max_len)
+                continue;
+            uint64_t cost = loh_chunk_decode_cost(state->out.data, state->out.len, in_size);
+            if (cost < best_cost || (cost == best_cost && state->out.len < best->out.len))
+            {
+                best = state;
+                best_cost = cost;
+            }
+        }
+    }
+    
+    uint8_t out_borrowed = out->borrowed;
+    bytes_push(out, best->out.data, best->out.len);
+    if (!out->data || out->borrowed != out_borrowed)
+        return 0;
+    
+    if (stats)
+    {
+        *stats = best->stats;
+        // the times count every trial, not just the one that was kept
+        for (uint32_t n = 0; n < params->trial_count; n += 1)
+        {
+            if (&scratch->trials[n] == best)
+                continue;
+            stats->time_prepare += scratch->trials[n].stats.time_prepare;
+            stats->time_lookback += scratch->trials[n].stats.time_lookback;
+            stats->time_entropy += scratch->trials[n].stats.time_entropy;
+        }
+    }
+    return 1;
+}
+
+// splits the input into chunks (see below)
+static inline uint64_t loh_chunk_size(const loh_params * params, size_t len, uint32_t default_chunk_div)
+{
+    uint64_t chunk_div = params->chunk_div ? params->chunk_div : default_chunk_div;
+    if (chunk_div == 0)
+        chunk_div = 1;
+    uint64_t chunk_size = (len + chunk_div - 1) / chunk_div;
+    if (chunk_size < (1 << 15))
+        chunk_size = (1 << 15);
+    return chunk_size;
+}
+
+// content-defined chunking (loh_params.content_chunk_size) only looks at this many bytes before each possible boundary
+#define LOH_CDC_WINDOW 64
+
+// the shortest and longest a content-defined chunk can be, and the mask for the top bits of the rolling hash that have to
+//  be zero for a chunk to end; past min_size, a chunk ends at each byte with a chance of one in 2 to the power of mask's bit count, so
+//  the average comes out to about content_chunk_size
+static inline void loh_cdc_sizes(const loh_params * params, uint64_t * min_size, uint64_t * max_size, uint64_t * mask)
+{
+    uint64_t average = params->content_chunk_size;
+    *min_size = average / 4 > (1 << 15) ? average / 4 : (1 << 15);
+    *max_size = average > *min_size ? average * 4 : *min_size * 4;
+    uint8_t bits = average > *min_size * 2 ? loh_ceil_log2(average - *min_size) : 1;
+    *mask = ~(~(uint64_t)0 >> bits);
+}
+
+// where the chunk starting at start should end
+// the hash is shifted left once per byte, so by the time it's checked, every byte further back than LOH_CDC_WINDOW has been
+//  shifted out of it, and where a chunk ends doesn't depend on where it started (as long as it's past min_size)
+static uint64_t loh_cdc_cut(const uint8_t * data, uint64_t start, uint64_t len, uint64_t min_size, uint64_t max_size, uint64_t mask, const uint64_t * gear)
+{
+    if (len - start <= min_size)
+        return len;
+    uint64_t end = len - start > max_size ? start + max_size : len;
+    uint64_t h = 0;
+    for (uint64_t i = start + min_size - LOH_CDC_WINDOW; i < start + min_size; i++)
+        h = (h << 1) + gear[data[i]];
+    for (uint64_t i = start + min_size; i < end; i++)
+    {
+        if (!(h & mask))
+            return i;
+        h = (h << 1) + gear[data[i]];
+    }
+    return end;
+}
+
+// where each of the input's chunks starts and ends, and which of them get copied from loh_params.reuse
+typedef struct {
+    uint64_t len;
+    uint64_t chunk_count;
+    // fixed-size chunks: every chunk but the last is this long
+    uint64_t chunk_size;
+    // content-defined chunks: where each chunk ends (null otherwise)
+    uint64_t * ends;
+    // loh_params.reuse: for each chunk, 1 + the index of the previous file's chunk it's a copy of, or 0 (null otherwise)
+    uint64_t * reused;
+    const loh_allocator * allocator;
+} loh_chunk_layout;
+
+static void loh_chunk_layout_match(loh_chunk_layout * layout, const uint8_t * data, const loh_params * params);
+
+// data has to be the input as given, before any chunk is compressed (and delta coded or filtered in place)
+// returns 0 on allocation failure
+static int loh_chunk_layout_init(loh_chunk_layout * layout, const uint8_t * data, size_t len, const loh_params * params, uint32_t default_chunk_div)
+{
+    memset(layout, 0, sizeof(loh_chunk_layout));
+    layout->len = len;
+    layout->allocator = params->allocator;
+    layout->chunk_size = loh_chunk_size(params, len, default_chunk_div);
+    layout->chunk_count = (len + layout->chunk_size - 1) / layout->chunk_size;
+    
+    if (params->content_chunk_size && len)
+    {
+        uint64_t min_size, max_size, mask;
+        loh_cdc_sizes(params, &min_size, &max_size, &mask);
+        layout->ends = (uint64_t *)loh_alloc(layout->allocator, sizeof(uint64_t) * (len / min_size + 1));
+        if (!layout->ends)
+            return 0;
+        
+        // any fixed random values will do, as long as they never change, or else no chunks will match older files'
+        uint64_t gear[256];
+        uint64_t x = 0;
+        for (size_t b = 0; b < 256; b++)
+        {
+            x += 0x9E3779B97F4A7C15;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EB;
+            gear[b] = z ^ (z >> 31);
+        }
+        
+        layout->chunk_count = 0;
+        uint64_t start = 0;
+        while (start < len)
+        {
+            start = loh_cdc_cut(data, start, len, min_size, max_size, mask, gear);
+            layout->ends[layout->chunk_count++] = start;
+        }
+    }
+    
+    if (params->reuse)
+        loh_chunk_layout_match(layout, data, params);
+    return 1;
+}
+
+static void loh_chunk_layout_free(loh_chunk_layout * layout)
+{
+    loh_dealloc(layout->allocator, layout->ends);
+    loh_dealloc(layout->allocator, layout->reused);
+    layout->ends = 0;
+    layout->reused = 0;
+}
+
+static inline uint64_t loh_chunk_start(const loh_chunk_layout * layout, uint64_t i)
+{
+    if (layout->ends)
+        return i ? layout->ends[i - 1] : 0;
+    return i * layout->chunk_size;
+}
+
+static inline uint64_t loh_chunk_end(const loh_chunk_layout * layout, uint64_t i)
+{
+    if (layout->ends)
+        return layout->ends[i];
+    return (i + 1) * layout->chunk_size < layout->len ? (i + 1) * layout->chunk_size : layout->len;
+}
+
+// appends chunk i's compressed bytes from loh_params.reuse to out, if it has some; returns 0 if it doesn't
+static int loh_chunk_reuse(const loh_chunk_layout * layout, uint64_t i, const loh_params * params, loh_byte_buffer * out, loh_chunk_stats * stats)
+{
+    if (!layout->reused || !layout->reused[i])
+        return 0;
+    const uint8_t * chunk_table = &params->reuse[16 + (layout->reused[i] - 1) * 16];
+    uint64_t in_start = loh_read_u64(&chunk_table[0]);
+    uint64_t in_end = loh_read_u64(&chunk_table[16]);
+    bytes_push(out, &params->reuse[in_start], in_end - in_start);
+    if (stats)
+    {
+        stats->in_bytes = loh_chunk_end(layout, i) - loh_chunk_start(layout, i);
+        stats->out_bytes = in_end - in_start;
+        stats->reused = 1;
+    }
+    return 1;
+}
+
+// returns roughly how many bytes of working memory compressing a single chunk takes with the given params,
+//  not counting the input or the final output
+// len is the length of the whole input; if it's 0, only the fixed cost is returned (the match finder's tables
+//  at their full configured size), since everything else scales with chunk length
+// threaded compression works on every chunk at once, so multiply by the number of chunks (usually the thread count)
+LOH_API size_t loh_compress_memory_usage(const loh_params * params, size_t len)
+{
+    uint64_t chunk_size = len ? loh_chunk_size(params, len, 4) : (uint64_t)1 << 62;
+    if (len && params->content_chunk_size)
+    {
+        uint64_t min_size, max_size, mask;
+        loh_cdc_sizes(params, &min_size, &max_size, &mask);
+        chunk_size = max_size < len ? max_size : len;
+    }
+    size_t total = 0;
+    
+    // each trial has its own scratch space, plus its own copy of the chunk and its own output
+    if (params->trials && params->trial_count)
+    {
+        loh_params trial_params = *params;
+        trial_params.trials = 0;
+        trial_params.trial_count = 0;
+        trial_params.parallel_for = 0;
+        for (uint32_t n = 0; n < params->trial_count; n += 1)
+        {
+            trial_params.do_lookback = params->trials[n].do_lookback < 12 ? params->trials[n].do_lookback : 12;
+            trial_params.do_huff = params->trials[n].do_huff;
+            total += loh_compress_memory_usage(&trial_params, len);
+            if (len)
+                total += (((uint64_t)1) << loh_ceil_log2(chunk_size)) + (((uint64_t)1) << loh_ceil_log2(chunk_size + chunk_size / 8 + 64));
+        }
+        return total;
+    }
+    
+    if (params->do_lookback)
+    {
+        uint8_t hash_bits;
+        uint8_t window_bits;
+        hashmap_table_bits(params, chunk_size, &hash_bits, &window_bits);
+        total += sizeof(uint32_t) << hash_bits;
+        total += sizeof(uint32_t) << window_bits;
+        if (params->long_distance)
+            total += sizeof(uint64_t) << loh_ldm_table_bits(chunk_size);
+        if (params->parallel_for)
+            total += sizeof(loh_match_candidate) << (window_bits > 12 + 3 ? window_bits - 3 : 12);
+    }
+    if (!len)
+        return total;
+    
+    // scratch buffers grow by doubling, so they can be up to twice the size of their contents
+    // the last stage writes straight into the output, so only the lookback output and the spare entropy coding trial count
+    uint64_t stage_buf = ((uint64_t)1) << loh_ceil_log2(chunk_size + chunk_size / 8 + 64);
+    uint8_t stage_count = 0;
+    stage_count += params->do_lookback ? 1 : 0;
+    stage_count += (params->do_huff && (params->do_lookback || params->do_huff == LOH_ENTROPY_BEST)) ? 1 : 0;
+    // each split stream has room for the whole lookback stream
+    stage_count += (params->do_lookback && params->split_streams) ? LOH_SPLIT_STREAMS : 0;
+    total += stage_buf * stage_count;
+    
+    // tANS scratch space
+    if (params->do_huff == LOH_ENTROPY_ANS || params->do_huff == LOH_ENTROPY_BEST)
+        total += (1 << 15) * 3;
+    // parallel huffman coding's slots
+    if (params->parallel_for && chunk_size > ((uint64_t)1 << 15) && (params->do_huff == LOH_ENTROPY_HUFF || params->do_huff == LOH_ENTROPY_BEST))
+        total += LOH_HUFF_SLOT_SIZE * LOH_HUFF_BATCH;
+    
+    return total;
+}
+
+// sets up stats to hold chunk_count chunks, returning its per-chunk array (null if stats is null or allocation fails)
+static loh_chunk_stats * loh_stats_begin(loh_stats * stats, uint64_t chunk_count)
+{
+    if (!stats)
+        return 0;
+    loh_stats_free(stats);
+    if (!chunk_count)
+        return 0;
+    stats->chunks = (loh_chunk_stats *)LOH_MALLOC(sizeof(loh_chunk_stats) * chunk_count);
+    if (!stats->chunks)
+        return 0;
+    memset(stats->chunks, 0, sizeof(loh_chunk_stats) * chunk_count);
+    stats->chunk_count = chunk_count;
+    return stats->chunks;
+}
+
+// writes stats to f as a table with one line per chunk, followed by the match length and distance histograms (over all chunks)
+LOH_API void loh_stats_print(const loh_stats * stats, FILE * f)
+{
+    fprintf(f, "chunk\tin\tout\tdelta\tfilter\tlookback\tentropy\tsplit\treused\tlb_in\tlb_out\tmatches\tlong_matches\tlit_runs\tlit_bytes\tent_in\tent_out\tent_table\tt_prep\tt_lb\tt_ent\n");
+    uint64_t length_hist[LOH_STATS_HIST_BINS] = {0};
+    uint64_t distance_hist[LOH_STATS_HIST_BINS] = {0};
+    for (uint64_t i = 0; i < stats->chunk_count; i++)
+    {
+        const loh_chunk_stats * c = &stats->chunks[i];
+        fprintf(f, "%llu\t%llu\t%llu\t%u\t%u\t%u\t%u\t%u\t%u\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%llu\t%.6f\t%.6f\t%.6f\n",
+            (unsigned long long)i, (unsigned long long)c->in_bytes, (unsigned long long)c->out_bytes,
+            c->delta_stride, c->filter, c->lookback_kept, c->entropy_kept, c->split_kept, c->reused,
+            (unsigned long long)c->lookback_in, (unsigned long long)c->lookback_out,
+            (unsigned long long)c->match_count, (unsigned long long)c->long_match_count, (unsigned long long)c->literal_run_count, (unsigned long long)c->literal_bytes,
+            (unsigned long long)c->entropy_in, (unsigned long long)c->entropy_out, (unsigned long long)c->entropy_table_bytes,
+            c->time_prepare, c->time_lookback, c->time_entropy);
+        for (size_t b = 0; b < LOH_STATS_HIST_BINS; b++)
+        {
+            length_hist[b] += c->match_length_hist[b];
+            distance_hist[b] += c->match_distance_hist[b];
+        }
+    }
+    fprintf(f, "bin\tlengths\tdistances\n");
+    for (size_t b = 0; b < LOH_STATS_HIST_BINS; b++)
+    {
+        if (length_hist[b] || distance_hist[b])
+            fprintf(f, "%llu\t%llu\t%llu\n", 1ULL << b, (unsigned long long)length_hist[b], (unsigned long long)distance_hist[b]);
+    }
+}
+
+static inline void loh_chunk_table_set(loh_byte_buffer * buf, size_t chunk_table_loc, size_t i, uint64_t value)
+{
+    // the output might be a caller's buffer with no particular alignment
+    memcpy(&buf->data[chunk_table_loc + i * 8], &value, 8);
+}
+
+// appends the whole compressed file to real_buf
+// returns 0 on failure (allocation failure, or real_buf being a borrowed buffer that ran out of room)
+static int _loh_compress_impl(uint8_t * data, size_t len, const loh_params * _params, loh_byte_buffer * real_buf, loh_compress_scratch * scratch)
+{
+    loh_params params = *_params;
+    if (params.do_lookback > 12)
+        params.do_lookback = 12;
+    
+    uint32_t checksum = loh_checksum(data, len);
+    
+    // LOH files are composed of a series of arbitrary-length chunks.
+    // Chunks have their compressed and decompressed start addresses stored in the header,
+    //  and also the address just past the end of the last chunk (still for both).
+    // Compression config is stored on a per-chunk basis at the start of each compressed chunk.
+    // For the sake of simplicity, the reference compressor divides the file into at most N chunks,
+    //  or chunks with 32KB length, whichever gives bigger chunks.
+    // There is no maximum chunk size.
+    
+    loh_chunk_layout layout;
+    if (!loh_chunk_layout_init(&layout, data, len, &params, 4))
+        return 0;
+    uint64_t chunk_count = layout.chunk_count;
+    
+    //printf("%lld\n", chunk_count);
+    
+    uint8_t borrowed = real_buf->borrowed;
+    
+    loh_chunk_stats * stats = loh_stats_begin(params.stats, chunk_count);
+    
+    bytes_push(real_buf, (const uint8_t *)"LOHz", 4);
+    bytes_push(real_buf, (uint8_t *)&checksum, 4);
+    bytes_push(real_buf, (uint8_t *)&chunk_count, 8);
+    
+    size_t chunk_table_loc = real_buf->len;
+    for (size_t i = 0; i < chunk_count + 1; i += 1)
+    {
+        uint64_t n = 0;
+        bytes_push(real_buf, (uint8_t *)&n, 8);
+        bytes_push(real_buf, (uint8_t *)&n, 8);
+    }
+    if (!real_buf->data || real_buf->borrowed != borrowed)
+    {
+        loh_chunk_layout_free(&layout);
+        return 0;
+    }
+    
+    // dependent chunks: dicts[i & 1] holds the dictionary for chunk i
+    uint64_t dict_size = loh_dict_size(&params);
+    loh_compress_scratch_bind(scratch, &params);
+    loh_byte_buffer dicts[2] = {{0, 0, 0, 0, scratch->allocator}, {0, 0, 0, 0, scratch->allocator}};
+    
+    int ok = 1;
+    uint64_t total_uncompressed_len = 0;
+    for (size_t i = 0; ok && i < chunk_count; i += 1)
+    {
+        loh_chunk_table_set(real_buf, chunk_table_loc, i * 2 + 0, real_buf->len);
+        loh_chunk_table_set(real_buf, chunk_table_loc, i * 2 + 1, total_uncompressed_len);
+        
+        uint64_t in_start = loh_chunk_start(&layout, i);
+        uint64_t in_end = loh_chunk_end(&layout, i);
+        
+        //printf("%lld %lld\n", in_start, in_end);
+        
+        uint64_t in_size = in_end - in_start;
+        
+        // if saving a dictionary fails, the chunk that would have used it just ends up independent
+        loh_byte_buffer * dict = &dicts[i & 1];
+        if (dict_size && i + 1 < chunk_count)
+            loh_dict_save(&dicts[(i + 1) & 1], &data[in_start], in_size, dict_size);
+        
+        if (loh_chunk_reuse(&layout, i, &params, real_buf, stats ? &stats[i] : 0))
+            ok = real_buf->data != 0;
+        else
+        {
+            loh_trace_event(params.tracer, "compress chunk", i, 1);
+            ok = loh_compress_chunk(&data[in_start], in_size, dict->data, dict->len, &params, scratch, real_buf, stats ? &stats[i] : 0);
+            loh_trace_event(params.tracer, "compress chunk", i, 0);
+        }
+        
+        total_uncompressed_len += in_size;
+    }
+    loh_chunk_table_set(real_buf, chunk_table_loc, chunk_count * 2 + 0, real_buf->len);
+    loh_chunk_table_set(real_buf, chunk_table_loc, chunk_count * 2 + 1, total_uncompressed_len);
+    
+    bytes_free(&dicts[1]);
+    bytes_free(&dicts[0]);
+    loh_chunk_layout_free(&layout);
+    
+    return ok;
+}
+
+static uint8_t * _loh_compress_alloc(uint8_t * data, size_t len, const loh_params * params, size_t * out_len)
+{
+    if (!data || !out_len || !params) return 0;
+    
+    loh_byte_buffer real_buf = {0, 0, 0, 0, 0};
+    loh_compress_scratch scratch;
+    memset(&scratch, 0, sizeof(loh_compress_scratch));
+    
+    int ok = _loh_compress_impl(data, len, params, &real_buf, &scratch);
+    loh_compress_scratch_free(&scratch);
+    if (!ok)
+    {
+        LOH_FREE(real_buf.data);
+        return 0;
+    }
+    
+    *out_len = real_buf.len;
+    return real_buf.data;
+}
+
+// passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+LOH_API uint8_t * loh_compress(uint8_t * data, size_t len, uint8_t do_lookback, uint8_t do_huff, uint8_t do_diff, size_t * out_len)
+{
+    loh_params params;
+    memset(&params, 0, sizeof(loh_params));
+    params.do_lookback = do_lookback;
+    params.do_huff = do_huff;
+    params.do_diff = do_diff;
+    return _loh_compress_alloc(data, len, &params, out_len);
+}
+
+// like loh_compress, but uses 2d image filters instead of delta coding
+// bpp is the number of bytes per pixel, and row_stride is the number of bytes per row (including any padding)
+LOH_API uint8_t * loh_compress_image(uint8_t * data, size_t len, uint8_t do_lookback, uint8_t do_huff, uint8_t bpp, uint32_t row_stride, size_t * out_len)
+{
+    loh_params params;
+    memset(&params, 0, sizeof(loh_params));
+    params.do_lookback = do_lookback;
+    params.do_huff = do_huff;
+    params.image_bpp = bpp;
+    params.image_stride = row_stride;
+    return _loh_compress_alloc(data, len, &params, out_len);
+}
+
+// like loh_compress, but takes its settings from a loh_params struct
+LOH_API uint8_t * loh_compress_ex(uint8_t * data, size_t len, const loh_params * params, size_t * out_len)
+{
+    return _loh_compress_alloc(data, len, params, out_len);
+}
+
+// the content_chunk_size loh_recompress uses if params doesn't have one
+#define LOH_CDC_DEFAULT_SIZE (1 << 18)
+
+// like loh_compress_ex, but copies the compressed bytes of any chunk that hasn't changed since prev (an earlier LOH file,
+//  which is only read) instead of compressing it again (see loh_params.reuse)
+// chunk boundaries are content-defined (LOH_CDC_DEFAULT_SIZE, unless params has its own content_chunk_size), so for the
+//  best results, prev should have been made by loh_recompress too, or with the same content_chunk_size
+LOH_API uint8_t * loh_recompress(const uint8_t * prev, size_t prev_len, uint8_t * data, size_t len, const loh_params * _params, size_t * out_len)
+{
+    if (!_params) return 0;
+    
+    loh_params params = *_params;
+    params.reuse = prev;
+    params.reuse_len = prev ? prev_len : 0;
+    if (!params.content_chunk_size)
+        params.content_chunk_size = LOH_CDC_DEFAULT_SIZE;
+    return _loh_compress_alloc(data, len, &params, out_len);
+}
+
+// the most space loh_compress_into can need for an input of the given length, whatever the params
+// (chunks are never smaller than 32KB, except the last one, and any chunk can fall back to being stored as-is)
+LOH_API size_t loh_compress_bound(size_t len)
+{
+    size_t max_chunk_count = len / (1 << 15) + 1;
+    return 16 + (max_chunk_count + 1) * 16 + max_chunk_count * LOH_CHUNK_HEADER_MAX + len;
+}
+
+// like loh_compress_ex, but writes into the caller's buffer instead of allocating one
+// the entropy coding stage writes straight into dst, so the only copies are of chunks where it doesn't pay off
+// scratch holds the working memory for the intermediate stages; it can be reused across calls to avoid reallocating it
+//  (zero it before first use, and release it with loh_compress_scratch_free), or passed as null to use a temporary one
+// returns the compressed length, or 0 if dst isn't big enough (cap >= loh_compress_bound(len) is always enough)
+LOH_API size_t loh_compress_into(uint8_t * data, size_t len, const loh_params * params, uint8_t * dst, size_t cap, loh_compress_scratch * scratch)
+{
+    if (!data || !params || !dst) return 0;
+    
+    loh_compress_scratch temp_scratch;
+    memset(&temp_scratch, 0, sizeof(loh_compress_scratch));
+    if (!scratch)
+        scratch = &temp_scratch;
+    
+    loh_byte_buffer real_buf = {dst, 0, cap, 1, 0};
+    int ok = _loh_compress_impl(data, len, params, &real_buf, scratch);
+    loh_compress_scratch_free(&temp_scratch);
+    
+    // ran out of room and spilled into a new allocation
+    if (!real_buf.borrowed)
+    {
+        LOH_FREE(real_buf.data);
+        return 0;
+    }
+    return ok ? real_buf.len : 0;
+}
+
+/* decompression */
+
+// Decoding is two-phase: loh_validate checks the container (chunk table, chunk headers, declared stream lengths)
+//  before anything is allocated, then each stage decodes straight into an output buffer of exactly the validated size.
+// The stages check bounds once per token or block rather than once per byte, and return 1 on bad data instead of
+//  reading or writing out of bounds.
+
+// copies a match of size bytes from dist bytes back, which has already been bounds checked
+static inline void loh_match_copy(uint8_t * dst, uint64_t dist, uint64_t size)
+{
+    const uint8_t * src = dst - dist;
+    
+    // overlap is allowed here, so memcpy only works if the source ends before the destination starts
+    if (dist >= size)
+        memcpy(dst, src, size);
+    else if (dist == 1)
+        memset(dst, *src, size);
+    else if (dist >= 8)
+    {
+        // copying 8 bytes at a time is safe as long as each group's source was already written
+        size_t j = 0;
+        for (; j + 8 <= size; j += 8)
+        {
+            uint64_t temp;
+            memcpy(&temp, &src[j], 8);
+            memcpy(&dst[j], &temp, 8);
+        }
+        for (; j < size; j++)
+            dst[j] = src[j];
+    }
+    else
+    {
+        for (size_t j = 0; j < size; j++)
+            dst[j] = src[j];
+    }
+}
+
+// continuation bytes for sizes and distances never need more than this many bits before overflowing
+#define _LOH_READ_VARINT(VAR, CONTINUES, BITS, INPUT, I, INPUT_LEN) \
+    { \
+        uint64_t n = BITS; \
+        while (CONTINUES) \
+        { \
+            if (I >= INPUT_LEN || n > 56) \
+                return 1; \
+            uint64_t cont_dat = INPUT[I++]; \
+            CONTINUES = cont_dat & 1; \
+            VAR += ((cont_dat >> 1) << n); \
+            VAR += ((uint64_t)1) << n; \
+            n += 7; \
+        } \
+    }
+
+// decodes a lookback stream into out, which must be exactly as long as the stream says it is
+// matches can reach up to history bytes back from the start of out, for dependent chunks
+// returns 0 on success or 1 if the stream is bad
+static int lookback_decompress(const uint8_t * input, size_t input_len, uint8_t * out, size_t out_len, size_t history)
+{
+    if (input_len < 8 || loh_read_u64(input) != out_len)
+        return 1;
+    
+    size_t i = 8;
+    size_t o = 0;
+    
+    while (i < input_len)
+    {
+        uint8_t dat = input[i++];
+        
+        uint8_t size_continues = dat & 1;
+        uint64_t size = (dat >> 1) & loh_size_mask;
+        
+        uint8_t dist_continues = dat & (1 << (loh_size_bits + 1));
+        uint64_t dist = (dat >> (loh_size_bits + 2)) & loh_dist_mask;
+        
+        _LOH_READ_VARINT(size, size_continues, loh_size_bits, input, i, input_len)
+        _LOH_READ_VARINT(dist, dist_continues, loh_dist_bits, input, i, input_len)
+        
+        // lookback mode
+        if (dist > 0)
+        {
+            size += loh_min_lookback_length;
+            // bounds limit, checked once per token so the copy loops don't have to
+            if (dist > o + history || size > out_len - o)
+                return 1;
+            
+            loh_match_copy(&out[o], dist, size);
+            o += size;
+        }
+        // literal mode
+        else
+        {
+            size += 1;
+            
+            if (size > input_len - i || size > out_len - o)
+                return 1;
+            memcpy(&out[o], &input[i], size);
+            i += size;
+            o += size;
+        }
+    }
+    
+    return o == out_len ? 0 : 1;
+}
+
+// decodes the (already entropy decoded) streams of a split lookback stage into out; see lookback_decompress
+// the tokens are the same, just with their distance bytes and literals read from their own streams
+// returns 0 on success or 1 if the streams are bad
+static int lookback_decompress_split(const uint8_t * const * streams, const uint64_t * lens, uint8_t * out, size_t out_len, size_t history)
+{
+    const uint8_t * literals = streams[LOH_SPLIT_LITERALS];
+    const uint8_t * commands = streams[LOH_SPLIT_COMMANDS];
+    const uint8_t * distances = streams[LOH_SPLIT_DISTANCES];
+    size_t literals_len = lens[LOH_SPLIT_LITERALS];
+    size_t commands_len = lens[LOH_SPLIT_COMMANDS];
+    size_t distances_len = lens[LOH_SPLIT_DISTANCES];
+    size_t l = 0;
+    size_t c = 0;
+    size_t d = 0;
+    size_t o = 0;
+    
+    while (c < commands_len)
+    {
+        uint8_t dat = commands[c++];
+        
+        uint8_t size_continues = dat & 1;
+        uint64_t size = (dat >> 1) & loh_size_mask;
+        
+        uint8_t dist_continues = dat & (1 << (loh_size_bits + 1));
+        uint64_t dist = (dat >> (loh_size_bits + 2)) & loh_dist_mask;
+        
+        _LOH_READ_VARINT(size, size_continues, loh_size_bits, commands, c, commands_len)
+        _LOH_READ_VARINT(dist, dist_continues, loh_dist_bits, distances, d, distances_len)
+        
+        if (dist > 0)
+        {
+            size += loh_min_lookback_length;
+            if (dist > o + history || size > out_len - o)
+                return 1;
+            
+            loh_match_copy(&out[o], dist, size);
+            o += size;
+        }
+        else
+        {
+            size += 1;
+            
+            if (size > literals_len - l || size > out_len - o)
+                return 1;
+            memcpy(&out[o], &literals[l], size);
+            l += size;
+            o += size;
+        }
+    }
+    
+    return (o == out_len && l == literals_len && d == distances_len) ? 0 : 1;
+}
+
+#undef _LOH_READ_VARINT
+
+// decodes a huffman stream into out, which must be exactly as long as the stream says it is
+// returns 0 on success or 1 if the stream is bad
+static int huff_unpack(const uint8_t * input, size_t input_len, uint8_t * out, size_t out_len)
+{
+    loh_bit_buffer _buf;
+    memset(&_buf, 0, sizeof(loh_bit_buffer));
+    _buf.buffer.data = (uint8_t *)input;
+    _buf.buffer.len = input_len;
+    _buf.buffer.cap = input_len;
+    loh_bit_buffer * buf = &_buf;
+    
+    if (input_len < 8)
+        return 1;
+    
+    size_t output_len = bits_pop(buf, 8*8);
+    if (output_len != out_len)
+        return 1;
+    
+    size_t start_len = 0;
+    while (start_len < output_len)
+    {
+        // the bit buffer is forcibly aligned at the start of each chunk
+        if (buf->bit_index != 0)
+        {
+            buf->bit_index = 0;
+            buf->byte_index += 1;
+        }
+        if (buf->byte_index + 5 > input_len)
+            return 1;
+        
+        uint32_t chunk_len = bits_pop(buf, 8*4);
+        if (chunk_len == 0 || chunk_len > output_len - start_len)
+            return 1;
+        
+        uint8_t incompressible = bit_pop(buf);
+        
+        if (!incompressible)
+        {
+            // load huffman code description
+            // starts at code length 1
+            // bit 1: add 1 to code length
+            // bit 0: read next 8 bits as symbol for next code. add 1 to code
+            uint16_t symbol_count = bits_pop(buf, 8) + 1;
+            uint16_t max_codes[16] = {0};
+            uint8_t symbols[32768] = {0};
+            uint16_t code_value = 0;
+            size_t code_depth = 1;
+            uint8_t prev_symbol = 0;
+            for (size_t i = 0; i < symbol_count; i++)
+            {
+                uint8_t bit = bit_pop(buf);
+                while (bit)
+                {
+                    code_value <<= 1;
+                    code_depth += 1;
+                    bit = bit_pop(buf);
+                    if (code_depth > 15)
+                        return 1;
+                }
+                // more codes than fit in this many bits
+                if (code_value >= (1u << code_depth))
+                    return 1;
+                
+                // stored as diffs
+                // 0 : 1
+                // 10 : 2
+                // 110 : 3
+                // 1110 : 4
+                // 1111xxxxxxxx : other
+                uint8_t diff = 1 + bit_pop(buf);
+                diff += diff == 2 && bit_pop(buf);
+                diff += diff == 3 && bit_pop(buf);
+                diff += diff == 4 && bit_pop(buf);
+                if (diff == 5)
+                    diff = bits_pop(buf, 8);
+                
+                uint8_t symbol = prev_symbol + diff;
+                prev_symbol += diff;
+                
+                symbols[code_value] = symbol;
+                max_codes[code_depth] = code_value + 1;
+                code_value += 1;
+            }
+            max_codes[code_depth] = 0xFFFF;
+            
+            // the bit buffer is forcibly aligned to the start of the next byte at the end of the huffman tree data
+            if (buf->bit_index != 0)
+            {
+                buf->bit_index = 0;
+                buf->byte_index += 1;
+            }
+            
+            uint8_t * dst = &out[start_len];
+            size_t n = 0;
+            uint16_t code_word = 0;
+            uint16_t * max_code = max_codes + 1;
+            size_t j = buf->byte_index;
+            // operating on bit buffer input bytes/words is faster than operating on individual input bits
+            // a byte can't decode to more than 8 symbols, so the output only needs to be checked once per byte
+#define _LOH_PROCESS_BIT(B) \
+                code_word = code_word | ((word >> B) & 1); \
+                if (code_word < *max_code++) \
+                { \
+                    dst[n++] = symbols[code_word]; \
+                    code_word = 0; \
+                    max_code = max_codes + 1; \
+                } \
+                else \
+                    code_word <<= 1;
+            while (j < input_len && n + 8 <= chunk_len)
+            {
+                uint8_t word = input[j++];
+                _LOH_PROCESS_BIT(0) _LOH_PROCESS_BIT(1) _LOH_PROCESS_BIT(2) _LOH_PROCESS_BIT(3)
+                _LOH_PROCESS_BIT(4) _LOH_PROCESS_BIT(5) _LOH_PROCESS_BIT(6) _LOH_PROCESS_BIT(7)
+            }
+#undef _LOH_PROCESS_BIT
+            // the last few symbols of the chunk go bit by bit so that decoding stops exactly at the end of the chunk
+            uint8_t b = 0;
+            while (n < chunk_len)
+            {
+                if (j >= input_len)
+                    return 1;
+                code_word = code_word | ((input[j] >> b) & 1);
+                if (code_word < *max_code++)
+                {
+                    dst[n++] = symbols[code_word];
+                    code_word = 0;
+                    max_code = max_codes + 1;
+                }
+                else
+                    code_word <<= 1;
+                b += 1;
+                if (b == 8)
+                {
+                    b = 0;
+                    j += 1;
+                }
+            }
+            // the rest of the last byte is padding
+            buf->byte_index = b ? j + 1 : j;
+            buf->bit_index = 0;
+        }
+        else
+        {
+            // the bit buffer is forcibly aligned to the start of the next byte for incompressible data
+            if (buf->bit_index != 0)
+            {
+                buf->bit_index = 0;
+                buf->byte_index += 1;
+            }
+            
+            if (buf->byte_index > input_len || chunk_len > input_len - buf->byte_index)
+                return 1;
+            memcpy(&out[start_len], &input[buf->byte_index], chunk_len);
+            
+            buf->byte_index += chunk_len;
+            buf->bit_index = 0;
+        }
+        start_len += chunk_len;
+    }
+    
+    return 0;
+}
+
+
+// decodes a tANS stream into out, which must be exactly as long as the stream says it is
+// returns 0 on success or 1 if the stream is bad
+static int ans_unpack(const uint8_t * input, size_t input_len, uint8_t * output, size_t out_len)
+{
+    loh_bit_buffer buf;
+    memset(&buf, 0, sizeof(loh_bit_buffer));
+    buf.buffer.data = (uint8_t *)input;
+    buf.buffer.len = input_len;
+    buf.buffer.cap = input_len;
+    
+    if (input_len < 8)
+        return 1;
+    
+    size_t output_len = bits_pop(&buf, 8*8);
+    if (output_len != out_len)
+        return 1;
+    
+    // decoding table: one entry per state, giving the state's symbol and how to get the next state
+    typedef struct {
+        uint16_t base;
+        uint8_t symbol;
+        uint8_t nbits;
+    } ans_decode_entry;
+    
+    ans_decode_entry decode_table[LOH_ANS_TABLE_SIZE];
+    
+    size_t start_len = 0;
+    while (start_len < output_len)
+    {
+        // the bit buffer is forcibly aligned at the start of each chunk
+        if (buf.bit_index != 0)
+        {
+            buf.bit_index = 0;
+            buf.byte_index += 1;
+        }
+        if (buf.byte_index + 5 > input_len)
+            return 1;
+        
+        size_t chunk_len = bits_pop(&buf, 8*4);
+        if (chunk_len == 0 || chunk_len > output_len - start_len)
+            return 1;
+        
+        uint8_t incompressible = bit_pop(&buf);
+        
+        // the bit buffer is forcibly aligned before incompressible data or after the frequency table, so data always starts on a byte
+        if (incompressible)
+        {
+            buf.bit_index = 0;
+            buf.byte_index += 1;
+            if (chunk_len > input_len - buf.byte_index)
+                return 1;
+            memcpy(&output[start_len], &input[buf.byte_index], chunk_len);
+            buf.byte_index += chunk_len;
+            start_len += chunk_len;
+            continue;
+        }
+        
+        // load symbols and frequencies
+        size_t symbol_count = bits_pop(&buf, 8) + 1;
+        uint8_t symbols[256];
+        uint16_t norm[256] = {0};
+        uint16_t prev_symbol = 0;
+        for (size_t i = 0; i < symbol_count; i++)
+        {
+            uint16_t diff = 1 + bit_pop(&buf);
+            diff += diff == 2 && bit_pop(&buf);
+            diff += diff == 3 && bit_pop(&buf);
+            diff += diff == 4 && bit_pop(&buf);
+            if (diff == 5)
+                diff = bits_pop(&buf, 8);
+            if ((i > 0 && diff == 0) || prev_symbol + diff > 255)
+                return 1;
+            prev_symbol += diff;
+            symbols[i] = prev_symbol;
+        }
+        uint32_t remaining = LOH_ANS_TABLE_SIZE;
+        for (size_t i = 0; i + 1 < symbol_count; i++)
+        {
+            size_t symbols_left = symbol_count - i - 1;
+            uint32_t max_value = remaining - symbols_left - 1;
+            uint32_t value = bits_pop(&buf, max_value ? loh_floor_log2(max_value) + 1 : 0);
+            if (value > max_value)
+                return 1;
+            norm[symbols[i]] = value + 1;
+            remaining -= value + 1;
+        }
+        norm[symbols[symbol_count - 1]] = remaining;
+        
+        uint32_t state = bits_pop(&buf, LOH_ANS_TABLE_LOG);
+        
+        if (buf.byte_index >= input_len)
+            return 1;
+        
+        // build decoding table
+        uint8_t spread[LOH_ANS_TABLE_SIZE];
+        ans_spread(norm, spread);
+        uint16_t next[256];
+        memcpy(next, norm, sizeof(next));
+        for (size_t u = 0; u < LOH_ANS_TABLE_SIZE; u++)
+        {
+            uint8_t s = spread[u];
+            uint16_t x = next[s]++;
+            uint8_t nbits = LOH_ANS_TABLE_LOG - loh_floor_log2(x);
+            decode_table[u].symbol = s;
+            decode_table[u].nbits = nbits;
+            decode_table[u].base = (x << nbits) - LOH_ANS_TABLE_SIZE;
+        }
+        
+        buf.bit_index = 0;
+        buf.byte_index += 1;
+        
+        // decode. no branches other than the loop condition
+        // the fast loop does unaligned 8-byte loads, so it stops 8 bytes before the end of the input
+        const uint8_t * in = &input[buf.byte_index];
+        size_t in_len = input_len - buf.byte_index;
+        uint8_t * out = &output[start_len];
+        size_t bitpos = 0;
+        size_t i = 0;
+        while (i < chunk_len && (bitpos >> 3) + 8 <= in_len)
+        {
+            uint64_t bits;
+            memcpy(&bits, &in[bitpos >> 3], 8);
+            bits >>= bitpos & 7;
+            ans_decode_entry e = decode_table[state];
+            out[i++] = e.symbol;
+            state = e.base + (bits & ((((uint64_t)1) << e.nbits) - 1));
+            bitpos += e.nbits;
+        }
+        while (i < chunk_len)
+        {
+            ans_decode_entry e = decode_table[state];
+            if (((bitpos + e.nbits + 7) >> 3) > in_len)
+                return 1;
+            uint32_t bits = 0;
+            for (uint8_t b = 0; b < e.nbits; b++)
+                bits |= ((in[(bitpos + b) >> 3] >> ((bitpos + b) & 7)) & 1) << b;
+            out[i++] = e.symbol;
+            state = e.base + bits;
+            bitpos += e.nbits;
+        }
+        
+        buf.byte_index += (bitpos + 7) >> 3;
+        start_len += chunk_len;
+    }
+    
+    return 0;
+}
+
+// undoes an image filter in place
+static void loh_filter_undo(uint8_t * data, size_t len, uint8_t filter, uint8_t bpp, uint32_t stride)
+{
+    size_t head = (size_t)stride + bpp;
+    if (head > len)
+        head = len;
+    
+    for (size_t i = 0; i < head; i += 1)
+        data[i] += loh_filter_predict_at(data, i, filter, bpp, stride);
+    
+    if (filter == LOH_FILTER_UP)
+    {
+        // each byte only depends on the previous row, so rows can be processed as whole vectors
+        for (size_t i = head; i < len; i += stride)
+        {
+            size_t n = len - i < stride ? len - i : stride;
+            uint8_t * out = &data[i];
+            const uint8_t * up = &data[i - stride];
+            for (size_t j = 0; j < n; j += 1)
+                out[j] += up[j];
+        }
+        return;
+    }
+    
+    // the other filters depend on the pixel to the left, so they go one pixel at a time,
+    //  with every channel of the pixel handled together and no branches in the inner loop
+#define _LOH_FILTER_UNDO_LOOP(PRED) \
+    for (size_t i = head; i < len; i += bpp) \
+    { \
+        size_t n = len - i < bpp ? len - i : bpp; \
+        uint8_t * out = &data[i]; \
+        const uint8_t * left = out - bpp; \
+        const uint8_t * up = out - stride; \
+        const uint8_t * up_left = up - bpp; \
+        for (size_t j = 0; j < n; j += 1) \
+        { \
+            uint8_t a = left[j]; \
+            uint8_t b = up[j]; \
+            uint8_t c = up_left[j]; \
+            (void)b; (void)c; \
+            out[j] += (PRED); \
+        } \
+    }
+    
+    switch (filter)
+    {
+    case LOH_FILTER_LEFT: _LOH_FILTER_UNDO_LOOP(a) break;
+    case LOH_FILTER_AVG: _LOH_FILTER_UNDO_LOOP((uint8_t)(((uint16_t)a + (uint16_t)b) >> 1)) break;
+    case LOH_FILTER_PAETH: _LOH_FILTER_UNDO_LOOP(loh_paeth(a, b, c)) break;
+    default: break;
+    }
+    
+#undef _LOH_FILTER_UNDO_LOOP
+}
+
+static int loh_entropy_unpack(uint8_t kind, const uint8_t * input, size_t input_len, uint8_t * out, size_t out_len)
+{
+    if (kind == LOH_ENTROPY_ANS)
+        return ans_unpack(input, input_len, out, out_len);
+    return huff_unpack(input, input_len, out, out_len);
+}
+
+// checks everything about a chunk that can be checked without decoding it
+// every stage's stream starts with its decoded length, so the last stage's has to match the chunk's output length
+// returns the length of the chunk header, or 0 if the chunk is bad
+static size_t loh_chunk_validate(const uint8_t * chunk_start, size_t chunk_len, size_t out_len, loh_chunk_header * header)
+{
+    size_t header_len = chunk_header_read(chunk_start, chunk_len, header);
+    if (header_len == 0 || header->do_huff > LOH_ENTROPY_ANS)
+        return 0;
+    
+    const uint8_t * payload = chunk_start + header_len;
+    size_t payload_len = chunk_len - header_len;
+    
+    if (header->split)
+    {
+        loh_split_layout layout;
+        return loh_split_read(payload, payload_len, out_len, &layout) ? 0 : header_len;
+    }
+    
+    if (!header->do_huff && !header->do_lookback)
+        return payload_len == out_len ? header_len : 0;
+    
+    if (payload_len < 8)
+        return 0;
+    
+    uint64_t stage_len = loh_read_u64(payload);
+    // huffman codes never spend less than a bit per byte
+    if (header->do_huff == LOH_ENTROPY_HUFF && stage_len / 8 > payload_len)
+        return 0;
+    if (header->do_huff && header->do_lookback)
+    {
+        // the lookback stream between the two stages needs at least its own length
+        if (stage_len < 8 || stage_len > SIZE_MAX)
+            return 0;
+    }
+    else if (stage_len != out_len)
+        return 0;
+    
+    return header_len;
+}
+
+// calls a decoder's wait function (see loh_decompress_chunk), with a trace event around it
+static void loh_decompress_wait(void (*wait)(void *), void * wait_arg, const loh_tracer * tracer)
+{
+    loh_trace_event(tracer, "wait", LOH_TRACE_NO_CHUNK, 1);
+    wait(wait_arg);
+    loh_trace_event(tracer, "wait", LOH_TRACE_NO_CHUNK, 0);
+}
+
+// decodes a split lookback stage (see loh_split_pack) into out
+// wait, tracer and allocator are the same as for loh_decompress_chunk, and can be null
+// returns 0 on success, 1 if the data is bad, and 2 if an allocation failed
+static int loh_split_decompress(const uint8_t * payload, size_t payload_len, uint8_t * out, size_t out_len, size_t history, void (*wait)(void *), void * wait_arg, const loh_tracer * tracer, const loh_allocator * allocator)
+{
+    loh_split_layout layout;
+    if (loh_split_read(payload, payload_len, out_len, &layout))
+        return 1;
+    
+    // the entropy coded streams are decoded into one buffer, and the others are used where they are
+    uint64_t decoded_len = 0;
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
+        decoded_len += layout.kind[n] ? layout.len[n] : 0;
+    if (decoded_len > SIZE_MAX)
+        return 1;
+    uint8_t * decoded = (uint8_t *)loh_alloc(allocator, decoded_len ? decoded_len : 1);
+    if (!decoded)
+        return 2;
+    
+    int error = 0;
+    const uint8_t * streams[LOH_SPLIT_STREAMS];
+    size_t at = 0;
+    loh_trace_event(tracer, "entropy", LOH_TRACE_NO_CHUNK, 1);
+    for (size_t n = 0; n < LOH_SPLIT_STREAMS; n += 1)
+    {
+        streams[n] = layout.coded[n];
+        if (layout.kind[n] && !error)
+        {
+            streams[n] = &decoded[at];
+            error = loh_entropy_unpack(layout.kind[n], layout.coded[n], layout.coded_len[n], &decoded[at], layout.len[n]);
+            at += layout.len[n];
+        }
+    }
+    loh_trace_event(tracer, "entropy", LOH_TRACE_NO_CHUNK, 0);
+    if (!error && wait)
+        loh_decompress_wait(wait, wait_arg, tracer);
+    if (!error)
+    {
+        loh_trace_event(tracer, "lookback", LOH_TRACE_NO_CHUNK, 1);
+        error = lookback_decompress_split(streams, layout.len, out, out_len, history);
+        loh_trace_event(tracer, "lookback", LOH_TRACE_NO_CHUNK, 0);
+    }
+    
+    loh_dealloc(allocator, decoded);
+    return error;
+}
+
+// decompresses a single chunk into out, which must have room for out_len bytes
+// history is how many bytes just before out hold the previous chunk's decompressed data, for dependent chunks
+// if wait isn't null, it's called before a dependent chunk's lookback stage, and must wait until those bytes are there;
+//  this lets threaded decoders run the entropy stage of every chunk at once
+// if tracer isn't null, it gets an event for each stage (and for the wait)
+// the buffer between the entropy and lookback stages comes from allocator (see loh_allocator), or LOH_MALLOC if it's null
+// returns 0 on success, 1 if the chunk's data is bad, and 2 if an allocation failed
+static int loh_decompress_chunk(const uint8_t * chunk_start, size_t chunk_len, uint8_t * out, size_t out_len, size_t history, void (*wait)(void *), void * wait_arg, const loh_tracer * tracer, const loh_allocator * allocator)
+{
+    loh_chunk_header header;
+    size_t header_len = loh_chunk_validate(chunk_start, chunk_len, out_len, &header);
+    if (header_len == 0 || header.dict_len > history)
+        return 1;
+    if (header.dict_len == 0)
+        wait = 0;
+    
+    const uint8_t * payload = chunk_start + header_len;
+    size_t payload_len = chunk_len - header_len;
+    
+    int error = 0;
+    if (header.split)
+        error = loh_split_decompress(payload, payload_len, out, out_len, header.dict_len, wait, wait_arg, tracer, allocator);
+    else if (header.do_huff && header.do_lookback)
+    {
+        size_t mid_len = loh_read_u64(payload);
+        uint8_t * mid = (uint8_t *)loh_alloc(allocator, mid_len);
+        if (!mid)
+            return 2;
+        loh_trace_event(tracer, "entropy", LOH_TRACE_NO_CHUNK, 1);
+        error = loh_entropy_unpack(header.do_huff, payload, payload_len, mid, mid_len);
+        loh_trace_event(tracer, "entropy", LOH_TRACE_NO_CHUNK, 0);
+        if (!error && wait)
+            loh_decompress_wait(wait, wait_arg, tracer);
+        if (!error)
+        {
+            loh_trace_event(tracer, "lookback", LOH_TRACE_NO_CHUNK, 1);
+            error = lookback_decompress(mid, mid_len, out, out_len, header.dict_len);
+            loh_trace_event(tracer, "lookback", LOH_TRACE_NO_CHUNK, 0);
+        }
+        loh_dealloc(allocator, mid);
+    }
+    else if (header.do_huff)
+    {
+        loh_trace_event(tracer, "entropy", LOH_TRACE_NO_CHUNK, 1);
+        error = loh_entropy_unpack(header.do_huff, payload, payload_len, out, out_len);
+        loh_trace_event(tracer, "entropy", LOH_TRACE_NO_CHUNK, 0);
+    }
+    else if (header.do_lookback)
+    {
+        if (wait)
+            loh_decompress_wait(wait, wait_arg, tracer);
+        loh_trace_event(tracer, "lookback", LOH_TRACE_NO_CHUNK, 1);
+        error = lookback_decompress(payload, payload_len, out, out_len, header.dict_len);
+        loh_trace_event(tracer, "lookback", LOH_TRACE_NO_CHUNK, 0);
+    }
+    else
+        memcpy(out, payload, out_len);
+    
+    if (error)
+        return error;
+    
+    loh_trace_event(tracer, "filter", LOH_TRACE_NO_CHUNK, 1);
+    if (header.filter)
+        loh_filter_undo(out, out_len, header.filter, header.filter_bpp, header.filter_stride);
+    else if (header.do_diff)
+        loh_delta_undo(out, out_len, header.do_diff);
+    loh_trace_event(tracer, "filter", LOH_TRACE_NO_CHUNK, 0);
+    
+    return 0;
+}
+
+// checks a chunk table (chunk_count + 1 entries, starting right after the 16-byte file header) without looking at the chunks
+// chunks have to be in order and start after the table, and the output offsets have to start at zero and never go backwards
+// returns 1 and sets in_len (where the last chunk ends in the input) and output_len if the table looks good, or 0 if it doesn't
+static int loh_validate_table(const uint8_t * table, uint64_t chunk_count, uint64_t * in_len, size_t * output_len)
+{
+    uint64_t table_end = 16 + (chunk_count + 1) * 16;
+    
+    if (loh_read_u64(&table[8]) != 0)
+        return 0;
+    
+    uint64_t prev_in = table_end;
+    uint64_t prev_out = 0;
+    for (size_t i = 0; i <= chunk_count; i += 1)
+    {
+        uint64_t in_start = loh_read_u64(&table[i * 16]);
+        uint64_t out_start = loh_read_u64(&table[i * 16 + 8]);
+        if (in_start < prev_in || out_start < prev_out)
+            return 0;
+        prev_in = in_start;
+        prev_out = out_start;
+    }
+    
+    if (prev_out > SIZE_MAX)
+        return 0;
+    
+    *in_len = prev_in;
+    *output_len = prev_out;
+    return 1;
+}
+
+// checks a whole stream's container before anything is allocated or decoded
+// the chunk table has to pass loh_validate_table and fit in the input, and every chunk has to pass loh_chunk_validate
+//  and can't have a dictionary longer than the chunk before it
+// returns 1 and sets chunk_count and output_len if the stream looks good, or 0 if it doesn't
+static int loh_validate(const uint8_t * data, size_t len, uint64_t * chunk_count, size_t * output_len)
+{
+    if (!data || len < 16 || memcmp(data, "LOHz", 4) != 0)
+        return 0;
+    
+    // the table has one more entry than there are chunks, with 16 bytes per entry
+    uint64_t count = loh_read_u64(&data[8]);
+    if (count >= (len - 16) / 16)
+        return 0;
+    
+    const uint8_t * table = &data[16];
+    uint64_t in_len;
+    size_t out_len;
+    if (!loh_validate_table(table, count, &in_len, &out_len) || in_len > len)
+        return 0;
+    
+    uint64_t prev_out_start = 0;
+    
+    for (size_t i = 0; i < count; i += 1)
+    {
+        uint64_t in_start = loh_read_u64(&table[i * 16]);
+        uint64_t out_start = loh_read_u64(&table[i * 16 + 8]);
+        uint64_t in_end = loh_read_u64(&table[i * 16 + 16]);
+        uint64_t out_end = loh_read_u64(&table[i * 16 + 24]);
+        
+        loh_chunk_header header;
+        if (!loh_chunk_validate(&data[in_start], in_end - in_start, out_end - out_start, &header) || header.dict_len > out_start - prev_out_start)
+            return 0;
+        prev_out_start = out_start;
+    }
+    
+    *chunk_count = count;
+    *output_len = out_len;
+    return 1;
+}
+
+// input data is not modified, and still belongs to the caller
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+// returns 0 if the data is corrupt, fails its checksum, or claims to decompress to more memory than can be allocated
+LOH_API uint8_t * loh_decompress(uint8_t * data, size_t len, size_t * out_len, uint8_t check_checksum)
+{
+    if (!data || !out_len) return 0;
+    
+    uint64_t chunk_count;
+    size_t output_len;
+    if (!loh_validate(data, len, &chunk_count, &output_len))
+        return 0;
+    
+    uint32_t stored_checksum = data[4]
+        | (((uint32_t)data[5]) << 8)
+        | (((uint32_t)data[6]) << 16)
+        | (((uint32_t)data[7]) << 24);
+    
+    const uint8_t * chunk_table = &data[16];
+    
+    // the output length comes from the input, so it's allocated exactly rather than through the growable buffer code
+    uint8_t * out = (uint8_t *)LOH_MALLOC(output_len ? output_len : 1);
+    if (!out)
+        return 0;
+    
+    for (size_t i = 0; i < chunk_count; i += 1)
+    {
+        size_t in_start = loh_read_u64(&chunk_table[i * 16]);
+        size_t out_start = loh_read_u64(&chunk_table[i * 16 + 8]);
+        size_t chunk_len = loh_read_u64(&chunk_table[i * 16 + 16]) - in_start;
+        size_t chunk_output_len = loh_read_u64(&chunk_table[i * 16 + 24]) - out_start;
+        // chunks are decompressed in order, so the previous chunk is already there for dependent chunks to use
+        size_t history = i ? out_start - loh_read_u64(&chunk_table[i * 16 - 8]) : 0;
+        
+        if (loh_decompress_chunk(&data[in_start], chunk_len, &out[out_start], chunk_output_len, history, 0, 0, 0, 0))
+        {
+            LOH_FREE(out);
+            return 0;
+        }
+    }
+    
+    uint32_t checksum;
+    if (stored_checksum != 0 && check_checksum)
+        checksum = loh_checksum(out, output_len);
+    else
+        checksum = stored_checksum;
+    
+    if (checksum == stored_checksum || !check_checksum)
     {
-        *out_len = out_buf.len;
-        return out_buf.data;
+        *out_len = output_len;
+        return out;
     }
     else
     {
-        if (out_buf.data)
-            LOH_FREE(out_buf.data);
+        LOH_FREE(out);
+        return 0;
+    }
+}
+
+// results of loh_test (and loh_test_threaded)
+#define LOH_TEST_OK 0
+// the file header or chunk table is bad, so no chunks could be checked
+#define LOH_TEST_BAD_FILE 1
+// a chunk failed to decode; bad_chunk says which one (the first, if there's more than one)
+#define LOH_TEST_BAD_CHUNK 2
+// every chunk decoded, but the output doesn't match the stored checksum
+#define LOH_TEST_BAD_CHECKSUM 3
+#define LOH_TEST_NO_MEMORY 4
+
+// works out how big loh_test's buffers need to be: the longest chunk output, and the longest dictionary
+// chunks with bad headers don't count (they fail when they're decoded)
+// returns 0 if the file header or chunk table is bad
+static int loh_test_layout(const uint8_t * data, size_t len, uint64_t * chunk_count, size_t * max_chunk, size_t * max_history)
+{
+    if (!data || len < 16 || memcmp(data, "LOHz", 4) != 0)
+        return 0;
+    uint64_t count = loh_read_u64(&data[8]);
+    if (count >= (len - 16) / 16)
+        return 0;
+    
+    const uint8_t * table = &data[16];
+    uint64_t in_len;
+    size_t out_len;
+    if (!loh_validate_table(table, count, &in_len, &out_len) || in_len > len)
+        return 0;
+    
+    *chunk_count = count;
+    *max_chunk = 0;
+    *max_history = 0;
+    for (size_t i = 0; i < count; i += 1)
+    {
+        uint64_t in_start = loh_read_u64(&table[i * 16]);
+        uint64_t out_start = loh_read_u64(&table[i * 16 + 8]);
+        uint64_t in_end = loh_read_u64(&table[i * 16 + 16]);
+        uint64_t out_end = loh_read_u64(&table[i * 16 + 24]);
+        if (out_end - out_start > *max_chunk)
+            *max_chunk = out_end - out_start;
+        
+        loh_chunk_header header;
+        if (loh_chunk_validate(&data[in_start], in_end - in_start, out_end - out_start, &header) && header.dict_len > *max_history)
+            *max_history = header.dict_len;
+    }
+    return 1;
+}
+
+// decodes count chunks starting at first (which has to be independent, or the first chunk), and works out the checksum
+//  of their output, for loh_test and for splicing; returns one of the LOH_TEST_ values, like loh_test
+static int loh_test_chunks(const uint8_t * data, size_t len, uint64_t first, uint64_t count, uint64_t * bad_chunk, uint32_t * checksum_out)
+{
+    uint64_t chunk_count;
+    size_t max_chunk;
+    size_t max_history;
+    if (!loh_test_layout(data, len, &chunk_count, &max_chunk, &max_history) || first > chunk_count || count > chunk_count - first)
+        return LOH_TEST_BAD_FILE;
+    if (max_chunk + max_history < max_chunk)
+        return LOH_TEST_NO_MEMORY;
+    
+    // each chunk is decoded after the end of the one before it, which is moved to the front for dependent chunks
+    uint8_t * buf = (uint8_t *)LOH_MALLOC(max_chunk + max_history ? max_chunk + max_history : 1);
+    if (!buf)
+        return LOH_TEST_NO_MEMORY;
+    uint8_t * out = &buf[max_history];
+    
+    const uint8_t * chunk_table = &data[16];
+    loh_checksum_state checksum;
+    loh_checksum_begin(&checksum);
+    int result = LOH_TEST_OK;
+    size_t prev_len = 0;
+    for (size_t i = first; i < first + count; i += 1)
+    {
+        size_t in_start = loh_read_u64(&chunk_table[i * 16]);
+        size_t out_start = loh_read_u64(&chunk_table[i * 16 + 8]);
+        size_t chunk_len = loh_read_u64(&chunk_table[i * 16 + 16]) - in_start;
+        size_t chunk_output_len = loh_read_u64(&chunk_table[i * 16 + 24]) - out_start;
+        
+        size_t history = prev_len < max_history ? prev_len : max_history;
+        memmove(&buf[max_history - history], &out[prev_len - history], history);
+        
+        int error = loh_decompress_chunk(&data[in_start], chunk_len, out, chunk_output_len, history, 0, 0, 0, 0);
+        if (error)
+        {
+            result = error == 2 ? LOH_TEST_NO_MEMORY : LOH_TEST_BAD_CHUNK;
+            if (bad_chunk && error != 2)
+                *bad_chunk = i;
+            break;
+        }
+        loh_checksum_update(&checksum, out, chunk_output_len);
+        prev_len = chunk_output_len;
+    }
+    LOH_FREE(buf);
+    
+    *checksum_out = loh_checksum_end(&checksum);
+    return result;
+}
+
+// decodes every chunk of a stream and checks its checksum (if it has one), without keeping the output
+// only needs one chunk's worth of memory (plus its dictionary, for dependent chunks), however big the output is
+// returns one of the LOH_TEST_ values; if it's LOH_TEST_BAD_CHUNK, bad_chunk (which can be null) is set to the chunk
+LOH_API int loh_test(const uint8_t * data, size_t len, uint64_t * bad_chunk)
+{
+    uint64_t chunk_count = data && len >= 16 ? loh_read_u64(&data[8]) : 0;
+    uint32_t checksum;
+    int result = loh_test_chunks(data, len, 0, chunk_count, bad_chunk, &checksum);
+    if (result != LOH_TEST_OK)
+        return result;
+    
+    uint32_t stored_checksum = data[4]
+        | (((uint32_t)data[5]) << 8)
+        | (((uint32_t)data[6]) << 16)
+        | (((uint32_t)data[7]) << 24);
+    if (stored_checksum != 0 && checksum != stored_checksum)
+        return LOH_TEST_BAD_CHECKSUM;
+    return LOH_TEST_OK;
+}
+
+typedef struct {
+    uint64_t len;
+    uint32_t checksum;
+    uint64_t index;
+} loh_reuse_key;
+
+static int loh_reuse_key_compare(const void * _a, const void * _b)
+{
+    const loh_reuse_key * a = (const loh_reuse_key *)_a;
+    const loh_reuse_key * b = (const loh_reuse_key *)_b;
+    if (a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    if (a->checksum != b->checksum)
+        return a->checksum < b->checksum ? -1 : 1;
+    return a->index < b->index ? -1 : a->index > b->index;
+}
+
+// the first of the sorted keys that's not less than (len, checksum)
+static size_t loh_reuse_key_find(const loh_reuse_key * keys, size_t count, uint64_t len, uint32_t checksum)
+{
+    size_t low = 0;
+    size_t high = count;
+    while (low < high)
+    {
+        size_t mid = low + (high - low) / 2;
+        if (keys[mid].len < len || (keys[mid].len == len && keys[mid].checksum < checksum))
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+// fills in layout->reused: decodes each independent chunk of loh_params.reuse that's the same length as one of the new
+//  chunks, and looks for new chunks with the same checksum and then the same contents
+// dependent chunks can't be copied, since the chunk before them might not be the same anymore
+// if anything goes wrong (the previous file is corrupt, or an allocation fails), fewer chunks (or none) are reused
+static void loh_chunk_layout_match(loh_chunk_layout * layout, const uint8_t * data, const loh_params * params)
+{
+    uint64_t prev_count;
+    size_t max_chunk, max_history;
+    if (!layout->chunk_count || !loh_test_layout(params->reuse, params->reuse_len, &prev_count, &max_chunk, &max_history))
+        return;
+    
+    const loh_allocator * allocator = layout->allocator;
+    loh_reuse_key * keys = (loh_reuse_key *)loh_alloc(allocator, sizeof(loh_reuse_key) * layout->chunk_count);
+    uint64_t * reused = (uint64_t *)loh_alloc(allocator, sizeof(uint64_t) * layout->chunk_count);
+    uint8_t * buf = (uint8_t *)loh_alloc(allocator, max_chunk ? max_chunk : 1);
+    if (!keys || !reused || !buf)
+    {
+        loh_dealloc(allocator, keys);
+        loh_dealloc(allocator, reused);
+        loh_dealloc(allocator, buf);
+        return;
+    }
+    
+    memset(reused, 0, sizeof(uint64_t) * layout->chunk_count);
+    for (uint64_t i = 0; i < layout->chunk_count; i++)
+    {
+        uint64_t start = loh_chunk_start(layout, i);
+        keys[i].len = loh_chunk_end(layout, i) - start;
+        keys[i].checksum = loh_checksum(&data[start], keys[i].len);
+        keys[i].index = i;
+    }
+    qsort(keys, layout->chunk_count, sizeof(loh_reuse_key), loh_reuse_key_compare);
+    
+    const uint8_t * chunk_table = &params->reuse[16];
+    for (uint64_t j = 0; j < prev_count; j++)
+    {
+        size_t in_start = loh_read_u64(&chunk_table[j * 16]);
+        size_t chunk_len = loh_read_u64(&chunk_table[j * 16 + 16]) - in_start;
+        size_t out_len = loh_read_u64(&chunk_table[j * 16 + 24]) - loh_read_u64(&chunk_table[j * 16 + 8]);
+        size_t k = loh_reuse_key_find(keys, layout->chunk_count, out_len, 0);
+        if (k == layout->chunk_count || keys[k].len != out_len)
+            continue;
+        
+        loh_chunk_header header;
+        if (!loh_chunk_validate(&params->reuse[in_start], chunk_len, out_len, &header) || header.dict_len)
+            continue;
+        if (loh_decompress_chunk(&params->reuse[in_start], chunk_len, buf, out_len, 0, 0, 0, 0, allocator))
+            continue;
+        
+        uint32_t checksum = loh_checksum(buf, out_len);
+        for (k = loh_reuse_key_find(keys, layout->chunk_count, out_len, checksum); k < layout->chunk_count && keys[k].len == out_len && keys[k].checksum == checksum; k++)
+        {
+            uint64_t i = keys[k].index;
+            if (!reused[i] && memcmp(&data[loh_chunk_start(layout, i)], buf, out_len) == 0)
+                reused[i] = j + 1;
+        }
+    }
+    
+    loh_dealloc(allocator, keys);
+    loh_dealloc(allocator, buf);
+    layout->reused = reused;
+}
+
+
+/* splicing */
+
+// Chunks are located through the chunk table, so LOH files can be cut apart and put back together at chunk boundaries
+//  without recompressing anything: only the header and chunk table are rewritten, and the chunks are copied as they are.
+
+// the checksum of a followed by b, worked out from their checksums and lengths alone
+// only works if a_len is a multiple of 4, so that b's bytes land in the same stripes as they did on their own; with that,
+//  every step of the checksum is multiplying by big_prime and adding, so a's part of it just gets multiplied by big_prime
+//  once for each step that b adds
+static uint32_t loh_checksum_combine(uint32_t a, uint64_t a_len, uint32_t b, uint64_t b_len)
+{
+    const uint32_t big_prime = 0x1011B0D5;
+    uint32_t power = 1;
+    uint32_t base = big_prime;
+    for (uint64_t steps = b_len / 4 + b_len % 4; steps; steps >>= 1)
+    {
+        if (steps & 1)
+            power *= base;
+        base *= base;
+    }
+    // the checksum of nothing is exactly the part that every checksum starts with
+    uint32_t empty = loh_checksum(0, 0);
+    return b + (uint32_t)a_len + power * (a - (uint32_t)a_len - empty);
+}
+
+// concatenates file_count LOH files, so that the result decompresses to all of their outputs one after another
+// each file's stored checksum is folded into the new one without decompressing anything if every file but the last has
+//  an output length that's a multiple of 4 (and every file has a checksum); otherwise the result is decoded, a chunk at a
+//  time, to work the checksum out
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+// returns 0 if any file is invalid (or fails to decode, if it has to be decoded), or allocation fails
+LOH_API uint8_t * loh_concat(const uint8_t * const * files, const size_t * lens, size_t file_count, size_t * out_len)
+{
+    if ((!files && file_count) || (!lens && file_count) || !out_len) return 0;
+    
+    uint64_t chunk_count = 0;
+    uint64_t chunk_bytes = 0;
+    int combine = 1;
+    uint32_t checksum = 0;
+    uint64_t output_len = 0;
+    for (size_t f = 0; f < file_count; f += 1)
+    {
+        uint64_t file_chunk_count;
+        size_t file_output_len;
+        if (!loh_validate(files[f], lens[f], &file_chunk_count, &file_output_len))
+            return 0;
+        const uint8_t * table = &files[f][16];
+        chunk_count += file_chunk_count;
+        chunk_bytes += loh_read_u64(&table[file_chunk_count * 16]) - loh_read_u64(&table[0]);
+        
+        uint32_t file_checksum = loh_read_u32(&files[f][4]);
+        combine = combine && file_checksum != 0 && (f == 0 || output_len % 4 == 0);
+        checksum = f == 0 ? file_checksum : loh_checksum_combine(checksum, output_len, file_checksum, file_output_len);
+        output_len += file_output_len;
+    }
+    
+    loh_byte_buffer buf = {0, 0, 0, 0, 0};
+    size_t chunk_table_loc = 16;
+    bytes_reserve(&buf, chunk_table_loc + (chunk_count + 1) * 16 + chunk_bytes);
+    if (!buf.data)
+        return 0;
+    memset(buf.data, 0, chunk_table_loc + (chunk_count + 1) * 16);
+    memcpy(buf.data, "LOHz", 4);
+    memcpy(&buf.data[8], &chunk_count, 8);
+    buf.len = chunk_table_loc + (chunk_count + 1) * 16;
+    
+    uint64_t chunk = 0;
+    uint64_t out_start = 0;
+    for (size_t f = 0; f < file_count; f += 1)
+    {
+        const uint8_t * table = &files[f][16];
+        uint64_t file_chunk_count = loh_read_u64(&files[f][8]);
+        uint64_t in_start = loh_read_u64(&table[0]);
+        for (uint64_t i = 0; i < file_chunk_count; i += 1)
+        {
+            loh_chunk_table_set(&buf, chunk_table_loc, chunk * 2 + 0, buf.len + loh_read_u64(&table[i * 16]) - in_start);
+            loh_chunk_table_set(&buf, chunk_table_loc, chunk * 2 + 1, out_start + loh_read_u64(&table[i * 16 + 8]));
+            chunk += 1;
+        }
+        out_start += loh_read_u64(&table[file_chunk_count * 16 + 8]);
+        bytes_push(&buf, &files[f][in_start], loh_read_u64(&table[file_chunk_count * 16]) - in_start);
+    }
+    loh_chunk_table_set(&buf, chunk_table_loc, chunk_count * 2 + 0, buf.len);
+    loh_chunk_table_set(&buf, chunk_table_loc, chunk_count * 2 + 1, out_start);
+    
+    if (!combine && loh_test_chunks(buf.data, buf.len, 0, chunk_count, 0, &checksum) != LOH_TEST_OK)
+    {
+        LOH_FREE(buf.data);
+        return 0;
+    }
+    memcpy(&buf.data[4], &checksum, 4);
+    
+    *out_len = buf.len;
+    return buf.data;
+}
+
+// makes a new LOH file out of count of data's chunks, starting at first, which decompresses to just their output
+// the first of them can't be a dependent chunk, since the chunk before it won't be there anymore
+// the new checksum has to be worked out by decoding the chunks (a chunk at a time), unless data has no checksum
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+// returns 0 if data is invalid, the range is out of bounds or starts with a dependent chunk, a chunk fails to decode, or
+//  allocation fails
+LOH_API uint8_t * loh_extract_chunks(const uint8_t * data, size_t len, uint64_t first, uint64_t count, size_t * out_len)
+{
+    if (!out_len) return 0;
+    
+    uint64_t chunk_count;
+    size_t output_len;
+    if (!loh_validate(data, len, &chunk_count, &output_len) || first > chunk_count || count > chunk_count - first)
+        return 0;
+    
+    const uint8_t * table = &data[16];
+    if (count)
+    {
+        loh_chunk_header header;
+        uint64_t in_start = loh_read_u64(&table[first * 16]);
+        uint64_t in_end = loh_read_u64(&table[first * 16 + 16]);
+        uint64_t chunk_output_len = loh_read_u64(&table[first * 16 + 24]) - loh_read_u64(&table[first * 16 + 8]);
+        if (!loh_chunk_validate(&data[in_start], in_end - in_start, chunk_output_len, &header) || header.dict_len)
+            return 0;
+    }
+    
+    uint32_t checksum = 0;
+    if (loh_read_u32(&data[4]) != 0 && loh_test_chunks(data, len, first, count, 0, &checksum) != LOH_TEST_OK)
+        return 0;
+    
+    uint64_t in_start = loh_read_u64(&table[first * 16]);
+    uint64_t in_end = loh_read_u64(&table[(first + count) * 16]);
+    uint64_t out_start = loh_read_u64(&table[first * 16 + 8]);
+    
+    loh_byte_buffer buf = {0, 0, 0, 0, 0};
+    size_t chunk_table_loc = 16;
+    bytes_reserve(&buf, chunk_table_loc + (count + 1) * 16 + (in_end - in_start));
+    if (!buf.data)
+        return 0;
+    memcpy(buf.data, "LOHz", 4);
+    memcpy(&buf.data[4], &checksum, 4);
+    memcpy(&buf.data[8], &count, 8);
+    buf.len = chunk_table_loc + (count + 1) * 16;
+    for (uint64_t i = 0; i <= count; i += 1)
+    {
+        loh_chunk_table_set(&buf, chunk_table_loc, i * 2 + 0, buf.len + loh_read_u64(&table[(first + i) * 16]) - in_start);
+        loh_chunk_table_set(&buf, chunk_table_loc, i * 2 + 1, loh_read_u64(&table[(first + i) * 16 + 8]) - out_start);
+    }
+    bytes_push(&buf, &data[in_start], in_end - in_start);
+    
+    *out_len = buf.len;
+    return buf.data;
+}
+
+// compresses data into new chunks and puts them on the end of prev (an existing LOH file, which is only read), so that
+//  the result decompresses to prev's output followed by data
+// the new chunks don't refer back to prev's, so this is the same as compressing data on its own and using loh_concat
+//  (see there for when the checksum can be worked out without decoding prev)
+// passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+LOH_API uint8_t * loh_append(const uint8_t * prev, size_t prev_len, uint8_t * data, size_t len, const loh_params * params, size_t * out_len)
+{
+    size_t new_len = 0;
+    uint8_t * new_data = _loh_compress_alloc(data, len, params, &new_len);
+    if (!new_data)
+        return 0;
+    
+    const uint8_t * files[2] = {prev, new_data};
+    size_t lens[2] = {prev_len, new_len};
+    uint8_t * out = loh_concat(files, lens, 2, out_len);
+    LOH_FREE(new_data);
+    return out;
+}
+
+
+/* archives */
+
+// An archive holds any number of named members, each compressed as its own complete LOH stream, behind a directory:
+//  "LOHa", a u32 that's always 0, u64 member count, u64 hash slot count, u64 name table length
+//  one 48-byte entry per member: u64 name offset and length (in the name table), u64 offset and length of the member's
+//   LOH stream (from the start of the archive), u64 decompressed length, u32 checksum (same as the stream's), u32 name hash
+//  the hash slots: u32s holding a member index plus one (0 if empty), found by linear probing from the name hash
+//  the name table, then the member streams
+// Names are arbitrary bytes (so they can just as well be binary IDs), and can't repeat.
+// Any member can be found in constant time and decompressed without touching the others.
+
+#define LOH_ARCHIVE_HEADER_LEN 32
+#define LOH_ARCHIVE_ENTRY_LEN 48
+
+typedef struct {
+    // doesn't have to be null-terminated
+    const char * name;
+    size_t name_len;
+    // compressed in place, like with loh_compress
+    uint8_t * data;
+    size_t len;
+} loh_archive_member;
+
+// FNV-1a
+static inline uint32_t loh_archive_hash(const char * name, size_t name_len)
+{
+    uint32_t hash = 0x811C9DC5;
+    for (size_t i = 0; i < name_len; i += 1)
+        hash = (hash ^ (uint8_t)name[i]) * 0x01000193;
+    return hash;
+}
+
+static inline void loh_archive_put(loh_byte_buffer * buf, size_t at, uint64_t value, size_t size)
+{
+    for (size_t i = 0; i < size; i += 1)
+        buf->data[at + i] = (value >> (i * 8)) & 0xFF;
+}
+
+// writes the header, directory, hash slots and name table to buf, with every member's stream location left at zero
+// returns 0 if two members have the same name or allocation fails
+static int loh_archive_begin(loh_byte_buffer * buf, const loh_archive_member * members, size_t member_count)
+{
+    // at most half full, so probes stay short
+    uint64_t slot_count = member_count ? ((uint64_t)1) << loh_ceil_log2(member_count * 2) : 0;
+    uint64_t names_len = 0;
+    for (size_t i = 0; i < member_count; i += 1)
+        names_len += members[i].name_len;
+    
+    size_t slots_at = LOH_ARCHIVE_HEADER_LEN + member_count * LOH_ARCHIVE_ENTRY_LEN;
+    size_t names_at = slots_at + slot_count * 4;
+    bytes_reserve(buf, names_at + names_len);
+    if (!buf->data)
+        return 0;
+    memset(buf->data, 0, names_at);
+    buf->len = names_at;
+    
+    memcpy(buf->data, "LOHa", 4);
+    loh_archive_put(buf, 8, member_count, 8);
+    loh_archive_put(buf, 16, slot_count, 8);
+    loh_archive_put(buf, 24, names_len, 8);
+    
+    uint64_t name_offset = 0;
+    for (size_t i = 0; i < member_count; i += 1)
+    {
+        const loh_archive_member * member = &members[i];
+        uint32_t hash = loh_archive_hash(member->name, member->name_len);
+        size_t entry = LOH_ARCHIVE_HEADER_LEN + i * LOH_ARCHIVE_ENTRY_LEN;
+        loh_archive_put(buf, entry, name_offset, 8);
+        loh_archive_put(buf, entry + 8, member->name_len, 8);
+        loh_archive_put(buf, entry + 32, member->len, 8);
+        loh_archive_put(buf, entry + 44, hash, 4);
+        
+        for (uint64_t slot = hash & (slot_count - 1); ; slot = (slot + 1) & (slot_count - 1))
+        {
+            uint32_t other = loh_read_u32(&buf->data[slots_at + slot * 4]);
+            if (other == 0)
+            {
+                loh_archive_put(buf, slots_at + slot * 4, i + 1, 4);
+                break;
+            }
+            const loh_archive_member * other_member = &members[other - 1];
+            if (other_member->name_len == member->name_len && memcmp(other_member->name, member->name, member->name_len) == 0)
+                return 0;
+        }
+        
+        bytes_push(buf, (const uint8_t *)member->name, member->name_len);
+        if (!buf->data)
+            return 0;
+        name_offset += member->name_len;
+    }
+    return 1;
+}
+
+// fills in where member index's stream ended up, once it's been appended to buf
+static inline void loh_archive_set_stream(loh_byte_buffer * buf, size_t index, uint64_t offset, uint64_t len)
+{
+    size_t entry = LOH_ARCHIVE_HEADER_LEN + index * LOH_ARCHIVE_ENTRY_LEN;
+    loh_archive_put(buf, entry + 16, offset, 8);
+    loh_archive_put(buf, entry + 24, len, 8);
+    // the stream's checksum is right after its magic number
+    memcpy(&buf->data[entry + 40], &buf->data[offset + 4], 4);
+}
+
+// members' data is modified, but not stored; it still belongs to the caller
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+// returns 0 if two members have the same name or allocation fails
+LOH_API uint8_t * loh_archive_build(loh_archive_member * members, size_t member_count, const loh_params * params, size_t * out_len)
+{
+    if ((!members && member_count) || !params || !out_len) return 0;
+    
+    loh_byte_buffer buf = {0, 0, 0, 0, 0};
+    // streams store their chunk offsets from their own start, so each one is built on its own and then copied over
+    loh_byte_buffer member_buf = {0, 0, 0, 0, 0};
+    loh_compress_scratch scratch;
+    memset(&scratch, 0, sizeof(loh_compress_scratch));
+    
+    int ok = loh_archive_begin(&buf, members, member_count);
+    for (size_t i = 0; ok && i < member_count; i += 1)
+    {
+        member_buf.len = 0;
+        ok = _loh_compress_impl(members[i].data, members[i].len, params, &member_buf, &scratch);
+        if (ok)
+        {
+            size_t start = buf.len;
+            bytes_push(&buf, member_buf.data, member_buf.len);
+            ok = buf.data != 0;
+            if (ok)
+                loh_archive_set_stream(&buf, i, start, member_buf.len);
+        }
+    }
+    
+    LOH_FREE(member_buf.data);
+    loh_compress_scratch_free(&scratch);
+    if (!ok)
+    {
+        LOH_FREE(buf.data);
+        return 0;
+    }
+    *out_len = buf.len;
+    return buf.data;
+}
+
+// an archive that's been checked by loh_archive_open; just points into the archive's data, so nothing needs to be freed
+typedef struct {
+    const uint8_t * data;
+    size_t len;
+    uint64_t member_count;
+    uint64_t slot_count;
+    const uint8_t * entries;
+    const uint8_t * slots;
+    const uint8_t * names;
+} loh_archive;
+
+// what the directory says about a member
+typedef struct {
+    const char * name;
+    size_t name_len;
+    // the member's LOH stream, inside the archive
+    const uint8_t * stream;
+    size_t stream_len;
+    size_t len;
+    uint32_t checksum;
+} loh_archive_info;
+
+// checks the directory (but not the member streams themselves; loh_archive_extract does that) and sets up archive
+// data has to stay around for as long as archive is used
+// returns 1 if the directory looks good, or 0 if it doesn't
+LOH_API int loh_archive_open(loh_archive * archive, const uint8_t * data, size_t len)
+{
+    if (!archive || !data || len < LOH_ARCHIVE_HEADER_LEN || memcmp(data, "LOHa", 4) != 0 || loh_read_u32(&data[4]) != 0)
+        return 0;
+    
+    uint64_t member_count = loh_read_u64(&data[8]);
+    uint64_t slot_count = loh_read_u64(&data[16]);
+    uint64_t names_len = loh_read_u64(&data[24]);
+    
+    size_t room = len - LOH_ARCHIVE_HEADER_LEN;
+    if (member_count > room / LOH_ARCHIVE_ENTRY_LEN)
+        return 0;
+    room -= member_count * LOH_ARCHIVE_ENTRY_LEN;
+    if (slot_count > room / 4 || (slot_count & (slot_count - 1)) != 0 || slot_count < member_count || (member_count && !slot_count))
+        return 0;
+    room -= slot_count * 4;
+    if (names_len > room)
+        return 0;
+    
+    archive->data = data;
+    archive->len = len;
+    archive->member_count = member_count;
+    archive->slot_count = slot_count;
+    archive->entries = &data[LOH_ARCHIVE_HEADER_LEN];
+    archive->slots = &archive->entries[member_count * LOH_ARCHIVE_ENTRY_LEN];
+    archive->names = &archive->slots[slot_count * 4];
+    
+    uint64_t streams_start = (archive->names - data) + names_len;
+    for (uint64_t i = 0; i < member_count; i += 1)
+    {
+        const uint8_t * entry = &archive->entries[i * LOH_ARCHIVE_ENTRY_LEN];
+        uint64_t name_offset = loh_read_u64(entry);
+        uint64_t name_len = loh_read_u64(&entry[8]);
+        uint64_t offset = loh_read_u64(&entry[16]);
+        uint64_t stream_len = loh_read_u64(&entry[24]);
+        if (name_offset > names_len || name_len > names_len - name_offset)
+            return 0;
+        if (offset < streams_start || offset > len || stream_len > len - offset || loh_read_u64(&entry[32]) > SIZE_MAX)
+            return 0;
+    }
+    for (uint64_t i = 0; i < slot_count; i += 1)
+    {
+        if (loh_read_u32(&archive->slots[i * 4]) > member_count)
+            return 0;
+    }
+    return 1;
+}
+
+// looks up what the directory says about member index, which has to be less than the member count
+static inline void loh_archive_member_info(const loh_archive * archive, uint64_t index, loh_archive_info * info)
+{
+    const uint8_t * entry = &archive->entries[index * LOH_ARCHIVE_ENTRY_LEN];
+    info->name = (const char *)&archive->names[loh_read_u64(entry)];
+    info->name_len = loh_read_u64(&entry[8]);
+    info->stream = &archive->data[loh_read_u64(&entry[16])];
+    info->stream_len = loh_read_u64(&entry[24]);
+    info->len = loh_read_u64(&entry[32]);
+    info->checksum = loh_read_u32(&entry[40]);
+}
+
+// returns the index of the member with the given name, or -1 if there isn't one
+LOH_API uint64_t loh_archive_find(const loh_archive * archive, const char * name, size_t name_len)
+{
+    if (!archive->slot_count)
+        return -1;
+    
+    uint32_t hash = loh_archive_hash(name, name_len);
+    uint64_t mask = archive->slot_count - 1;
+    // a corrupt archive could have every slot full, so don't probe forever
+    for (uint64_t n = 0, slot = hash & mask; n < archive->slot_count; n += 1, slot = (slot + 1) & mask)
+    {
+        uint32_t index = loh_read_u32(&archive->slots[slot * 4]);
+        if (index == 0)
+            return -1;
+        
+        const uint8_t * entry = &archive->entries[(index - 1) * LOH_ARCHIVE_ENTRY_LEN];
+        if (loh_read_u32(&entry[44]) != hash || loh_read_u64(&entry[8]) != name_len)
+            continue;
+        if (memcmp(&archive->names[loh_read_u64(entry)], name, name_len) == 0)
+            return index - 1;
+    }
+    return -1;
+}
+
+// decompresses a single member; index has to be less than the member count
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+// returns 0 if the member's stream is corrupt or doesn't match the directory, or fails its checksum (if checked)
+LOH_API uint8_t * loh_archive_extract(const loh_archive * archive, uint64_t index, size_t * out_len, uint8_t check_checksum)
+{
+    loh_archive_info info;
+    loh_archive_member_info(archive, index, &info);
+    if (info.stream_len < 8 || loh_read_u32(&info.stream[4]) != info.checksum)
+        return 0;
+    
+    size_t len = 0;
+    // loh_decompress doesn't modify its input
+    uint8_t * out = loh_decompress((uint8_t *)info.stream, info.stream_len, &len, check_checksum);
+    if (out && len != info.len)
+    {
+        LOH_FREE(out);
         return 0;
     }
+    if (out)
+        *out_len = len;
+    return out;
 }
 
 #endif // LOH_IMPL_HEADER
@@ -1,167 +1,232 @@
 #ifndef LOH_IMPL_THREADED_HEADER
 #define LOH_IMPL_THREADED_HEADER
 
+#include <time.h>
+
+// CPU time used by the calling thread alone, in seconds
+static double loh_thread_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+    return (double)t.tv_sec + (double)t.tv_nsec / 1000000000.0;
+}
+
+// each chunk's stage times (loh_stats) shouldn't count what other threads were doing at the same time
+#ifndef LOH_STATS_TIME
+#define LOH_STATS_TIME() loh_thread_time()
+#endif
+
+// the speed target (loh_params.target_speed) is per core, so with other threads busy, each thread has to be timed on its own
+#ifndef LOH_SPEED_TIME
+#define LOH_SPEED_TIME() loh_thread_time()
+#endif
+
 #include "loh_impl.h"
 
 #include <pthread.h>
 
+// used to timestamp loh_trace events; must return microseconds as a double, from any fixed starting point
+#ifndef LOH_TRACE_TIME
+static double loh_trace_time(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1000000.0 + (double)t.tv_nsec / 1000.0;
+}
+#define LOH_TRACE_TIME() loh_trace_time()
+#endif
+
+// Records loh_tracer events from any number of threads, to be written out as Chrome trace-event JSON
+//  (loadable in chrome://tracing or ui.perfetto.dev), with one row per thread.
+// Set up with loh_trace_init, point loh_params.tracer (or loh_decompress_threaded_ex's tracer) at its tracer, then
+//  call loh_trace_write and loh_trace_free.
+typedef struct {
+    const char * name;
+    uint64_t chunk;
+    double time;
+    uint32_t thread;
+    uint8_t begin;
+} loh_trace_record;
+
+typedef struct {
+    loh_tracer tracer;
+    pthread_mutex_t mutex;
+    // loh_trace_record array
+    loh_byte_buffer records;
+    // pthread_t array; a thread's index in here is its id in the output
+    // threads that have been joined can have their pthread_t reused, so later threads can share a finished one's row
+    loh_byte_buffer threads;
+    double start;
+    // set if an allocation failed, in which case some events are missing
+    uint8_t dropped;
+} loh_trace;
+
+static void loh_trace_callback(void * arg, const char * name, uint64_t chunk, uint8_t begin)
+{
+    loh_trace * trace = (loh_trace *)arg;
+    loh_trace_record record;
+    record.name = name;
+    record.chunk = chunk;
+    record.begin = begin;
+    
+    pthread_t self = pthread_self();
+    pthread_mutex_lock(&trace->mutex);
+    record.time = LOH_TRACE_TIME() - trace->start;
+    
+    // there are only ever as many threads as chunks (plus a few), so a linear search is fine
+    const pthread_t * threads = (const pthread_t *)trace->threads.data;
+    size_t thread_count = trace->threads.len / sizeof(pthread_t);
+    size_t thread = 0;
+    while (thread < thread_count && !pthread_equal(threads[thread], self))
+        thread += 1;
+    if (thread == thread_count)
+        bytes_push(&trace->threads, (const uint8_t *)&self, sizeof(pthread_t));
+    record.thread = thread;
+    
+    bytes_push(&trace->records, (const uint8_t *)&record, sizeof(loh_trace_record));
+    trace->dropped |= !trace->records.data || !trace->threads.data;
+    pthread_mutex_unlock(&trace->mutex);
+}
+
+LOH_API void loh_trace_init(loh_trace * trace)
+{
+    memset(trace, 0, sizeof(loh_trace));
+    trace->tracer.event = loh_trace_callback;
+    trace->tracer.arg = trace;
+    pthread_mutex_init(&trace->mutex, 0);
+    trace->start = LOH_TRACE_TIME();
+}
+
+LOH_API void loh_trace_free(loh_trace * trace)
+{
+    LOH_FREE(trace->records.data);
+    LOH_FREE(trace->threads.data);
+    memset(&trace->records, 0, sizeof(loh_byte_buffer));
+    memset(&trace->threads, 0, sizeof(loh_byte_buffer));
+    pthread_mutex_destroy(&trace->mutex);
+}
+
+// writes everything recorded so far as a Chrome trace-event JSON file
+// thread 0 is labelled main, since it's whichever thread sent the first event (usually the one that called the threaded function)
+// returns 0 if writing failed
+LOH_API int loh_trace_write(loh_trace * trace, FILE * f)
+{
+    pthread_mutex_lock(&trace->mutex);
+    const loh_trace_record * records = (const loh_trace_record *)trace->records.data;
+    size_t record_count = trace->records.len / sizeof(loh_trace_record);
+    size_t thread_count = trace->threads.len / sizeof(pthread_t);
+    
+    fprintf(f, "{\"traceEvents\":[\n");
+    fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}},\n");
+    for (size_t i = 1; i < thread_count; i += 1)
+        fprintf(f, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%zu,\"args\":{\"name\":\"thread %zu\"}},\n", i, i);
+    for (size_t i = 0; i < record_count; i += 1)
+    {
+        const loh_trace_record * r = &records[i];
+        fprintf(f, "{\"name\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":1,\"tid\":%u", r->name, r->begin ? "B" : "E", r->time, (unsigned)r->thread);
+        if (r->chunk != LOH_TRACE_NO_CHUNK)
+            fprintf(f, ",\"args\":{\"chunk\":%llu}", (unsigned long long)r->chunk);
+        fprintf(f, "}%s\n", i + 1 < record_count ? "," : "");
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped\":%d}}\n", trace->dropped);
+    pthread_mutex_unlock(&trace->mutex);
+    return !ferror(f);
+}
+
 typedef struct {
     uint8_t * data;
     uint64_t data_len;
-    uint8_t do_diff;
-    uint8_t do_lookback;
-    uint8_t do_huff;
-    uint8_t buf_replaced;
+    const loh_params * params;
+    loh_byte_buffer out;
+    // the end of the previous chunk, if chunks are dependent
+    loh_byte_buffer dict;
+    loh_chunk_stats * stats;
+    size_t index;
+    int ok;
 } loh_compress_threaded_args;
 
-static void * loh_compress_threaded_single(void * _args)
+// for loh_params.parallel_for
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t next;
+    size_t count;
+    void (*job)(void *, size_t);
+    void * job_arg;
+} loh_parallel_for_state;
+
+static void * loh_parallel_for_worker(void * _state)
 {
-    loh_compress_threaded_args * args = (loh_compress_threaded_args *)_args;
-    uint8_t * raw_data = args->data;
-    uint64_t in_size = args->data_len;
-    uint8_t do_diff = args->do_diff;
-    uint8_t quality_level = args->do_lookback;
-    uint8_t do_huff = args->do_huff;
-    //printf("%lld %lld\n", in_start, in_end);
-    
-    loh_byte_buffer buf = {raw_data, in_size, in_size};
-    
-    // detect probably-good differentiation stride
-    // step 1: figure out the typical absolute difference between bytes
-    // (128 isn't guaranteed)
-    
-    int64_t difference = 0;
-    uint64_t rand = 19529;
-    const uint64_t m = 0xA68BF0C7;
-    uint8_t seen_values[256] = {0};
-    for (size_t n = 0; n < 4096; n += 1)
-    {
-        rand *= m + n * 2;
-        size_t a = rand % in_size;
-        rand *= m + n * 2;
-        size_t b = rand % in_size;
-        int16_t diff = (int16_t)raw_data[a] - (int16_t)raw_data[b];
-        diff = diff < 0 ? -diff : diff;
-        difference += diff;
-        seen_values[raw_data[a]] = 1;
-        seen_values[raw_data[b]] = 1;
-    }
-    // to prevent differentiating files that only have a small number of unique values (doing so thrashes the entropy coder)
-    uint16_t num_seen_values = 0;
-    for (size_t n = 0; n < 256; n++)
-        num_seen_values += seen_values[n];
-    difference /= 4096;
-    
-    int64_t orig_difference = difference;
-    
-    // now check 1 through 16 as possible differentiation values, using a similar strategy
-    if (!do_diff && num_seen_values > 128)
-    {
-        for (uint8_t diff_opt = 1; diff_opt <= 16; diff_opt += 1)
-        {
-            int64_t diff_difference = 0;
-            if (diff_opt * 2 > in_size)
-                break;
-            for (size_t n = 0; n < 4096; n += 1)
-            {
-                rand *= m + n * 2;
-                size_t a = rand % (in_size - diff_opt);
-                int16_t diff = (int16_t)raw_data[a] - (int16_t)raw_data[a + diff_opt];
-                diff = diff < 0 ? -diff : diff;
-                diff_difference += diff;
-            }
-            diff_difference /= 4096;
-            // 2x to prevent noise from triggering differentiation when it's not necessary
-            if (diff_difference * 2 < orig_difference && diff_difference < difference)
-            {
-                difference = diff_difference;
-                do_diff = diff_opt;
-            }
-        }
-    }
-    
-    uint8_t buf_replaced = 0;
-    
-    if (do_diff)
-    {
-        for (size_t i = buf.len - 1; i >= do_diff; i -= 1)
-            buf.data[i] -= buf.data[i - do_diff];
-    }
-    
-    loh_byte_buffer orig_buf = buf;
-    
-    size_t lb_comp_ratio_100 = 100;
-    
-    if (quality_level)
-    {
-        loh_byte_buffer new_buf = lookback_compress(buf.data, buf.len, quality_level);
-        
-        if (new_buf.len < buf.len)
-        {
-            lb_comp_ratio_100 = new_buf.len * 100 / buf.len;
-            buf = new_buf;
-            buf_replaced = 1;
-        }
-        else
-        {
-            LOH_FREE(new_buf.data);
-            quality_level = 0;
-        }
-    }
-    uint8_t did_huff = 0;
-    if (do_huff)
+    loh_parallel_for_state * state = (loh_parallel_for_state *)_state;
+    while (1)
     {
-        loh_byte_buffer new_buf = huff_pack(buf.data, buf.len).buffer;
-        if (new_buf.len < buf.len)
-        {
-            if (buf_replaced)
-                LOH_FREE(buf.data);
-            buf = new_buf;
-            did_huff = 1;
-            buf_replaced = 1;
-            
-            // if we did lookback but it's tenuous, try huff-compressing the original data too to see if it comes out smaller
-            
-            if (quality_level && (lb_comp_ratio_100 > 80 || (do_diff != 0 && lb_comp_ratio_100 > 30)))
-            {
-                loh_byte_buffer new_buf_2 = huff_pack(orig_buf.data, orig_buf.len).buffer;
-                
-                if (new_buf_2.len < buf.len)
-                {
-                    buf = new_buf_2;
-                    quality_level = 0;
-                }
-                else
-                    LOH_FREE(new_buf_2.data);
-            }
-        }
-        else
-        {
-            LOH_FREE(new_buf.data);
-            did_huff = 0;
-        }
+        pthread_mutex_lock(&state->mutex);
+        size_t n = state->next;
+        state->next += 1;
+        pthread_mutex_unlock(&state->mutex);
+        if (n >= state->count)
+            break;
+        state->job(state->job_arg, n);
     }
+    return 0;
+}
+
+// a loh_params.parallel_for that runs jobs on pthreads; parallel_arg has to point to a uint16_t thread count
+// the calling thread works on jobs too, so a thread count of 1 doesn't start any threads
+LOH_API void loh_parallel_for_threads(void * parallel_arg, void (*job)(void *, size_t), void * job_arg, size_t count)
+{
+    uint16_t threads = *(const uint16_t *)parallel_arg;
+    if (threads > count)
+        threads = count;
+    if (threads < 1)
+        threads = 1;
+    
+    loh_parallel_for_state state;
+    pthread_mutex_init(&state.mutex, 0);
+    state.next = 0;
+    state.count = count;
+    state.job = job;
+    state.job_arg = job_arg;
+    
+    // if a thread can't be started, the ones that could (and this one) just do its share
+    pthread_t thread_table[256];
+    size_t started = 0;
+    while (started + 1 < threads && started < 256 && pthread_create(&thread_table[started], NULL, loh_parallel_for_worker, &state) == 0)
+        started += 1;
+    loh_parallel_for_worker(&state);
+    for (size_t i = 0; i < started; i += 1)
+        pthread_join(thread_table[i], 0);
     
-    args->data = buf.data;
-    args->data_len = buf.len;
-    args->do_diff = do_diff;
-    args->do_lookback = quality_level;
-    args->do_huff = did_huff;
-    args->buf_replaced = buf_replaced;
+    pthread_mutex_destroy(&state.mutex);
+}
+
+static void * loh_compress_threaded_single(void * _args)
+{
+    loh_compress_threaded_args * args = (loh_compress_threaded_args *)_args;
+    loh_compress_scratch scratch;
+    memset(&scratch, 0, sizeof(loh_compress_scratch));
+    // the output outlives this thread's scratch (and its arena, if it has one), so it comes from the shared allocator
+    memset(&args->out, 0, sizeof(loh_byte_buffer));
+    args->out.allocator = args->params->allocator;
+    loh_trace_event(args->params->tracer, "compress chunk", args->index, 1);
+    args->ok = loh_compress_chunk(args->data, args->data_len, args->dict.data, args->dict.len, args->params, &scratch, &args->out, args->stats);
+    loh_trace_event(args->params->tracer, "compress chunk", args->index, 0);
+    loh_compress_scratch_free(&scratch);
     return (void *) args;
 }
     
 
-// passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
-// returned data must be freed by the caller; it was allocated with LOH_MALLOC
-static uint8_t * loh_compress_threaded(uint8_t * data, size_t len, uint8_t do_lookback, uint8_t do_huff, uint8_t do_diff, size_t * out_len, uint16_t threads)
+static uint8_t * _loh_compress_threaded_impl(uint8_t * data, size_t len, const loh_params * _params, size_t * out_len, uint16_t threads)
 {
-    if (!data || !out_len) return 0;
+    if (!data || !out_len || !_params) return 0;
     
-    if (do_lookback > 12)
-        do_lookback = 12;
+    loh_params params = *_params;
+    if (params.do_lookback > 12)
+        params.do_lookback = 12;
+    const loh_tracer * tracer = params.tracer;
     
+    loh_trace_event(tracer, "checksum", LOH_TRACE_NO_CHUNK, 1);
     uint32_t checksum = loh_checksum(data, len);
+    loh_trace_event(tracer, "checksum", LOH_TRACE_NO_CHUNK, 0);
     
     // LOH files are composed of a series of arbitrary-length chunks.
     // Chunks have their compressed and decompressed start addresses stored in the header,
@@ -171,15 +236,14 @@ static uint8_t * loh_compress_threaded(uint8_t * data, size_t len, uint8_t do_lo
     //  or chunks with 32KB length, whichever gives bigger chunks.
     // There is no maximum chunk size.
     
-    uint64_t chunk_div = threads;
-    uint64_t chunk_size = (len + chunk_div - 1) / chunk_div;
-    if (chunk_size < (1 << 15))
-        chunk_size = (1 << 15);
-    uint64_t chunk_count = (len + chunk_size - 1) / chunk_size;
+    loh_chunk_layout layout;
+    if (!loh_chunk_layout_init(&layout, data, len, &params, threads))
+        return 0;
+    uint64_t chunk_count = layout.chunk_count;
     
     //printf("%lld\n", chunk_count);
     
-    loh_byte_buffer real_buf = {0, 0, 0};
+    loh_byte_buffer real_buf = {0, 0, 0, 0, 0};
     
     bytes_push(&real_buf, (const uint8_t *)"LOHz", 4);
     bytes_push(&real_buf, (uint8_t *)&checksum, 4);
@@ -192,160 +256,177 @@ static uint8_t * loh_compress_threaded(uint8_t * data, size_t len, uint8_t do_lo
         bytes_push(&real_buf, (uint8_t *)&n, 8);
         bytes_push(&real_buf, (uint8_t *)&n, 8);
     }
-    size_t chunk_table_end = real_buf.len;
     
-    pthread_t * thread_table = (pthread_t *)LOH_MALLOC(sizeof(pthread_t) * chunk_count);
-    loh_compress_threaded_args * thread_args  = (loh_compress_threaded_args *)LOH_MALLOC(sizeof(loh_compress_threaded_args) * chunk_count);
+    loh_chunk_stats * stats = loh_stats_begin(params.stats, chunk_count);
+    
+    const loh_allocator * allocator = params.allocator;
+    pthread_t * thread_table = (pthread_t *)loh_alloc(allocator, sizeof(pthread_t) * chunk_count);
+    loh_compress_threaded_args * thread_args  = (loh_compress_threaded_args *)loh_alloc(allocator, sizeof(loh_compress_threaded_args) * chunk_count);
+    
+    uint64_t dict_size = loh_dict_size(&params);
+    for (size_t i = 0; i < chunk_count; i += 1)
+    {
+        memset(&thread_args[i].dict, 0, sizeof(loh_byte_buffer));
+        thread_args[i].dict.allocator = allocator;
+    }
     
     uint64_t total_uncompressed_len = 0;
     for (size_t i = 0; i < chunk_count; i += 1)
     {
-        uint64_t in_start = i * chunk_size;
-        uint64_t in_end = (i + 1) * chunk_size;
-        if (in_end > len)
-            in_end = len;
+        uint64_t in_start = loh_chunk_start(&layout, i);
+        uint64_t in_end = loh_chunk_end(&layout, i);
         
-        uint64_t * chunk_table = (uint64_t *)&real_buf.data[chunk_table_loc];
-        chunk_table[i * 2 + 1] = total_uncompressed_len;
+        loh_chunk_table_set(&real_buf, chunk_table_loc, i * 2 + 1, total_uncompressed_len);
         total_uncompressed_len += in_end - in_start;
         
         loh_compress_threaded_args * args = &thread_args[i];
         args->data = &data[in_start];
         args->data_len = in_end - in_start;
-        args->do_diff = do_diff;
-        args->do_lookback = do_lookback;
-        args->do_huff = do_huff;
-        args->buf_replaced = 0;
+        args->params = &params;
+        args->stats = stats ? &stats[i] : 0;
+        args->index = i;
+        
+        // the next chunk's dictionary has to be copied out before this chunk's thread starts changing it in place
+        if (dict_size && i + 1 < chunk_count)
+            loh_dict_save(&thread_args[i + 1].dict, args->data, args->data_len, dict_size);
         
-        pthread_create(&thread_table[i], NULL, loh_compress_threaded_single, args);
+        // chunks copied from loh_params.reuse don't need a thread; they're copied straight into the output below
+        memset(&args->out, 0, sizeof(loh_byte_buffer));
+        if (!layout.reused || !layout.reused[i])
+            pthread_create(&thread_table[i], NULL, loh_compress_threaded_single, args);
     }
     
-    uint64_t total_compressed_len = chunk_table_end;
+    int ok = 1;
     for (size_t i = 0; i < chunk_count; i += 1)
     {
-        uint64_t * chunk_table = (uint64_t *)&real_buf.data[chunk_table_loc];
-        chunk_table[i * 2 + 0] = total_compressed_len;
-        
-        pthread_join(thread_table[i], 0);
+        loh_chunk_table_set(&real_buf, chunk_table_loc, i * 2 + 0, real_buf.len);
         
         loh_compress_threaded_args * ret = &thread_args[i];
         
-        byte_push(&real_buf, ret->do_diff);
-        byte_push(&real_buf, ret->do_lookback);
-        byte_push(&real_buf, ret->do_huff);
-        byte_push(&real_buf, 0);
-        bytes_push(&real_buf, ret->data, ret->data_len);
-        
-        if (ret->buf_replaced)
-            LOH_FREE(ret->data);
+        if (layout.reused && layout.reused[i])
+        {
+            loh_trace_event(tracer, "append", i, 1);
+            loh_chunk_reuse(&layout, i, &params, &real_buf, ret->stats);
+            loh_trace_event(tracer, "append", i, 0);
+        }
+        else
+        {
+            // chunks have to be appended in order, so this is where a slow chunk holds up the ones after it
+            loh_trace_event(tracer, "join", i, 1);
+            pthread_join(thread_table[i], 0);
+            loh_trace_event(tracer, "join", i, 0);
+            
+            ok = ok && ret->ok;
+            loh_trace_event(tracer, "append", i, 1);
+            bytes_push(&real_buf, ret->out.data, ret->out.len);
+            loh_trace_event(tracer, "append", i, 0);
+        }
         
-        total_compressed_len += ret->data_len + 4;
+        bytes_free(&ret->out);
+        bytes_free(&ret->dict);
     }
     
-    uint64_t * chunk_table = (uint64_t *)&real_buf.data[chunk_table_loc];
-    chunk_table[chunk_count * 2 + 0] = total_compressed_len;
-    chunk_table[chunk_count * 2 + 1] = total_uncompressed_len;
+    loh_chunk_table_set(&real_buf, chunk_table_loc, chunk_count * 2 + 0, real_buf.len);
+    loh_chunk_table_set(&real_buf, chunk_table_loc, chunk_count * 2 + 1, total_uncompressed_len);
+    
+    loh_dealloc(allocator, thread_args);
+    loh_dealloc(allocator, thread_table);
+    loh_chunk_layout_free(&layout);
+    
+    if (!ok)
+    {
+        LOH_FREE(real_buf.data);
+        return 0;
+    }
     
     *out_len = real_buf.len;
     return real_buf.data;
 }
 
+// passed-in data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+LOH_API uint8_t * loh_compress_threaded(uint8_t * data, size_t len, uint8_t do_lookback, uint8_t do_huff, uint8_t do_diff, size_t * out_len, uint16_t threads)
+{
+    loh_params params;
+    memset(&params, 0, sizeof(loh_params));
+    params.do_lookback = do_lookback;
+    params.do_huff = do_huff;
+    params.do_diff = do_diff;
+    return _loh_compress_threaded_impl(data, len, &params, out_len, threads);
+}
+
+// threaded version of loh_compress_image
+LOH_API uint8_t * loh_compress_image_threaded(uint8_t * data, size_t len, uint8_t do_lookback, uint8_t do_huff, uint8_t bpp, uint32_t row_stride, size_t * out_len, uint16_t threads)
+{
+    loh_params params;
+    memset(&params, 0, sizeof(loh_params));
+    params.do_lookback = do_lookback;
+    params.do_huff = do_huff;
+    params.image_bpp = bpp;
+    params.image_stride = row_stride;
+    return _loh_compress_threaded_impl(data, len, &params, out_len, threads);
+}
+
+// threaded version of loh_compress_ex
+LOH_API uint8_t * loh_compress_threaded_ex(uint8_t * data, size_t len, const loh_params * params, size_t * out_len, uint16_t threads)
+{
+    return _loh_compress_threaded_impl(data, len, params, out_len, threads);
+}
+
+// dependent chunks have to wait for the chunk before them to finish before they can run their lookback stage
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t * done;
+} loh_decompress_threaded_sync;
+
 typedef struct {
     uint8_t * in_data;
     uint64_t in_data_len;
     uint8_t * out_data;
     uint64_t out_data_len;
+    size_t history;
+    size_t index;
+    loh_decompress_threaded_sync * sync;
+    const loh_tracer * tracer;
+    const loh_allocator * allocator;
     uint8_t error;
 } loh_decompress_threaded_args;
 
+static void loh_decompress_threaded_wait(void * _args)
+{
+    loh_decompress_threaded_args * args = (loh_decompress_threaded_args *)_args;
+    pthread_mutex_lock(&args->sync->mutex);
+    while (!args->sync->done[args->index - 1])
+        pthread_cond_wait(&args->sync->cond, &args->sync->mutex);
+    pthread_mutex_unlock(&args->sync->mutex);
+}
 
 static void * loh_decompress_threaded_single(void * _args)
 {
     loh_decompress_threaded_args * args = (loh_decompress_threaded_args *)_args;
-    
-    uint8_t * chunk_start = args->in_data;
-    uint64_t chunk_len = args->in_data_len;
-    
-    uint8_t * out_data = args->out_data;
-    uint64_t out_data_len = args->out_data_len;
-    
-    uint8_t * out_error = &args->error;
-    
-    loh_byte_buffer buf = {chunk_start, chunk_len, chunk_len};
-    
-    uint8_t do_diff = buf.data[0];
-    uint8_t do_lookback = buf.data[1];
-    uint8_t do_huff = buf.data[2];
-    
-    buf.data += 4;
-    buf.len -= 4;
-    
-    uint8_t * buf_orig = buf.data;
-    
-    if (do_huff)
-    {
-        loh_bit_buffer compressed;
-        memset(&compressed, 0, sizeof(loh_bit_buffer));
-        compressed.buffer = buf;
-        int error = 0;
-        loh_byte_buffer new_buf = huff_unpack(&compressed, &error);
-        if (buf.data != buf_orig)
-            LOH_FREE(buf.data);
-        buf = new_buf;
-        if (!error && !buf.data)
-        {
-            *out_error = 2;
-            return 0;
-        }
-        if (error)
-        {
-            if (buf.data && buf.data != buf_orig)
-                LOH_FREE(buf.data);
-            *out_error = 1;
-            return 0;
-        }
-    }
-    if (do_lookback)
-    {
-        int error = 0;
-        loh_byte_buffer new_buf = lookback_decompress(buf.data, buf.len, &error);
-        if (buf.data != buf_orig)
-            LOH_FREE(buf.data);
-        buf = new_buf;
-        if (!error && !buf.data)
-        {
-            *out_error = 2;
-            return 0;
-        }
-        if (error)
-        {
-            if (buf.data && buf.data != buf_orig)
-                LOH_FREE(buf.data);
-            *out_error = 1;
-            return 0;
-        }
-    }
-    if (do_diff)
-    {
-        for (size_t i = do_diff; i < buf.len; i += 1)
-            buf.data[i] += buf.data[i - do_diff];
-    }
-    
-    for (size_t i = 0; i < out_data_len; i += 1)
-        out_data[i] = buf.data[i];
-    
+    loh_trace_event(args->tracer, "decompress chunk", args->index, 1);
+    args->error = loh_decompress_chunk(args->in_data, args->in_data_len, args->out_data, args->out_data_len, args->history, loh_decompress_threaded_wait, args, args->tracer, args->allocator);
+    loh_trace_event(args->tracer, "decompress chunk", args->index, 0);
+    
+    pthread_mutex_lock(&args->sync->mutex);
+    args->sync->done[args->index] = 1;
+    pthread_cond_broadcast(&args->sync->cond);
+    pthread_mutex_unlock(&args->sync->mutex);
     return 0;
 }
     
 
-// input data is modified, but not stored; it still belongs to the caller, and must be freed by the caller
-// if huffman and lookback coding are both disabled, then the returned pointer is a pointer into the input data
-// otherwise, returned data must be freed by the caller; it was allocated with LOH_MALLOC
-static uint8_t * loh_decompress_threaded(uint8_t * data, size_t len, size_t * out_len, uint8_t check_checksum)
+// loh_decompress_threaded, but with a tracer (see loh_tracer and loh_trace) that gets an event for each chunk and stage,
+//  and an allocator for working memory (see loh_allocator; it has to be thread-safe); either can be null
+LOH_API uint8_t * loh_decompress_threaded_ex(uint8_t * data, size_t len, size_t * out_len, uint8_t check_checksum, const loh_tracer * tracer, const loh_allocator * allocator)
 {
     if (!data || !out_len) return 0;
     
-    if (len < 8 || memcmp(data, "LOHz", 4) != 0)
+    // the whole container gets checked before any threads are started
+    uint64_t chunk_count;
+    size_t output_len;
+    if (!loh_validate(data, len, &chunk_count, &output_len))
         return 0;
     
     uint32_t stored_checksum = data[4]
@@ -353,57 +434,391 @@ static uint8_t * loh_decompress_threaded(uint8_t * data, size_t len, size_t * ou
         | (((uint32_t)data[6]) << 16)
         | (((uint32_t)data[7]) << 24);
     
-    uint64_t chunk_count = data[8]
-        | (((uint64_t)data[9]) << 8)
-        | (((uint64_t)data[10]) << 16)
-        | (((uint64_t)data[11]) << 24)
-        | (((uint64_t)data[12]) << 32)
-        | (((uint64_t)data[13]) << 40)
-        | (((uint64_t)data[14]) << 48)
-        | (((uint64_t)data[15]) << 56);
+    const uint8_t * chunk_table = &data[16];
     
-    const uint64_t * chunk_table = (uint64_t *)&data[16];
+    uint8_t * out = (uint8_t *)LOH_MALLOC(output_len ? output_len : 1);
+    pthread_t * thread_table = (pthread_t *)loh_alloc(allocator, sizeof(pthread_t) * (chunk_count + 1));
+    loh_decompress_threaded_args * thread_args  = (loh_decompress_threaded_args *)loh_alloc(allocator, sizeof(loh_decompress_threaded_args) * (chunk_count + 1));
     
-    uint64_t output_len = chunk_table[chunk_count * 2 + 1];
+    loh_decompress_threaded_sync sync;
+    sync.done = (uint8_t *)loh_alloc(allocator, chunk_count + 1);
     
-    loh_byte_buffer out_buf = {0, 0, 0};
-    bytes_reserve(&out_buf, output_len);
-    out_buf.len = output_len;
+    if (!out || !thread_table || !thread_args || !sync.done)
+    {
+        LOH_FREE(out);
+        loh_dealloc(allocator, sync.done);
+        loh_dealloc(allocator, thread_args);
+        loh_dealloc(allocator, thread_table);
+        return 0;
+    }
     
-    pthread_t * thread_table = (pthread_t *)LOH_MALLOC(sizeof(pthread_t) * chunk_count);
-    loh_decompress_threaded_args * thread_args  = (loh_decompress_threaded_args *)LOH_MALLOC(sizeof(loh_decompress_threaded_args) * chunk_count);
+    memset(sync.done, 0, chunk_count + 1);
+    pthread_mutex_init(&sync.mutex, 0);
+    pthread_cond_init(&sync.cond, 0);
     
     for (size_t i = 0; i < chunk_count; i += 1)
     {
+        size_t in_start = loh_read_u64(&chunk_table[i * 16]);
+        size_t out_start = loh_read_u64(&chunk_table[i * 16 + 8]);
+        
         loh_decompress_threaded_args * args = &thread_args[i];
-        args->in_data = &data[chunk_table[i * 2]];
-        args->in_data_len = chunk_table[i * 2 + 2] - chunk_table[i * 2];
-        args->out_data = &out_buf.data[chunk_table[i * 2 + 1]];
-        args->out_data_len = chunk_table[i * 2 + 3] - chunk_table[i * 2 + 1];
+        args->in_data = &data[in_start];
+        args->in_data_len = loh_read_u64(&chunk_table[i * 16 + 16]) - in_start;
+        args->out_data = &out[out_start];
+        args->out_data_len = loh_read_u64(&chunk_table[i * 16 + 24]) - out_start;
+        // loh_validate already made sure no chunk's dictionary is longer than the chunk before it
+        args->history = i ? out_start - loh_read_u64(&chunk_table[i * 16 - 8]) : 0;
+        args->index = i;
+        args->sync = &sync;
+        args->tracer = tracer;
+        args->allocator = allocator;
         args->error = 0;
         
         pthread_create(&thread_table[i], NULL, loh_decompress_threaded_single, args);
     }
+    uint8_t error = 0;
     for (size_t i = 0; i < chunk_count; i += 1)
+    {
+        loh_trace_event(tracer, "join", i, 1);
         pthread_join(thread_table[i], 0);
+        loh_trace_event(tracer, "join", i, 0);
+        error |= thread_args[i].error;
+    }
+    
+    loh_dealloc(allocator, sync.done);
+    loh_dealloc(allocator, thread_args);
+    loh_dealloc(allocator, thread_table);
+    pthread_mutex_destroy(&sync.mutex);
+    pthread_cond_destroy(&sync.cond);
+    
+    if (error)
+    {
+        LOH_FREE(out);
+        return 0;
+    }
     
     uint32_t checksum;
     if (stored_checksum != 0 && check_checksum)
-        checksum = loh_checksum(out_buf.data, out_buf.len);
+    {
+        loh_trace_event(tracer, "checksum", LOH_TRACE_NO_CHUNK, 1);
+        checksum = loh_checksum(out, output_len);
+        loh_trace_event(tracer, "checksum", LOH_TRACE_NO_CHUNK, 0);
+    }
     else
         checksum = stored_checksum;
     
     if (checksum == stored_checksum || !check_checksum)
     {
-        *out_len = out_buf.len;
-        return out_buf.data;
+        *out_len = output_len;
+        return out;
     }
     else
     {
-        if (out_buf.data)
-            LOH_FREE(out_buf.data);
+        LOH_FREE(out);
+        return 0;
+    }
+}
+
+// input data is not modified, and still belongs to the caller
+// returned data must be freed by the caller; it was allocated with LOH_MALLOC
+// returns 0 if the data is corrupt, fails its checksum, or claims to decompress to more memory than can be allocated
+LOH_API uint8_t * loh_decompress_threaded(uint8_t * data, size_t len, size_t * out_len, uint8_t check_checksum)
+{
+    return loh_decompress_threaded_ex(data, len, out_len, check_checksum, 0, 0);
+}
+
+// for loh_test_threaded: thread n decodes chunks n, n + threads, n + threads * 2 and so on into its own buffer, and
+//  the threads take turns feeding their chunks to the checksum in order
+typedef struct {
+    const uint8_t * data;
+    uint64_t chunk_count;
+    size_t max_chunk;
+    size_t max_history;
+    uint16_t threads;
+    // one per thread: max_history bytes for the end of the previous chunk, then max_chunk bytes for the chunk
+    uint8_t ** buffers;
+    // per chunk: set once it's been decoded (or has failed), and once the chunk after it doesn't need its buffer anymore
+    uint8_t * decoded;
+    uint8_t * released;
+    // how many chunks have been fed to the checksum
+    uint64_t summed;
+    loh_checksum_state checksum;
+    int result;
+    uint64_t bad_chunk;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} loh_test_threaded_state;
+
+typedef struct {
+    loh_test_threaded_state * state;
+    uint16_t index;
+    uint64_t chunk;
+    // the buffer between stages comes from here, so it's only allocated once per thread rather than once per chunk
+    loh_arena arena;
+} loh_test_threaded_worker;
+
+static inline size_t loh_test_chunk_output_len(const loh_test_threaded_state * state, uint64_t chunk)
+{
+    const uint8_t * chunk_table = &state->data[16];
+    return loh_read_u64(&chunk_table[chunk * 16 + 24]) - loh_read_u64(&chunk_table[chunk * 16 + 8]);
+}
+
+// waits for the previous chunk to be decoded, then copies its end in front of this chunk's output
+static void loh_test_threaded_wait(void * _worker)
+{
+    loh_test_threaded_worker * worker = (loh_test_threaded_worker *)_worker;
+    loh_test_threaded_state * state = worker->state;
+    uint64_t prev = worker->chunk - 1;
+    pthread_mutex_lock(&state->mutex);
+    while (!state->decoded[prev])
+        pthread_cond_wait(&state->cond, &state->mutex);
+    pthread_mutex_unlock(&state->mutex);
+    
+    size_t prev_len = loh_test_chunk_output_len(state, prev);
+    size_t history = prev_len < state->max_history ? prev_len : state->max_history;
+    // with one thread, this is the same buffer, but nothing's been written over the previous chunk yet
+    const uint8_t * prev_out = &state->buffers[prev % state->threads][state->max_history];
+    memmove(&state->buffers[worker->index][state->max_history - history], &prev_out[prev_len - history], history);
+    
+    pthread_mutex_lock(&state->mutex);
+    state->released[worker->chunk] = 1;
+    pthread_cond_broadcast(&state->cond);
+    pthread_mutex_unlock(&state->mutex);
+}
+
+static void * loh_test_threaded_single(void * _worker)
+{
+    loh_test_threaded_worker * worker = (loh_test_threaded_worker *)_worker;
+    loh_test_threaded_state * state = worker->state;
+    const uint8_t * chunk_table = &state->data[16];
+    uint8_t * out = &state->buffers[worker->index][state->max_history];
+    for (uint64_t i = worker->index; i < state->chunk_count; i += state->threads)
+    {
+        worker->chunk = i;
+        pthread_mutex_lock(&state->mutex);
+        // this buffer still has chunk i - threads in it, which chunk i - threads + 1 might still need
+        while (state->threads > 1 && i >= state->threads && !state->released[i - state->threads + 1])
+            pthread_cond_wait(&state->cond, &state->mutex);
+        // once a chunk has failed, the rest are only gone through to keep the other threads moving
+        int failed = state->result != LOH_TEST_OK;
+        pthread_mutex_unlock(&state->mutex);
+        
+        size_t in_start = loh_read_u64(&chunk_table[i * 16]);
+        size_t chunk_len = loh_read_u64(&chunk_table[i * 16 + 16]) - in_start;
+        size_t chunk_output_len = loh_test_chunk_output_len(state, i);
+        size_t prev_len = i ? loh_test_chunk_output_len(state, i - 1) : 0;
+        size_t history = prev_len < state->max_history ? prev_len : state->max_history;
+        int error = failed ? 0 : loh_decompress_chunk(&state->data[in_start], chunk_len, out, chunk_output_len, history, loh_test_threaded_wait, worker, 0, &worker->arena.allocator);
+        
+        pthread_mutex_lock(&state->mutex);
+        state->decoded[i] = 1;
+        state->released[i] = 1;
+        if (error == 2 && state->result == LOH_TEST_OK)
+            state->result = LOH_TEST_NO_MEMORY;
+        // chunks can fail out of order, but the first one is the one reported
+        if (error == 1 && (state->result != LOH_TEST_BAD_CHUNK || i < state->bad_chunk))
+        {
+            state->result = LOH_TEST_BAD_CHUNK;
+            state->bad_chunk = i;
+        }
+        pthread_cond_broadcast(&state->cond);
+        while (state->summed < i)
+            pthread_cond_wait(&state->cond, &state->mutex);
+        failed = state->result != LOH_TEST_OK;
+        pthread_mutex_unlock(&state->mutex);
+        
+        if (!failed)
+            loh_checksum_update(&state->checksum, out, chunk_output_len);
+        
+        pthread_mutex_lock(&state->mutex);
+        state->summed = i + 1;
+        pthread_cond_broadcast(&state->cond);
+        pthread_mutex_unlock(&state->mutex);
+    }
+    return 0;
+}
+
+// threaded version of loh_test; decodes chunks on up to threads threads at once, each with one chunk's worth of memory
+LOH_API int loh_test_threaded(const uint8_t * data, size_t len, uint64_t * bad_chunk, uint16_t threads)
+{
+    loh_test_threaded_state state;
+    memset(&state, 0, sizeof(loh_test_threaded_state));
+    if (!loh_test_layout(data, len, &state.chunk_count, &state.max_chunk, &state.max_history))
+        return LOH_TEST_BAD_FILE;
+    if (state.max_chunk + state.max_history < state.max_chunk)
+        return LOH_TEST_NO_MEMORY;
+    
+    if (threads > state.chunk_count)
+        threads = state.chunk_count;
+    if (threads < 1)
+        threads = 1;
+    state.data = data;
+    state.threads = threads;
+    state.result = LOH_TEST_OK;
+    loh_checksum_begin(&state.checksum);
+    
+    state.buffers = (uint8_t **)LOH_MALLOC(sizeof(uint8_t *) * threads);
+    state.decoded = (uint8_t *)LOH_MALLOC(state.chunk_count + 1);
+    state.released = (uint8_t *)LOH_MALLOC(state.chunk_count + 1);
+    loh_test_threaded_worker * workers = (loh_test_threaded_worker *)LOH_MALLOC(sizeof(loh_test_threaded_worker) * threads);
+    pthread_t * thread_table = (pthread_t *)LOH_MALLOC(sizeof(pthread_t) * threads);
+    int ok = state.buffers && state.decoded && state.released && workers && thread_table;
+    for (uint16_t n = 0; ok && n < threads; n += 1)
+        state.buffers[n] = 0;
+    for (uint16_t n = 0; ok && n < threads; n += 1)
+    {
+        state.buffers[n] = (uint8_t *)LOH_MALLOC(state.max_history + state.max_chunk ? state.max_history + state.max_chunk : 1);
+        ok = state.buffers[n] != 0;
+    }
+    
+    int result = LOH_TEST_NO_MEMORY;
+    if (ok)
+    {
+        memset(state.decoded, 0, state.chunk_count + 1);
+        memset(state.released, 0, state.chunk_count + 1);
+        pthread_mutex_init(&state.mutex, 0);
+        pthread_cond_init(&state.cond, 0);
+        for (uint16_t n = 0; n < threads; n += 1)
+        {
+            workers[n].state = &state;
+            workers[n].index = n;
+            loh_arena_init(&workers[n].arena, 0, 0);
+            pthread_create(&thread_table[n], NULL, loh_test_threaded_single, &workers[n]);
+        }
+        for (uint16_t n = 0; n < threads; n += 1)
+        {
+            pthread_join(thread_table[n], 0);
+            loh_arena_release(&workers[n].arena);
+        }
+        pthread_mutex_destroy(&state.mutex);
+        pthread_cond_destroy(&state.cond);
+        
+        uint32_t stored_checksum = data[4]
+            | (((uint32_t)data[5]) << 8)
+            | (((uint32_t)data[6]) << 16)
+            | (((uint32_t)data[7]) << 24);
+        result = state.result;
+        if (result == LOH_TEST_OK && stored_checksum != 0 && loh_checksum_end(&state.checksum) != stored_checksum)
+            result = LOH_TEST_BAD_CHECKSUM;
+        if (result == LOH_TEST_BAD_CHUNK && bad_chunk)
+            *bad_chunk = state.bad_chunk;
+    }
+    
+    for (uint16_t n = 0; state.buffers && n < threads; n += 1)
+        LOH_FREE(state.buffers[n]);
+    LOH_FREE(state.buffers);
+    LOH_FREE(state.decoded);
+    LOH_FREE(state.released);
+    LOH_FREE(workers);
+    LOH_FREE(thread_table);
+    return result;
+}
+
+// archive members are handed out to worker threads one at a time, so big and small members can share the work evenly
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t next;
+    loh_archive_member * members;
+    size_t member_count;
+    const loh_params * params;
+    // one finished stream per member
+    loh_byte_buffer * streams;
+    int ok;
+} loh_archive_threaded_args;
+
+static void * loh_archive_threaded_worker(void * _args)
+{
+    loh_archive_threaded_args * args = (loh_archive_threaded_args *)_args;
+    loh_compress_scratch scratch;
+    memset(&scratch, 0, sizeof(loh_compress_scratch));
+    while (1)
+    {
+        pthread_mutex_lock(&args->mutex);
+        size_t i = args->next;
+        args->next += 1;
+        int ok = args->ok;
+        pthread_mutex_unlock(&args->mutex);
+        if (i >= args->member_count || !ok)
+            break;
+        
+        ok = _loh_compress_impl(args->members[i].data, args->members[i].len, args->params, &args->streams[i], &scratch);
+        if (!ok)
+        {
+            pthread_mutex_lock(&args->mutex);
+            args->ok = 0;
+            pthread_mutex_unlock(&args->mutex);
+        }
+    }
+    loh_compress_scratch_free(&scratch);
+    return 0;
+}
+
+// threaded version of loh_archive_build; members are compressed in parallel, each one on a single thread
+LOH_API uint8_t * loh_archive_build_threaded(loh_archive_member * members, size_t member_count, const loh_params * params, size_t * out_len, uint16_t threads)
+{
+    if ((!members && member_count) || !params || !out_len) return 0;
+    
+    if (threads < 1)
+        threads = 1;
+    if (threads > member_count)
+        threads = member_count ? member_count : 1;
+    
+    loh_byte_buffer buf = {0, 0, 0, 0, 0};
+    if (!loh_archive_begin(&buf, members, member_count))
+    {
+        LOH_FREE(buf.data);
+        return 0;
+    }
+    
+    loh_archive_threaded_args args;
+    args.next = 0;
+    args.members = members;
+    args.member_count = member_count;
+    args.params = params;
+    args.streams = (loh_byte_buffer *)LOH_MALLOC(sizeof(loh_byte_buffer) * (member_count + 1));
+    args.ok = 1;
+    pthread_t * thread_table = (pthread_t *)LOH_MALLOC(sizeof(pthread_t) * threads);
+    if (!args.streams || !thread_table)
+    {
+        LOH_FREE(buf.data);
+        LOH_FREE(args.streams);
+        LOH_FREE(thread_table);
+        return 0;
+    }
+    memset(args.streams, 0, sizeof(loh_byte_buffer) * (member_count + 1));
+    pthread_mutex_init(&args.mutex, 0);
+    
+    for (size_t i = 0; i < threads; i += 1)
+        pthread_create(&thread_table[i], NULL, loh_archive_threaded_worker, &args);
+    for (size_t i = 0; i < threads; i += 1)
+        pthread_join(thread_table[i], 0);
+    
+    int ok = args.ok;
+    for (size_t i = 0; i < member_count; i += 1)
+    {
+        if (ok)
+        {
+            size_t start = buf.len;
+            bytes_push(&buf, args.streams[i].data, args.streams[i].len);
+            ok = buf.data != 0;
+            if (ok)
+                loh_archive_set_stream(&buf, i, start, args.streams[i].len);
+        }
+        LOH_FREE(args.streams[i].data);
+    }
+    
+    pthread_mutex_destroy(&args.mutex);
+    LOH_FREE(args.streams);
+    LOH_FREE(thread_table);
+    
+    if (!ok)
+    {
+        LOH_FREE(buf.data);
         return 0;
     }
+    
+    *out_len = buf.len;
+    return buf.data;
 }
 
 #endif // LOH_IMPL_THREADED_HEADER